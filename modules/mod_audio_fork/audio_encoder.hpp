@@ -0,0 +1,218 @@
+#ifndef __AUDIO_ENCODER_HPP__
+#define __AUDIO_ENCODER_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <strings.h>
+#include <opus/opus.h>
+
+/**
+ * compresses the linear audio of a fork before it is queued to its AudioPipe.
+ *
+ * G.711 is a byte per sample and is passed on as it is produced.  Opus runs in hard CBR mode, so every
+ * packet is exactly frameBytes() long: the binary stream is then a plain concatenation of packets that the
+ * far end can split without any framing, the same way it splits L16 into samples, and AudioPipe's
+ * drop-oldest and flush logic, which work in whole frames, never cut a packet in two.
+ */
+class AudioEncoder {
+public:
+  enum Encoding_t {
+    L16,
+    PCMU,
+    PCMA,
+    OPUS
+  };
+
+  static bool parseEncoding(const char* name, Encoding_t& encoding) {
+    if (0 == strcasecmp(name, "L16") || 0 == strcasecmp(name, "linear16")) encoding = L16;
+    else if (0 == strcasecmp(name, "PCMU") || 0 == strcasecmp(name, "mulaw")) encoding = PCMU;
+    else if (0 == strcasecmp(name, "PCMA") || 0 == strcasecmp(name, "alaw")) encoding = PCMA;
+    else if (0 == strcasecmp(name, "OPUS")) encoding = OPUS;
+    else return false;
+    return true;
+  }
+  static const char* encodingName(Encoding_t encoding) {
+    switch (encoding) {
+      case PCMU: return "pcmu";
+      case PCMA: return "pcma";
+      case OPUS: return "opus";
+      default: return "l16";
+    }
+  }
+
+  AudioEncoder(Encoding_t encoding, unsigned int sampleRate, unsigned int channels, unsigned int frameMs, unsigned int bitrate) :
+    m_encoding(encoding), m_sampleRate(sampleRate), m_channels(channels), m_frameMs(frameMs), m_bitrate(bitrate),
+    m_opus(nullptr), m_staged(0) {
+    m_frameSamples = sampleRate * frameMs / 1000;
+    if (OPUS == encoding) m_frameBytes = bitrate / 8 * frameMs / 1000;
+    else if (L16 == encoding) m_frameBytes = m_frameSamples * channels * sizeof(int16_t);
+    else m_frameBytes = m_frameSamples * channels;
+  }
+  ~AudioEncoder() {
+    if (m_opus) opus_encoder_destroy(m_opus);
+  }
+
+  // returns false, with a reason, if the encoder cannot be used with this format
+  bool init(std::string& err) {
+    if (OPUS != m_encoding) return true;
+
+    if (m_sampleRate != 8000 && m_sampleRate != 12000 && m_sampleRate != 16000 && m_sampleRate != 24000 && m_sampleRate != 48000) {
+      err = "opus supports sampling rates of 8000, 12000, 16000, 24000 and 48000 only";
+      return false;
+    }
+    if (m_frameMs != 10 && m_frameMs != 20 && m_frameMs != 40 && m_frameMs != 60) {
+      err = "opus frame duration must be 10, 20, 40 or 60 ms";
+      return false;
+    }
+
+    int error = OPUS_OK;
+    m_opus = opus_encoder_create(m_sampleRate, m_channels, OPUS_APPLICATION_VOIP, &error);
+    if (OPUS_OK != error || !m_opus) {
+      err = opus_strerror(error);
+      return false;
+    }
+    opus_encoder_ctl(m_opus, OPUS_SET_BITRATE(m_bitrate));
+    opus_encoder_ctl(m_opus, OPUS_SET_VBR(0));
+    opus_encoder_ctl(m_opus, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+    m_stage.resize(m_frameSamples * m_channels);
+    m_packet.resize(m_frameBytes);
+    return true;
+  }
+
+  void setComplexity(int complexity) {
+    if (m_opus) opus_encoder_ctl(m_opus, OPUS_SET_COMPLEXITY(std::max(0, std::min(complexity, 10))));
+  }
+
+  Encoding_t encoding(void) const {
+    return m_encoding;
+  }
+  const char* name(void) const {
+    return encodingName(m_encoding);
+  }
+  unsigned int frameMs(void) const {
+    return m_frameMs;
+  }
+  // bytes of encoded output per frame
+  size_t frameBytes(void) const {
+    return m_frameBytes;
+  }
+  unsigned int bitrate(void) const {
+    return OPUS == m_encoding ? m_bitrate : m_sampleRate * m_channels * (L16 == m_encoding ? 16 : 8);
+  }
+
+  /**
+   * encode samples (per channel) of interleaved linear audio, handing the output to write(data, len);
+   * Opus output is only produced a whole packet at a time.  Returns the sum of what write returns.
+   */
+  template <typename Writer>
+  size_t encode(const int16_t* pcm, size_t samples, Writer write) {
+    size_t ret = 0;
+    size_t total = samples * m_channels;
+
+    switch (m_encoding) {
+      case PCMU:
+      case PCMA:
+      {
+        const uint8_t* table = PCMU == m_encoding ? ulawTable() : alawTable();
+        uint8_t out[1024];
+        while (total > 0) {
+          size_t n = std::min(total, sizeof(out));
+          for (size_t i = 0; i < n; i++) out[i] = table[(uint16_t) pcm[i]];
+          ret += write(out, n);
+          pcm += n;
+          total -= n;
+        }
+      }
+      break;
+
+      case OPUS:
+        while (total > 0) {
+          size_t n = std::min(total, m_stage.size() - m_staged);
+          memcpy(&m_stage[m_staged], pcm, n * sizeof(int16_t));
+          m_staged += n;
+          pcm += n;
+          total -= n;
+          if (m_staged < m_stage.size()) break;
+
+          m_staged = 0;
+          int len = opus_encode(m_opus, &m_stage[0], m_frameSamples, &m_packet[0], m_frameBytes);
+          if (len <= 0) continue;
+          // CBR output is normally exactly the target size already; pad, should it ever come up short
+          if (len < (int) m_frameBytes && OPUS_OK != opus_packet_pad(&m_packet[0], len, m_frameBytes)) continue;
+          ret += write(&m_packet[0], m_frameBytes);
+        }
+      break;
+
+      default:
+        ret += write((const uint8_t *) pcm, total * sizeof(int16_t));
+      break;
+    }
+    return ret;
+  }
+
+  // no default constructor or copying
+  AudioEncoder() = delete;
+  AudioEncoder(const AudioEncoder&) = delete;
+  void operator=(const AudioEncoder&) = delete;
+
+private:
+  // G.711 is done by table lookup, indexed by the 16 bit sample; the tables are built once per process
+  static const uint8_t* ulawTable(void) {
+    static const std::vector<uint8_t> table = buildTable(linearToUlaw);
+    return table.data();
+  }
+  static const uint8_t* alawTable(void) {
+    static const std::vector<uint8_t> table = buildTable(linearToAlaw);
+    return table.data();
+  }
+  static std::vector<uint8_t> buildTable(uint8_t (*encode)(int)) {
+    std::vector<uint8_t> table(65536);
+    for (int i = 0; i < 65536; i++) table[i] = encode((int16_t) (uint16_t) i);
+    return table;
+  }
+
+  static uint8_t linearToUlaw(int sample) {
+    int sign = sample < 0 ? 0x80 : 0;
+    if (sign) sample = -sample;
+    sample = std::min(sample, 32635) + 0x84;
+
+    int exponent = 7;
+    for (int mask = 0x4000; !(sample & mask) && exponent > 0; mask >>= 1) exponent--;
+    int mantissa = (sample >> (exponent + 3)) & 0x0F;
+    return (uint8_t) ~(sign | (exponent << 4) | mantissa);
+  }
+
+  static uint8_t linearToAlaw(int sample) {
+    int mask = 0xD5;
+    sample >>= 3;
+    if (sample < 0) {
+      mask = 0x55;
+      sample = -sample - 1;
+    }
+
+    int segment = 0;
+    while (segment < 8 && sample >= (0x20 << segment)) segment++;
+    if (segment >= 8) return (uint8_t) (0x7F ^ mask);
+    int aval = segment << 4;
+    aval |= (segment < 2 ? sample >> 1 : sample >> segment) & 0x0F;
+    return (uint8_t) (aval ^ mask);
+  }
+
+  Encoding_t m_encoding;
+  unsigned int m_sampleRate;
+  unsigned int m_channels;
+  unsigned int m_frameMs;
+  unsigned int m_bitrate;
+  unsigned int m_frameSamples;    // per channel
+  size_t m_frameBytes;
+  OpusEncoder* m_opus;
+  std::vector<int16_t> m_stage;   // linear audio waiting for a full Opus frame
+  size_t m_staged;
+  std::vector<uint8_t> m_packet;
+};
+
+#endif
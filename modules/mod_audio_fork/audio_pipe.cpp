@@ -2,10 +2,37 @@
 
 #include <cassert>
 #include <iostream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 /* discard incoming text messages over the socket that are longer than this */
 #define MAX_RECV_BUF_SIZE (65 * 1024 * 10)
-#define RECV_BUF_REALLOC_SIZE (8 * 1024)
+
+/* largest binary frame we will send in one lws_write */
+#define MAX_AUDIO_WRITE_LEN (64 * 1024)
+
+/* granularity of the per-context timer used by pipes in flush-tick mode */
+#define FLUSH_TICK_MS (20)
+
+/* when choosing a context, each pipe counts as this much load on top of the measured bytes/sec (8 kHz mono L16) */
+#define LOAD_BYTES_PER_PIPE (16000)
+
+/* ceiling for the exponential backoff between reconnect attempts */
+#define MAX_RECONNECT_BACKOFF_MS (30000)
+
+/* threads doing blocking name lookups on behalf of the service threads */
+#define DNS_RESOLVER_THREADS (2)
+
+/* optional header in front of the audio in each binary frame; see writeFrameHeader */
+#define FRAME_HEADER_VERSION (1)
+#define FRAME_HEADER_LEN (28)
 
 
 namespace {
@@ -14,6 +41,26 @@ namespace {
 
   static const char *requestedTcpKeepaliveSecs = std::getenv("MOD_AUDIO_FORK_TCP_KEEPALIVE_SECS");
   static int nTcpKeepaliveSecs = requestedTcpKeepaliveSecs ? ::atoi(requestedTcpKeepaliveSecs) : 55;
+
+  static const char *requestedTlsSessionCacheSize = std::getenv("MOD_AUDIO_FORK_TLS_SESSION_CACHE_SIZE");
+  static int nTlsSessionCacheSize = std::max(0, requestedTlsSessionCacheSize ? ::atoi(requestedTlsSessionCacheSize) : 256);
+
+  static const char *requestedPoolSize = std::getenv("MOD_AUDIO_FORK_POOL_SIZE");
+  static unsigned int nPoolSize = std::max(0, requestedPoolSize ? ::atoi(requestedPoolSize) : 0);
+  static const char *requestedPoolIdleSecs = std::getenv("MOD_AUDIO_FORK_POOL_IDLE_SECS");
+  static int nPoolIdleSecs = std::max(1, requestedPoolIdleSecs ? ::atoi(requestedPoolIdleSecs) : 30);
+  static const char *requestedPoolMaxPerHost = std::getenv("MOD_AUDIO_FORK_POOL_MAX_PER_HOST");
+  static unsigned int nPoolMaxPerHost = std::max(0, requestedPoolMaxPerHost ? ::atoi(requestedPoolMaxPerHost) : 32);
+
+  static const char *requestedDnsNegativeTtlSecs = std::getenv("MOD_AUDIO_FORK_DNS_NEGATIVE_TTL_SECS");
+  static unsigned int nDnsNegativeTtlSecs = std::max(0, requestedDnsNegativeTtlSecs ? ::atoi(requestedDnsNegativeTtlSecs) : 5);
+  static const char *requestedDnsMaxTtlSecs = std::getenv("MOD_AUDIO_FORK_DNS_MAX_TTL_SECS");
+  static unsigned int nDnsMaxTtlSecs = std::max(1, requestedDnsMaxTtlSecs ? ::atoi(requestedDnsMaxTtlSecs) : 300);
+
+  static const char *requestedHealthCheckSecs = std::getenv("MOD_AUDIO_FORK_HEALTH_CHECK_SECS");
+  static unsigned int nHealthCheckSecs = std::max(0, requestedHealthCheckSecs ? ::atoi(requestedHealthCheckSecs) : 5);
+  static const char *requestedHealthCheckTimeoutMs = std::getenv("MOD_AUDIO_FORK_HEALTH_CHECK_TIMEOUT_MS");
+  static unsigned int nHealthCheckTimeoutMs = std::max(1, requestedHealthCheckTimeoutMs ? ::atoi(requestedHealthCheckTimeoutMs) : 1000);
 }
 
 // remove once we update to lws with this helper
@@ -71,18 +118,24 @@ int AudioPipe::lws_callback(struct lws *wsi,
       break;
 
     case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
-      processPendingConnects(vhd);
-      processPendingDisconnects(vhd);
-      processPendingWrites();
+      {
+        // only pipes owned by this context are ever queued to it
+        ServiceContext* ctx = static_cast<ServiceContext*>(lws_context_user(vhd->context));
+        processPendingConnects(ctx, vhd);
+        processPendingDisconnects(ctx);
+        processPendingWrites(ctx);
+        processSpoolSignals(ctx);
+      }
       break;
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
       {
-        AudioPipe* ap = findAndRemovePendingConnect(wsi);
+        AudioPipe* ap = findPendingConnect(wsi);
         int rc = lws_http_client_http_response(wsi);
         lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR: %s, response status %d\n", in ? (char *)in : "(null)", rc); 
         if (ap) {
-          ap->m_state = LWS_CLIENT_FAILED;
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECT_FAIL, (char *) in);
+          // reported from inside lws_client_connect_via_info: connect_client deals with it once that returns
+          if (ap->m_connectingInline) break;
+          connectFailed(ap, in ? (char *) in : "connection error");
         }
         else {
           lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR unable to find wsi %p..\n", wsi); 
@@ -92,12 +145,41 @@ int AudioPipe::lws_callback(struct lws *wsi,
 
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
       {
-        AudioPipe* ap = findAndRemovePendingConnect(wsi);
+        AudioPipe* ap = findPendingConnect(wsi);
         if (ap) {
           *ppAp = ap;
           ap->m_vhd = vhd;
           ap->m_state = LWS_CLIENT_CONNECTED;
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECT_SUCCESS, NULL);
+          if (ap->m_sslFlags & LCCSCF_USE_SSL) tlsSessions.established(wsi, ap->m_address.c_str(), ap->m_port);
+          ap->countEstablished(wsi);
+          if (!ap->m_endpoints.empty()) balancer.connected(ap->endpointKey());
+          if (ap->m_warm) {
+            warmEstablished(ap);
+            break;
+          }
+          if (ap->m_flushIntervalMs > 0) addFlushPipe(ap);
+          ap->openSpool();
+          ap->startPing();
+          ap->m_dropReason = nullptr;
+          unsigned int attempt = ap->m_reconnectAttempt.exchange(0);
+          bool first = !ap->m_established;
+          ap->m_established = true;
+          if (attempt > 0 && ap->m_closeRequested) {
+            // closed while we were reconnecting; a spooling pipe sends what it has kept first, as close() would have
+            if (ap->m_spool) spoolCond.notify_one();
+            else addPendingDisconnect(ap);
+          }
+          else if (first) {
+            // a spooling pipe may have taken a few attempts to get here
+            ap->notify(AudioPipe::CONNECT_SUCCESS, NULL, 0);
+          }
+          else {
+            char msg[64];
+            lwsl_notice("%s reconnected on attempt %u\n", ap->m_uuid.c_str(), attempt);
+            snprintf(msg, sizeof(msg), "{\"attempt\":%u}", attempt);
+            ap->notify(AudioPipe::RECONNECTED, msg, strlen(msg));
+            ap->queueReplay();
+          }
         }
         else {
           lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_ESTABLISHED %s unable to find wsi %p..\n", ap->m_uuid.c_str(), wsi); 
@@ -111,22 +193,32 @@ int AudioPipe::lws_callback(struct lws *wsi,
           lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CLOSED %s unable to find wsi %p..\n", ap->m_uuid.c_str(), wsi); 
           return 0;
         }
+        *ppAp = NULL;
+        ap->stopPing();
+        ap->m_spoolOpen = false;
         if (ap->m_state == LWS_CLIENT_DISCONNECTING) {
           // closed by us
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL);
+          ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
         }
         else if (ap->m_state == LWS_CLIENT_CONNECTED) {
-          // closed by far end
-          lwsl_notice("%s socket closed by far end\n", ap->m_uuid.c_str());
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECTION_DROPPED, NULL);
+          // closed by far end, or taken down by us for not answering pings
+          lwsl_notice("%s socket closed: %s\n", ap->m_uuid.c_str(), ap->m_dropReason ? ap->m_dropReason : "by far end");
+
+          // keep the pipe, and the audio still queued in it, if we are going to reconnect
+          ap->m_wsi = nullptr;
+          removeFlushPipe(ap);
+          if (ap->m_recv_buf) {
+            ap->m_ctx->recvPool.release(ap->m_recv_buf, ap->m_recv_buf_len);
+            ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
+          }
+          if (ap->scheduleReconnect(ap->m_dropReason)) break;
+
+          ap->notify(AudioPipe::CONNECTION_DROPPED, ap->m_dropReason, ap->m_dropReason ? strlen(ap->m_dropReason) : 0);
         }
-        ap->m_state = LWS_CLIENT_DISCONNECTED;
 
         //NB: after receiving any of the events above, any holder of a 
         //pointer or reference to this object must treat is as no longer valid
-
-        *ppAp = NULL;
-        delete ap;
+        retire(ap);
       }
       break;
 
@@ -139,56 +231,68 @@ int AudioPipe::lws_callback(struct lws *wsi,
         }
 
         if (lws_frame_is_binary(wsi)) {
-          lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE received binary frame, discarding.\n");
+          if (ap->m_playback) ap->m_playback->write((const uint8_t *) in, len);
+          else lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE received binary frame, discarding.\n");
           return 0;
         }
 
+        BufferPool& pool = ap->m_ctx->recvPool;
         if (lws_is_first_fragment(wsi)) {
-          // allocate a buffer for the entire chunk of memory needed
+          // take a pooled buffer big enough for this frame plus a terminating NUL so it can be parsed in place
           assert(nullptr == ap->m_recv_buf);
-          ap->m_recv_buf_len = len + lws_remaining_packet_payload(wsi);
-          ap->m_recv_buf = (uint8_t*) malloc(ap->m_recv_buf_len);
+          size_t needed = len + lws_remaining_packet_payload(wsi) + 1;
+          ap->m_recv_buf = needed <= MAX_RECV_BUF_SIZE ? pool.acquire(needed, ap->m_recv_buf_len) : nullptr;
           ap->m_recv_buf_ptr = ap->m_recv_buf;
-        }
-
-        size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
-        size_t remaining_space = ap->m_recv_buf_len - write_offset;
-        if (remaining_space < len) {
-          lwsl_notice("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE buffer realloc needed.\n");
-          size_t newlen = ap->m_recv_buf_len + RECV_BUF_REALLOC_SIZE;
-          if (newlen > MAX_RECV_BUF_SIZE) {
-            free(ap->m_recv_buf);
-            ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-            ap->m_recv_buf_len = 0;
+          if (nullptr == ap->m_recv_buf) {
             lwsl_notice("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
           }
-          else {
-            ap->m_recv_buf = (uint8_t*) realloc(ap->m_recv_buf, newlen);
-            if (nullptr != ap->m_recv_buf) {
-              ap->m_recv_buf_len = newlen;
-              ap->m_recv_buf_ptr = ap->m_recv_buf + write_offset;
-            }
-          }
         }
 
         if (nullptr != ap->m_recv_buf) {
-          if (len > 0) {
-            memcpy(ap->m_recv_buf_ptr, in, len);
-            ap->m_recv_buf_ptr += len;
-          }
-          if (lws_is_final_fragment(wsi)) {
-            if (nullptr != ap->m_recv_buf) {
-              std::string msg((char *)ap->m_recv_buf, ap->m_recv_buf_ptr - ap->m_recv_buf);
-              ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::MESSAGE, msg.c_str());
-              if (nullptr != ap->m_recv_buf) free(ap->m_recv_buf);
+          size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
+          if (ap->m_recv_buf_len - write_offset < len + 1) {
+            // message continues in further fragments: move up to the next slab class that fits
+            size_t newlen = 0;
+            uint8_t* newbuf = nullptr;
+            size_t needed = write_offset + len + lws_remaining_packet_payload(wsi) + 1;
+            if (needed <= MAX_RECV_BUF_SIZE) newbuf = pool.acquire(needed, newlen);
+            if (nullptr == newbuf) {
+              lwsl_notice("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
             }
-            ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-            ap->m_recv_buf_len = 0;
+            else {
+              memcpy(newbuf, ap->m_recv_buf, write_offset);
+            }
+            pool.release(ap->m_recv_buf, ap->m_recv_buf_len);
+            ap->m_recv_buf = newbuf;
+            ap->m_recv_buf_ptr = newbuf ? newbuf + write_offset : nullptr;
+            ap->m_recv_buf_len = newlen;
+          }
+        }
+
+        if (nullptr != ap->m_recv_buf && len > 0) {
+          memcpy(ap->m_recv_buf_ptr, in, len);
+          ap->m_recv_buf_ptr += len;
+        }
+        if (lws_is_final_fragment(wsi)) {
+          if (nullptr != ap->m_recv_buf) {
+            size_t msglen = ap->m_recv_buf_ptr - ap->m_recv_buf;
+            *ap->m_recv_buf_ptr = '\0';
+            ap->notify(AudioPipe::MESSAGE, (char *) ap->m_recv_buf, msglen);
+            pool.release(ap->m_recv_buf, ap->m_recv_buf_len);
           }
+          ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
+          ap->m_recv_buf_len = 0;
         }
       }
       break;
 
+    case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
+      {
+        AudioPipe* ap = *ppAp;
+        if (ap) ap->pongReceived(in, len);
+      }
+      break;
+
     case LWS_CALLBACK_CLIENT_WRITEABLE:
       {
         AudioPipe* ap = *ppAp;
@@ -197,53 +301,26 @@ int AudioPipe::lws_callback(struct lws *wsi,
           return 0;
         }
 
-        // check for graceful close - send a zero length binary frame
-        if (ap->isGracefulShutdown()) {
-          lwsl_notice("%s graceful shutdown - sending zero length binary frame to flush any final responses\n", ap->m_uuid.c_str());
-          std::lock_guard<std::mutex> lk(ap->m_audio_mutex);
-          int sent = lws_write(wsi, (unsigned char *) ap->m_audio_buffer + LWS_PRE, 0, LWS_WRITE_BINARY);
+        // a keepalive ping goes ahead of everything else, in a writeable callback of its own
+        if (ap->m_pingPending && ap->m_state == LWS_CLIENT_CONNECTED) {
+          if (ap->writePing(wsi) < 0) return -1;
+          lws_callback_on_writable(wsi);
           return 0;
         }
 
-        // check for text frames to send
-        {
-          std::lock_guard<std::mutex> lk(ap->m_text_mutex);
-          if (ap->m_metadata.length() > 0) {
-            uint8_t buf[ap->m_metadata.length() + LWS_PRE];
-            memcpy(buf + LWS_PRE, ap->m_metadata.c_str(), ap->m_metadata.length());
-            int n = ap->m_metadata.length();
-            int m = lws_write(wsi, buf + LWS_PRE, n, LWS_WRITE_TEXT);
-            ap->m_metadata.clear();
-            if (m < n) {
-              return -1;
-            }
-
-            // there may be audio data, but only one write per writeable event
-            // get it next time
-            lws_callback_on_writable(wsi);
+        if (ap->m_isCarrier) return carrierWriteable(ap, wsi);
 
-            return 0;
-          }
+        // check for graceful close - send a zero length binary frame
+        if (ap->isGracefulShutdown()) {
+          lwsl_notice("%s graceful shutdown - sending zero length binary frame to flush any final responses\n", ap->m_uuid.c_str());
+          int sent = lws_write(wsi, (unsigned char *) ap->m_send_buf + LWS_PRE, 0, LWS_WRITE_BINARY);
+          return 0;
         }
 
-        if (ap->m_state == LWS_CLIENT_DISCONNECTING) {
-          lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
-          return -1;
-        }
+        if (ap->writeQueued(wsi) < 0) return -1;
 
-        // check for audio packets
-        {
-          std::lock_guard<std::mutex> lk(ap->m_audio_mutex);
-          if (ap->m_audio_buffer_write_offset > LWS_PRE) {
-            size_t datalen = ap->m_audio_buffer_write_offset - LWS_PRE;
-            int sent = lws_write(wsi, (unsigned char *) ap->m_audio_buffer + LWS_PRE, datalen, LWS_WRITE_BINARY);
-            if (sent < datalen) {
-              lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_WRITEABLE %s attemped to send %lu only sent %d wsi %p..\n", 
-                ap->m_uuid.c_str(), datalen, sent, wsi); 
-            }
-            ap->m_audio_buffer_write_offset = LWS_PRE;
-          }
-        }
+        // choked with more to send: come back when the socket drains
+        if (ap->hasQueued()) lws_callback_on_writable(wsi);
 
         return 0;
       }
@@ -257,6 +334,7 @@ int AudioPipe::lws_callback(struct lws *wsi,
 
 
 // static members
+// lws's own validity pings are left off: pipes that want keepalive pings send and time them themselves (see pingTick)
 static const lws_retry_bo_t retry = {
     nullptr,   // retry_ms_table
     0,         // retry_ms_table_count
@@ -266,133 +344,1064 @@ static const lws_retry_bo_t retry = {
     0          // jitter_percent
 };
 
-struct lws_context *AudioPipe::contexts[] = {
-  nullptr, nullptr, nullptr, nullptr, nullptr,
-  nullptr, nullptr, nullptr, nullptr, nullptr
-};
+AudioPipe::ServiceContext* AudioPipe::contexts = nullptr;
 unsigned int AudioPipe::numContexts = 0;
-unsigned int AudioPipe::nchild = 0;
+bool AudioPipe::pinServiceThreads = false;
+std::mutex AudioPipe::mutex_affinity;
+std::unordered_map<std::string, std::pair<AudioPipe::ServiceContext*, unsigned int> > AudioPipe::sessionContexts;
 std::string AudioPipe::protocolName;
-std::mutex AudioPipe::mutex_connects;
-std::mutex AudioPipe::mutex_disconnects;
-std::mutex AudioPipe::mutex_writes;
-std::list<AudioPipe*> AudioPipe::pendingConnects;
-std::list<AudioPipe*> AudioPipe::pendingDisconnects;
-std::list<AudioPipe*> AudioPipe::pendingWrites;
 AudioPipe::log_emit_function AudioPipe::logger;
+TlsSessionCache AudioPipe::tlsSessions(nTlsSessionCacheSize);
+DnsCache AudioPipe::dnsCache(nDnsNegativeTtlSecs, nDnsMaxTtlSecs);
+EndpointBalancer AudioPipe::balancer;
+std::mutex AudioPipe::poolMutex;
+std::unordered_map<std::string, AudioPipe::WarmPool> AudioPipe::warmPools;
+std::unordered_map<std::string, unsigned int> AudioPipe::warmPerHost;
+std::mutex AudioPipe::muxMutex;
+std::unordered_map<std::string, AudioPipe*> AudioPipe::carriers;
+std::mutex AudioPipe::spoolMutex;
+std::condition_variable AudioPipe::spoolCond;
+std::list<AudioPipe*> AudioPipe::spoolPipes;
+std::thread AudioPipe::spoolThread;
+bool AudioPipe::spoolStop = false;
+std::mutex AudioPipe::shmMutex;
+std::list<AudioPipe*> AudioPipe::shmConnects;
+std::thread AudioPipe::shmThread;
+int AudioPipe::shmEpoll = -1;
+int AudioPipe::shmWake = -1;
+bool AudioPipe::shmStop = false;
 std::mutex AudioPipe::mapMutex;
 std::unordered_map<std::thread::id, bool> AudioPipe::stopFlags;
 std::queue<std::thread::id> AudioPipe::threadIds;
 
-void AudioPipe::processPendingConnects(lws_per_vhost_data *vhd) {
-  std::list<AudioPipe*> connects;
-  {
-    std::lock_guard<std::mutex> guard(mutex_connects);
-    for (auto it = pendingConnects.begin(); it != pendingConnects.end(); ++it) {
-      if ((*it)->m_state == LWS_CLIENT_IDLE) {
-        connects.push_back(*it);
-        (*it)->m_state = LWS_CLIENT_CONNECTING;
+// lock-free push onto the owning context's queue; returns false if the pipe was already queued there
+bool AudioPipe::enqueuePending(AudioPipe* ap, PendingQueue_t queue) {
+  if (ap->m_pending[queue].exchange(true, std::memory_order_acq_rel)) return false;
+
+  std::atomic<AudioPipe*>& head = ap->m_ctx->pending[queue];
+  AudioPipe* next = head.load(std::memory_order_relaxed);
+  do {
+    ap->m_pending_next[queue] = next;
+  } while (!head.compare_exchange_weak(next, ap, std::memory_order_release, std::memory_order_relaxed));
+  return true;
+}
+
+// service thread only: take everything queued so far, returned oldest first
+AudioPipe* AudioPipe::dequeueAllPending(ServiceContext* ctx, PendingQueue_t queue) {
+  AudioPipe* ap = ctx->pending[queue].exchange(nullptr, std::memory_order_acquire);
+  AudioPipe* fifo = nullptr;
+  while (ap) {
+    AudioPipe* next = ap->m_pending_next[queue];
+    ap->m_pending_next[queue] = fifo;
+    fifo = ap;
+    ap = next;
+  }
+  return fifo;
+}
+
+void AudioPipe::processPendingConnects(ServiceContext* ctx, lws_per_vhost_data *vhd) {
+  AudioPipe* ap = dequeueAllPending(ctx, PENDING_CONNECT);
+  while (ap) {
+    AudioPipe* next = ap->m_pending_next[PENDING_CONNECT];
+    ap->m_pending[PENDING_CONNECT].exchange(false, std::memory_order_acq_rel);
+    if (ap->m_retired) {}
+    else if (ap->m_multiplex) attachStream(ap);
+    else if (ap->m_adopt) adoptWarm(ap, ap->m_adopt, vhd);
+    else if (ap->m_resolving) {
+      // the name lookup finished; connect_client will now find the answer in the cache
+      ap->m_resolving = false;
+      if (ap->m_closeRequested) {
+        ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
+        retire(ap);
+      }
+      else ap->connect_client(vhd);
+    }
+    else if (ap->m_state == LWS_CLIENT_IDLE) ap->connect_client(vhd);
+    ap = next;
+  }
+}
+
+void AudioPipe::processPendingDisconnects(ServiceContext* ctx) {
+  AudioPipe* ap = dequeueAllPending(ctx, PENDING_DISCONNECT);
+  while (ap) {
+    AudioPipe* next = ap->m_pending_next[PENDING_DISCONNECT];
+    ap->m_pending[PENDING_DISCONNECT].exchange(false, std::memory_order_acq_rel);
+    if (ap->m_retired) {}
+    else if (ap->m_multiplex) {
+      // a stream leaves its connection once its queued text has gone out; one not attached yet leaves when it attaches
+      if (!ap->m_attached || ap->m_state == LWS_CLIENT_DISCONNECTING) {}
+      else if (ap->m_state == LWS_CLIENT_CONNECTED) {
+        ap->m_state = LWS_CLIENT_DISCONNECTING;
+        lws_callback_on_writable(ap->m_wsi);
+      }
+      else {
+        ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
+        leaveCarrier(ap);
+        retire(ap);
+      }
+    }
+    else if (ap->m_resolving) {
+      // dnsCache still holds a pointer to this pipe; it is retired once the lookup comes back
+    }
+    else if (ap->m_reconnectAttempt > 0 && nullptr == ap->m_wsi) {
+      // closed while waiting out a reconnect backoff; audio still spooled keeps the retries going until it is sent
+      if (!ap->hasSpooled()) {
+        ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
+        retire(ap);
       }
     }
+    else if (ap->m_state == LWS_CLIENT_DISCONNECTING) lws_callback_on_writable(ap->m_wsi);
+    ap = next;
   }
-  for (auto it = connects.begin(); it != connects.end(); ++it) {
+}
+
+void AudioPipe::processPendingWrites(ServiceContext* ctx) {
+  AudioPipe* ap = dequeueAllPending(ctx, PENDING_WRITE);
+  while (ap) {
+    AudioPipe* next = ap->m_pending_next[PENDING_WRITE];
+    // clear before requesting the write so that anything queued after this point wakes us again
+    ap->m_pending[PENDING_WRITE].exchange(false, std::memory_order_acq_rel);
+    if (!ap->m_retired && ap->m_state == LWS_CLIENT_CONNECTED) lws_callback_on_writable(ap->m_wsi);
+    ap = next;
+  }
+}
+
+// service thread only: act on whatever the spool drainer has flagged.  The drainer never queues a pipe or changes
+// its state itself, since the pipe may be retired at any moment on this thread
+void AudioPipe::processSpoolSignals(ServiceContext* ctx) {
+  if (!ctx->spoolSignalled.exchange(false, std::memory_order_acq_rel)) return;
+  for (auto it = ctx->spoolPipes.begin(); it != ctx->spoolPipes.end(); ++it) {
     AudioPipe* ap = *it;
-    ap->connect_client(vhd);   
+    bool moved = ap->m_spoolMoved.exchange(false, std::memory_order_acq_rel);
+    bool done = ap->m_spoolDone.exchange(false, std::memory_order_acq_rel);
+
+    // if the connection has dropped meanwhile, the drainer closes the next one once it has sent the rest
+    if (ap->m_state != LWS_CLIENT_CONNECTED) continue;
+    if (done) {
+      ap->m_state = LWS_CLIENT_DISCONNECTING;
+      lws_callback_on_writable(ap->m_wsi);
+    }
+    // in flush-tick mode the next tick collects the audio
+    else if (moved && 0 == ap->m_flushIntervalMs) lws_callback_on_writable(ap->m_wsi);
   }
 }
 
-void AudioPipe::processPendingDisconnects(lws_per_vhost_data *vhd) {
-  std::list<AudioPipe*> disconnects;
-  {
-    std::lock_guard<std::mutex> guard(mutex_disconnects);
-    for (auto it = pendingDisconnects.begin(); it != pendingDisconnects.end(); ++it) {
-      if ((*it)->m_state == LWS_CLIENT_DISCONNECTING) disconnects.push_back(*it);
+// service thread only: wake once per tick for the whole context and request writes for pipes whose interval is up
+void AudioPipe::flushTick(lws_sorted_usec_list_t *sul) {
+  ServiceContext* ctx = lws_container_of(sul, ContextTimer, sul)->ctx;
+  lws_usec_t now = lws_now_usecs();
+
+  for (auto it = ctx->flushPipes.begin(); it != ctx->flushPipes.end(); ++it) {
+    AudioPipe* ap = *it;
+    if (now < ap->m_nextFlush) continue;
+    ap->m_nextFlush = now + ap->m_flushIntervalMs * LWS_US_PER_MS;
+    if (ap->m_state == LWS_CLIENT_CONNECTED && !ap->m_audio_ring.empty()) lws_callback_on_writable(ap->m_wsi);
+  }
+
+  if (!ctx->flushPipes.empty()) {
+    lws_sul_schedule(ctx->context, 0, &ctx->flushTimer.sul, flushTick, FLUSH_TICK_MS * LWS_US_PER_MS);
+  }
+}
+
+void AudioPipe::addFlushPipe(AudioPipe* ap) {
+  ServiceContext* ctx = ap->m_ctx;
+  bool idle = ctx->flushPipes.empty();
+  ap->m_nextFlush = lws_now_usecs() + ap->m_flushIntervalMs * LWS_US_PER_MS;
+  ap->m_flushIt = ctx->flushPipes.insert(ctx->flushPipes.end(), ap);
+  ap->m_flushRegistered = true;
+  if (idle) {
+    lws_sul_schedule(ctx->context, 0, &ctx->flushTimer.sul, flushTick, FLUSH_TICK_MS * LWS_US_PER_MS);
+  }
+}
+
+void AudioPipe::removeFlushPipe(AudioPipe* ap) {
+  if (!ap->m_flushRegistered) return;
+  ap->m_ctx->flushPipes.erase(ap->m_flushIt);
+  ap->m_flushRegistered = false;
+}
+
+// service thread only: a reconnect backoff has expired
+void AudioPipe::reconnectTick(lws_sorted_usec_list_t *sul) {
+  AudioPipe* ap = lws_container_of(sul, PipeTimer, sul)->ap;
+  if (ap->m_closeRequested && !ap->hasSpooled()) {
+    ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
+    retire(ap);
+    return;
+  }
+  ap->connect_client(ap->m_vhd);
+}
+
+// service thread only: time for the next ping, or the pong to the last one is overdue
+void AudioPipe::pingTick(lws_sorted_usec_list_t *sul) {
+  AudioPipe* ap = lws_container_of(sul, PipeTimer, sul)->ap;
+  if (ap->m_state != LWS_CLIENT_CONNECTED || !ap->m_wsi) return;
+
+  if (ap->m_pingDueUs) {
+    // the far end, or the path to it, is gone: close now and handle it as a drop, rather than buffer into the void
+    // until TCP notices
+    lwsl_notice("%s no pong within %u ms, closing\n", ap->m_uuid.c_str(), ap->m_pingTimeoutMs);
+    ap->m_counters.pingTimeouts.fetch_add(1, std::memory_order_relaxed);
+    ap->m_ctx->counters.pingTimeouts.fetch_add(1, std::memory_order_relaxed);
+    ap->m_dropReason = "ping timeout";
+    lws_set_timeout(ap->m_wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+    return;
+  }
+
+  // the deadline runs from now, so a socket too choked to even send the ping counts against it
+  ap->m_pingDueUs = lws_now_usecs();
+  ap->m_pingPending = true;
+  lws_callback_on_writable(ap->m_wsi);
+  lws_sul_schedule(ap->m_ctx->context, 0, &ap->m_pingTimer.sul, pingTick, ap->m_pingTimeoutMs * LWS_US_PER_MS);
+}
+
+// service thread only: a connect or reconnect attempt failed; retry if allowed, otherwise report it and retire the pipe
+void AudioPipe::connectFailed(AudioPipe* ap, const char* reason) {
+  ap->m_wsi = nullptr;
+  // a pipe balanced over an endpoint set tries the rest of the set before anything else
+  if (!ap->m_endpoints.empty()) {
+    balancer.failed(ap->endpointKey());
+    if (!ap->m_established && !ap->m_closeRequested && ap->failover()) {
+      // NB: may retire ap
+      ap->connect_client(ap->m_vhd);
+      return;
     }
-    pendingDisconnects.clear();
   }
-  for (auto it = disconnects.begin(); it != disconnects.end(); ++it) {
+  // a spooling pipe holds on to its audio through a failed first connect too, and retries it the same way
+  if ((ap->m_reconnectAttempt > 0 || ap->m_spool) && ap->scheduleReconnect()) return;
+
+  if (ap->m_reconnectAttempt > 0 && (ap->m_established || ap->m_closeRequested)) {
+    // out of attempts: report the original drop
+    lwsl_notice("%s giving up reconnecting after %u attempts\n", ap->m_uuid.c_str(), ap->m_reconnectAttempt.load());
+    if (ap->m_closeRequested) ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
+    else ap->notify(AudioPipe::CONNECTION_DROPPED, ap->m_dropReason, ap->m_dropReason ? strlen(ap->m_dropReason) : 0);
+  }
+  else {
+    ap->m_state = LWS_CLIENT_FAILED;
+    ap->notify(AudioPipe::CONNECT_FAIL, reason, strlen(reason));
+  }
+  retire(ap);
+}
+
+/**
+ * service thread only: drop every reference the context holds to a finished pipe, and hand it to reap() to delete.
+ * It may still be on a pending queue, or further along a batch being processed, so it is not deleted here
+ */
+void AudioPipe::retire(AudioPipe* ap) {
+  if (ap->m_retired) return;
+  if (ap->m_spool) {
+    // once out of the drainer's list, nothing but this thread refers to the pipe
+    std::lock_guard<std::mutex> lk(spoolMutex);
+    spoolPipes.remove(ap);
+  }
+  if (ap->m_warm && !releaseWarm(ap)) {
+    // a session has claimed this connection; it finds it closed when it comes to adopt it, and deletes it
+    ap->m_state = LWS_CLIENT_DISCONNECTED;
+    ap->m_wsi = nullptr;
+    return;
+  }
+
+  // a multiplexed connection takes its streams with it; it is only deleted here if no stream is still waiting to attach
+  bool keep = false;
+  if (ap->m_isCarrier) {
+    std::list<AudioPipe*> streams;
+    streams.swap(ap->m_streams);
+    {
+      std::lock_guard<std::mutex> lk(muxMutex);
+      auto it = carriers.find(ap->m_muxKey);
+      if (it != carriers.end() && it->second == ap) carriers.erase(it);
+      ap->m_muxDead = true;
+      ap->m_muxRefs -= streams.size();
+      keep = ap->m_muxRefs > 0;
+    }
+    // detach them all first, so none of them goes looking for us while the others are retired
+    for (auto it = streams.begin(); it != streams.end(); ++it) {
+      (*it)->m_carrier = nullptr;
+      (*it)->m_attached = false;
+    }
+    for (auto it = streams.begin(); it != streams.end(); ++it) retire(*it);
+  }
+
+  ap->m_state = LWS_CLIENT_DISCONNECTED;
+  ap->m_reconnectAttempt = 0;
+  lws_sul_cancel(&ap->m_timer.sul);
+  ap->stopPing();
+  releaseContext(ap);
+  removeFlushPipe(ap);
+  ap->m_spoolOpen = false;
+  if (ap->m_spoolListed) {
+    ap->m_ctx->spoolPipes.erase(ap->m_spoolIt);
+    ap->m_spoolListed = false;
+  }
+
+  if (ap->m_recv_buf) {
+    ap->m_ctx->recvPool.release(ap->m_recv_buf, ap->m_recv_buf_len);
+    ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
+  }
+  ap->m_retired = true;
+  if (!keep) ap->m_ctx->retired.push_back(ap);
+}
+
+// service thread only, between calls to lws_service: delete the retired pipes no pending queue holds any more; the
+// others have been skipped by the queue they are on by the time it next comes round.  All of them if the context is done
+void AudioPipe::reap(ServiceContext* ctx, bool all) {
+  if (ctx->retired.empty()) return;
+  std::vector<AudioPipe*> retired;
+  retired.swap(ctx->retired);
+  for (auto it = retired.begin(); it != retired.end(); ++it) {
     AudioPipe* ap = *it;
-    lws_callback_on_writable(ap->m_wsi); 
+    bool queued = false;
+    for (int q = 0; q < PENDING_QUEUE_COUNT && !all; q++) queued = queued || ap->m_pending[q].load(std::memory_order_acquire);
+    if (queued) ctx->retired.push_back(ap);
+    else delete ap;
   }
 }
 
-void AudioPipe::processPendingWrites() {
-  std::list<AudioPipe*> writes;
+// pooled connections are shared by sessions going to the same url with the same credentials
+std::string AudioPipe::poolKey(void) const {
+  return m_host + ":" + std::to_string(m_port) + m_path + "|" + std::to_string(m_sslFlags) + "|" + m_username + ":" + m_password;
+}
+
+// top up the pool for this destination to its target size, within the per-host cap; the new pipes connect in the background
+void AudioPipe::refillPool(const AudioPipe* tmpl, const std::string& key) {
+  std::vector<AudioPipe*> created;
+  std::string hostKey = tmpl->m_host + ":" + std::to_string(tmpl->m_port);
   {
-    std::lock_guard<std::mutex> guard(mutex_writes);
-    for (auto it = pendingWrites.begin(); it != pendingWrites.end(); ++it) {
-       if ((*it)->m_state == LWS_CLIENT_CONNECTED) writes.push_back(*it);
-    }  
-    pendingWrites.clear();
+    std::lock_guard<std::mutex> lk(poolMutex);
+    WarmPool& pool = warmPools[key];
+    unsigned int& perHost = warmPerHost[hostKey];
+    pool.hostKey = hostKey;
+    while (pool.idle.size() + pool.connecting < nPoolSize && perHost < nPoolMaxPerHost) {
+      // the session that adopts the connection brings its own buffers, so keep these minimal
+      AudioPipe* ap = new AudioPipe("", tmpl->m_host.c_str(), tmpl->m_port, tmpl->m_path.c_str(), tmpl->m_sslFlags, 1, 1,
+        tmpl->hasBasicAuth() ? tmpl->m_username.c_str() : nullptr, tmpl->hasBasicAuth() ? tmpl->m_password.c_str() : nullptr,
+        const_cast<char *>(""), warmCallback);
+      ap->m_warm = ap->m_pooled = true;
+      ap->m_poolKey = key;
+      pool.connecting++;
+      perHost++;
+      created.push_back(ap);
+    }
+    if (0 == perHost) warmPerHost.erase(hostKey);
+    if (pool.idle.empty() && 0 == pool.connecting) warmPools.erase(key);
   }
-  for (auto it = writes.begin(); it != writes.end(); ++it) {
-    AudioPipe* ap = *it;
-    lws_callback_on_writable(ap->m_wsi);
+  for (auto it = created.begin(); it != created.end(); ++it) addPendingConnect(*it);
+}
+
+// claim an idle pooled connection, preferring one on the context that already serves this call
+AudioPipe* AudioPipe::takeWarm(const std::string& key, const std::string& uuid) {
+  ServiceContext* preferred = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(mutex_affinity);
+    auto it = sessionContexts.find(uuid);
+    if (it != sessionContexts.end()) preferred = it->second.first;
+  }
+
+  std::lock_guard<std::mutex> lk(poolMutex);
+  auto it = warmPools.find(key);
+  if (it == warmPools.end() || it->second.idle.empty()) return nullptr;
+
+  WarmPool& pool = it->second;
+  auto pick = pool.idle.begin();
+  for (auto i = pool.idle.begin(); i != pool.idle.end(); ++i) {
+    if ((*i)->m_ctx == preferred) {
+      pick = i;
+      break;
+    }
   }
+  AudioPipe* warm = *pick;
+  pool.idle.erase(pick);
+  warm->m_pooled = false;
+  warm->m_claimed = true;
+  if (0 == --warmPerHost[pool.hostKey]) warmPerHost.erase(pool.hostKey);
+  if (pool.idle.empty() && 0 == pool.connecting) warmPools.erase(it);
+  return warm;
 }
 
-AudioPipe* AudioPipe::findAndRemovePendingConnect(struct lws *wsi) {
-  AudioPipe* ap = NULL;
-  std::lock_guard<std::mutex> guard(mutex_connects);
-  std::list<AudioPipe* > toRemove;
+// service thread only: a pooled connection is upgraded and ready to hand out
+void AudioPipe::warmEstablished(AudioPipe* ap) {
+  {
+    std::lock_guard<std::mutex> lk(poolMutex);
+    WarmPool& pool = warmPools[ap->m_poolKey];
+    pool.connecting--;
+    pool.idle.push_back(ap);
+  }
+  lwsl_notice("pooled connection to %s:%u ready, wsi is %p\n", ap->m_host.c_str(), ap->m_port, ap->m_wsi);
+  lws_sul_schedule(ap->m_ctx->context, 0, &ap->m_timer.sul, warmIdleTick, nPoolIdleSecs * LWS_US_PER_SEC);
+}
 
-  for (auto it = pendingConnects.begin(); it != pendingConnects.end() && !ap; ++it) {
-    int state = (*it)->m_state;
+// take a pooled pipe out of the pool's accounting; returns false if a session has claimed it
+bool AudioPipe::releaseWarm(AudioPipe* ap) {
+  std::lock_guard<std::mutex> lk(poolMutex);
+  if (ap->m_claimed) return false;
+  if (!ap->m_pooled) return true;
+
+  ap->m_pooled = false;
+  auto it = warmPools.find(ap->m_poolKey);
+  if (it != warmPools.end()) {
+    WarmPool& pool = it->second;
+    auto pos = std::find(pool.idle.begin(), pool.idle.end(), ap);
+    if (pos != pool.idle.end()) pool.idle.erase(pos);
+    else pool.connecting--;
+    if (0 == --warmPerHost[pool.hostKey]) warmPerHost.erase(pool.hostKey);
+    if (pool.idle.empty() && 0 == pool.connecting) warmPools.erase(it);
+  }
+  return true;
+}
 
-    if ((*it)->m_wsi == nullptr)
-      toRemove.push_back(*it);
+// service thread only: a pooled connection went unused for the idle timeout
+void AudioPipe::warmIdleTick(lws_sorted_usec_list_t *sul) {
+  AudioPipe* ap = lws_container_of(sul, PipeTimer, sul)->ap;
+  if (!releaseWarm(ap)) return;
 
-    if ((state == LWS_CLIENT_CONNECTING) &&
-      (*it)->m_wsi == wsi) ap = *it;
+  lwsl_notice("closing idle pooled connection to %s:%u\n", ap->m_host.c_str(), ap->m_port);
+  ap->m_state = LWS_CLIENT_DISCONNECTING;
+  lws_callback_on_writable(ap->m_wsi);
+}
+
+// service thread only: move a claimed pooled connection over to the session's pipe, then discard the pooled pipe
+void AudioPipe::adoptWarm(AudioPipe* ap, AudioPipe* warm, lws_per_vhost_data *vhd) {
+  ap->m_adopt = nullptr;
+
+  lws_sul_cancel(&warm->m_timer.sul);
+  if (warm->m_recv_buf) {
+    warm->m_ctx->recvPool.release(warm->m_recv_buf, warm->m_recv_buf_len);
+    warm->m_recv_buf = warm->m_recv_buf_ptr = nullptr;
   }
+  struct lws* wsi = warm->m_state == LWS_CLIENT_CONNECTED ? warm->m_wsi : nullptr;
 
-  for (auto it = toRemove.begin(); it != toRemove.end(); ++it)
-    pendingConnects.remove(*it);
+  // the session pipe inherits its place in the context's pipe count
+  warm->m_ctxReleased = true;
+  delete warm;
 
-  if (ap) {
-    pendingConnects.remove(ap);
+  if (!wsi) {
+    lwsl_notice("%s pooled connection closed before it could be used, connecting\n", ap->m_uuid.c_str());
+    ap->connect_client(vhd);
+    return;
   }
 
-  return ap;
+  lwsl_notice("%s using pooled connection, wsi is %p\n", ap->m_uuid.c_str(), wsi);
+  ap->m_wsi = wsi;
+  ap->m_vhd = vhd;
+  lws_set_opaque_user_data(wsi, ap);
+  *((AudioPipe **) lws_wsi_user(wsi)) = ap;
+  ap->m_state = LWS_CLIENT_CONNECTED;
+  ap->m_established = true;
+  if (ap->m_flushIntervalMs > 0) addFlushPipe(ap);
+  ap->openSpool();
+  ap->startPing();
+  ap->notify(AudioPipe::CONNECT_SUCCESS, NULL, 0);
 }
 
-AudioPipe* AudioPipe::findPendingConnect(struct lws *wsi) {
-  AudioPipe* ap = NULL;
-  std::lock_guard<std::mutex> guard(mutex_connects);
+// deliver an event to the session; a multiplexed connection passes it on to its streams instead
+void AudioPipe::notify(NotifyEvent_t event, const char* message, size_t len) {
+  if (!m_isCarrier) {
+    m_callback(m_uuid.c_str(), m_bugname.c_str(), event, message, len);
+    return;
+  }
 
-  for (auto it = pendingConnects.begin(); it != pendingConnects.end() && !ap; ++it) {
-    int state = (*it)->m_state;
-    if ((state == LWS_CLIENT_CONNECTING) &&
-      (*it)->m_wsi == wsi) ap = *it;
+  if (event == AudioPipe::MESSAGE) {
+    // the glue routes a message to the right fork by the streamId it carries; any stream will do as a way in
+    if (!m_streams.empty()) m_streams.front()->notify(event, message, len);
+    return;
+  }
+  for (auto it = m_streams.begin(); it != m_streams.end(); ++it) {
+    AudioPipe* ap = *it;
+    switch (event) {
+      case AudioPipe::CONNECT_SUCCESS:
+      case AudioPipe::RECONNECTED:
+        ap->m_wsi = m_wsi;
+        ap->m_reconnectAttempt = 0;
+        ap->m_state = LWS_CLIENT_CONNECTED;
+        if (ap->m_flushIntervalMs > 0 && !ap->m_flushRegistered) addFlushPipe(ap);
+      break;
+      case AudioPipe::RECONNECTING:
+        ap->m_wsi = nullptr;
+        ap->m_reconnectAttempt = m_reconnectAttempt.load();
+        ap->m_state = LWS_CLIENT_RECONNECTING;
+        removeFlushPipe(ap);
+      break;
+      default:
+        // the connection is gone; retire() takes the streams down with it
+        ap->m_wsi = nullptr;
+        ap->m_state = event == AudioPipe::CONNECT_FAIL ? LWS_CLIENT_FAILED : LWS_CLIENT_DISCONNECTED;
+        removeFlushPipe(ap);
+      break;
+    }
+    ap->notify(event, message, len);
   }
-  return ap;
+
+  // every stream left while we were still connecting
+  if (event == AudioPipe::CONNECT_SUCCESS && m_closeRequested) addPendingDisconnect(this);
 }
 
-void AudioPipe::addPendingConnect(AudioPipe* ap) {
+// carry this fork over the connection shared by the call's other multiplexed forks to the same destination,
+// opening it if this is the first of them
+void AudioPipe::joinCarrier(void) {
+  std::string key = m_uuid + "|" + poolKey();
+  std::lock_guard<std::mutex> lk(muxMutex);
+  auto it = carriers.find(key);
+  if (it != carriers.end()) m_carrier = it->second;
+  else {
+    m_carrier = new AudioPipe(m_uuid.c_str(), m_host.c_str(), m_port, m_path.c_str(), m_sslFlags, 1, 1,
+      hasBasicAuth() ? m_username.c_str() : nullptr, hasBasicAuth() ? m_password.c_str() : nullptr,
+      const_cast<char *>(""), nullptr);
+    m_carrier->m_isCarrier = true;
+    m_carrier->m_muxKey = key;
+    m_carrier->setReconnectPolicy(m_reconnectMaxAttempts, m_reconnectBackoffMs, 0);
+    m_carrier->setPingPolicy(m_pingIntervalMs, m_pingTimeoutMs);
+    carriers[key] = m_carrier;
+    m_carrier->connect();
+  }
+  m_carrier->m_muxRefs++;
+
+  // the connection owns the context share for the call; streams only ride on it
+  m_ctx = m_carrier->m_ctx;
+  m_ctxReleased = true;
+  if (enqueuePending(this, PENDING_CONNECT)) lws_cancel_service(m_ctx->context);
+}
+
+// service thread only: a stream joins its connection, and is connected at once if the connection is already up
+void AudioPipe::attachStream(AudioPipe* ap) {
+  AudioPipe* carrier = ap->m_carrier;
+  if (ap->m_closeRequested || carrier->m_muxDead) {
+    if (ap->m_closeRequested) ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
+    else {
+      const char* reason = "connection failed";
+      ap->m_state = LWS_CLIENT_FAILED;
+      ap->notify(AudioPipe::CONNECT_FAIL, reason, strlen(reason));
+    }
+    leaveCarrier(ap);
+    retire(ap);
+    return;
+  }
+
+  ap->m_attached = true;
+  carrier->m_streams.push_back(ap);
+  if (carrier->m_state == LWS_CLIENT_CONNECTED) {
+    ap->m_wsi = carrier->m_wsi;
+    ap->m_vhd = carrier->m_vhd;
+    ap->m_state = LWS_CLIENT_CONNECTED;
+    if (ap->m_flushIntervalMs > 0) addFlushPipe(ap);
+    ap->notify(AudioPipe::CONNECT_SUCCESS, NULL, 0);
+  }
+  else if (carrier->m_reconnectAttempt > 0) {
+    ap->m_reconnectAttempt = carrier->m_reconnectAttempt.load();
+    ap->m_state = LWS_CLIENT_RECONNECTING;
+  }
+  else ap->m_state = LWS_CLIENT_CONNECTING;
+}
+
+// service thread only: a stream gives up its hold on its connection, which is closed when the last one leaves
+void AudioPipe::leaveCarrier(AudioPipe* ap) {
+  AudioPipe* carrier = ap->m_carrier;
+  ap->m_carrier = nullptr;
+  if (ap->m_attached) {
+    carrier->m_streams.remove(ap);
+    ap->m_attached = false;
+  }
+
+  bool last, dead;
   {
-    std::lock_guard<std::mutex> guard(mutex_connects);
-    pendingConnects.push_back(ap);
-    lwsl_notice("%s after adding connect there are %lu pending connects\n", 
-      ap->m_uuid.c_str(), pendingConnects.size());
+    std::lock_guard<std::mutex> lk(muxMutex);
+    last = 0 == --carrier->m_muxRefs;
+    dead = carrier->m_muxDead;
+    if (last && !dead) {
+      // from here on a new fork to the same destination opens a new connection
+      auto it = carriers.find(carrier->m_muxKey);
+      if (it != carriers.end() && it->second == carrier) carriers.erase(it);
+    }
   }
-  lws_cancel_service(contexts[nchild++ % numContexts]);
+  if (!last) return;
+  if (dead) carrier->m_ctx->retired.push_back(carrier);     // already retired, and kept only for us
+  else carrier->close();
 }
-void AudioPipe::addPendingDisconnect(AudioPipe* ap) {
-  ap->m_state = LWS_CLIENT_DISCONNECTING;
+
+// service thread only: a multiplexed connection is writeable; its streams take turns, each tagging its own frames
+int AudioPipe::carrierWriteable(AudioPipe* carrier, struct lws* wsi) {
+  bool more = false;
+  size_t n = carrier->m_streams.size();
+  for (size_t i = 0; i < n && !carrier->m_streams.empty(); i++) {
+    if (lws_send_pipe_choked(wsi)) {
+      more = true;
+      break;
+    }
+
+    // rotate as we go, so that streams the socket cut off go first next time
+    AudioPipe* ap = carrier->m_streams.front();
+    carrier->m_streams.pop_front();
+    carrier->m_streams.push_back(ap);
+
+    if (ap->isGracefulShutdown()) {
+      // a frame holding only the stream id marks the end of that stream's audio
+      if (!ap->m_gracefulSent) {
+        lwsl_notice("%s graceful shutdown of stream %s\n", ap->m_uuid.c_str(), ap->m_bugname.c_str());
+        if (lws_write(wsi, (unsigned char *) ap->m_send_buf + LWS_PRE, ap->m_send_hdr_len, LWS_WRITE_BINARY) < 0) return -1;
+        ap->m_gracefulSent = true;
+      }
+      if (ap->m_state != LWS_CLIENT_DISCONNECTING) continue;
+    }
+
+    int rc = ap->writeQueued(wsi);
+    if (rc < 0) return -1;
+    if (rc > 0) {
+      ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
+      leaveCarrier(ap);
+      retire(ap);
+      continue;
+    }
+    if (ap->hasQueued()) more = true;
+  }
+
+  // the last stream has left
+  if (carrier->m_state == LWS_CLIENT_DISCONNECTING) {
+    lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+    return -1;
+  }
+  if (more) lws_callback_on_writable(wsi);
+  return 0;
+}
+
+// service thread only: true if bugname is another fork multiplexed over the same connection as this one
+bool AudioPipe::hasSibling(const char* bugname) const {
+  if (!m_carrier) return false;
+  for (auto it = m_carrier->m_streams.begin(); it != m_carrier->m_streams.end(); ++it) {
+    if ((*it)->m_bugname == bugname) return true;
+  }
+  return false;
+}
+
+void AudioPipe::setMultiplex(void) {
+  // every binary frame starts with the stream id: one length byte, then the bugname
+  m_send_hdr_len = 1 + std::min(m_bugname.size(), (size_t) UINT8_MAX);
+  m_multiplex = true;
+  allocSendBuffer();
+}
+
+void AudioPipe::setFrameDuration(unsigned int frameMs) {
+  if (m_frameUs || 0 == frameMs) return;
+  m_frameUs = frameMs * 1000;
+  m_audio_ring.enableTimestamps(m_frameUs);
+}
+
+void AudioPipe::setFrameHeader(unsigned int channels, unsigned int samplesPerFrame) {
+  m_hdrChannels = channels;
+  m_samplesPerFrame = samplesPerFrame;
+  m_frame_hdr_len = FRAME_HEADER_LEN;
+  allocSendBuffer();
+}
+
+// the send buffer holds, after LWS_PRE, any stream id, then any frame header, then the audio
+void AudioPipe::allocSendBuffer(void) {
+  if (m_send_buf) delete [] m_send_buf;
+  m_send_buf = new uint8_t[LWS_PRE + m_send_hdr_len + m_frame_hdr_len + m_send_buf_len];
+  if (m_multiplex) {
+    m_send_buf[LWS_PRE] = (uint8_t) (m_send_hdr_len - 1);
+    memcpy(m_send_buf + LWS_PRE + 1, m_bugname.data(), m_send_hdr_len - 1);
+  }
+}
+
+/**
+ * the header describing the audio about to be sent from the send buffer, all fields big-endian:
+ *   0  version (1 byte), channels (1 byte), header length (2 bytes)
+ *   4  sequence number of the frame (4 bytes), counting from 0
+ *   8  offset of the first sample, in samples per channel since the start of the stream, dropped audio included (8 bytes)
+ *  16  wall clock time the first sample was captured, in microseconds since the epoch (8 bytes)
+ *  24  total samples per channel dropped so far on buffer overrun (4 bytes)
+ */
+void AudioPipe::writeFrameHeader(uint8_t* p) {
+  size_t frameLen = m_audio_ring.frameLen();
+  uint64_t offset = m_sendPosition * m_samplesPerFrame / frameLen;
+  uint32_t dropped = (uint32_t) (m_audio_ring.droppedBytes() * m_samplesPerFrame / frameLen);
+  uint32_t seq = m_frameSeq++;
+
+  p[0] = FRAME_HEADER_VERSION;
+  p[1] = (uint8_t) m_hdrChannels;
+  p[2] = 0;
+  p[3] = FRAME_HEADER_LEN;
+  for (int i = 0; i < 4; i++) p[4 + i] = (uint8_t) (seq >> (24 - 8 * i));
+  for (int i = 0; i < 8; i++) p[8 + i] = (uint8_t) (offset >> (56 - 8 * i));
+  for (int i = 0; i < 8; i++) p[16 + i] = (uint8_t) (m_sendCaptureUs >> (56 - 8 * i));
+  for (int i = 0; i < 4; i++) p[24 + i] = (uint8_t) (dropped >> (24 - 8 * i));
+}
+
+// media thread: count audio dropped on overrun, and how far the queue has backed up
+void AudioPipe::countQueued(size_t dropped) {
+  ServiceContext* ctx = m_ctx;
+  if (dropped) {
+    m_counters.droppedBytes.fetch_add(dropped, std::memory_order_relaxed);
+    if (ctx) ctx->counters.droppedBytes.fetch_add(dropped, std::memory_order_relaxed);
+  }
+
+  uint64_t depth = m_audio_ring.size();
+  if (depth <= m_counters.queueHighWater.load(std::memory_order_relaxed)) return;
+  m_counters.queueHighWater.store(depth, std::memory_order_relaxed);
+  if (!ctx) return;
+  // other media threads feed the same context
+  uint64_t high = ctx->counters.queueHighWater.load(std::memory_order_relaxed);
+  while (depth > high && !ctx->counters.queueHighWater.compare_exchange_weak(high, depth, std::memory_order_relaxed));
+}
+
+// service thread only: count a frame handed to lws_write, against this pipe and its context.  lws takes the whole
+// frame, keeping whatever the socket would not take to send first on the next writeable event; that is a partial write
+void AudioPipe::countWrite(struct lws* wsi, size_t offered, int sent, bool binary) {
+  if (sent < 0) return;
+  bool partial = (size_t) sent < offered || lws_partial_buffered(wsi);
+  Counters* counters[] = { &m_counters, &m_ctx->counters };
+  for (Counters* c : counters) {
+    c->bytesSent.fetch_add(sent, std::memory_order_relaxed);
+    (binary ? c->framesSent : c->textFrames).fetch_add(1, std::memory_order_relaxed);
+    if (partial) c->partialWrites.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// service thread only: the websocket is up; count how long it took to get here
+void AudioPipe::countEstablished(struct lws* wsi) {
+  uint64_t connectUs = m_connectStartUs ? lws_now_usecs() - m_connectStartUs : 0;
+  uint64_t tlsUs = 0;
+#if defined(LWS_WITH_CONMON)
+  if (m_sslFlags & LCCSCF_USE_SSL) {
+    struct lws_conmon cm;
+    lws_conmon_wsi_take(wsi, &cm);
+    tlsUs = cm.ciu_tls;
+    lws_conmon_release(&cm);
+  }
+#endif
+  Counters* counters[] = { &m_counters, &m_ctx->counters };
+  for (Counters* c : counters) {
+    c->connects.fetch_add(1, std::memory_order_relaxed);
+    c->connectUs.fetch_add(connectUs, std::memory_order_relaxed);
+    if (tlsUs) {
+      c->tlsHandshakes.fetch_add(1, std::memory_order_relaxed);
+      c->tlsHandshakeUs.fetch_add(tlsUs, std::memory_order_relaxed);
+    }
+  }
+}
+
+// service thread only: len bytes of audio captured from captureUs on have just been handed to lws_write;
+// record how long each frame of it waited
+void AudioPipe::measureLatency(uint64_t captureUs, size_t len) {
+  if (!m_frameUs || !captureUs || 0 == len) return;
+  uint64_t now = wallClockUs();
+  size_t frames = std::max((size_t) 1, len / m_audio_ring.frameLen());
+  for (size_t i = 0; i < frames; i++) {
+    uint64_t captured = captureUs + i * m_frameUs;
+    m_ctx->latency.record(now > captured ? now - captured : 0);
+  }
+}
+
+void AudioPipe::setSpool(AudioSpool* spool) {
+  if (m_multiplex || m_spool) {
+    delete spool;
+    return;
+  }
+  m_spool = spool;
+  std::lock_guard<std::mutex> lk(spoolMutex);
+  spoolPipes.push_back(this);
+  if (!spoolThread.joinable()) spoolThread = std::thread(&AudioPipe::spoolDrainer);
+}
+
+// media thread only: whether len bytes of new audio go to the spool rather than straight into the ring.  Once
+// spooling, everything goes to the spool until the drainer has moved it all into the ring, so the order is kept
+bool AudioPipe::spooling(size_t len) {
+  if (m_spooling) {
+    if (!m_spool->empty()) return true;
+    m_spooling = false;
+  }
+  if (m_state == LWS_CLIENT_CONNECTED && ringHasRoom(len)) return false;
+  m_spooling = true;
+  return true;
+}
+
+// media thread only: returns the bytes lost, if the spool could not take them
+size_t AudioPipe::spoolWrite(const uint8_t* data, size_t len, uint64_t endUs) {
+  bool stored = m_spool->append(data, len, endUs);
+  Counters* counters[] = { &m_counters, m_ctx ? &m_ctx->counters : nullptr };
+  for (Counters* c : counters) {
+    if (c) (stored ? c->spooledBytes : c->spoolDroppedBytes).fetch_add(len, std::memory_order_relaxed);
+  }
+  return stored ? 0 : len;
+}
+
+// drainer thread only, with spoolMutex held: while connected, move spooled audio into the ring as fast as it empties.
+// The service thread is only signalled; it does the rest
+void AudioPipe::drainSpool(void) {
+  m_spool->prepare();
+  if (!m_spoolOpen.load(std::memory_order_acquire)) {
+    // should the connection have gone before the service thread closed it, close the next one instead
+    m_spoolClosed = false;
+    return;
+  }
+
+  // the ring has no other producer while there is audio in the spool
+  const uint8_t* data;
+  size_t len;
+  uint64_t endUs;
+  size_t moved = 0;
+  while (m_spool->peek(data, len, endUs) && ringHasRoom(len)) {
+    m_audio_ring.push(data, len, endUs);
+    m_spool->consume();
+    moved += len;
+  }
+  if (moved) {
+    m_counters.spoolDrainedBytes.fetch_add(moved, std::memory_order_relaxed);
+    m_ctx->counters.spoolDrainedBytes.fetch_add(moved, std::memory_order_relaxed);
+    m_spoolMoved = true;
+  }
+
+  // a fork that has ended keeps its connection until the last of its audio is on its way
+  if (m_closeRequested && !m_spoolClosed && m_spool->empty() && m_audio_ring.empty()) {
+    m_spoolClosed = true;
+    m_spoolDone = true;
+  }
+  if (moved || m_spoolDone.load(std::memory_order_relaxed)) {
+    m_ctx->spoolSignalled = true;
+    lws_cancel_service(m_ctx->context);
+  }
+}
+
+// service thread only: a spooling pipe has connected, so the drainer can start feeding it
+void AudioPipe::openSpool(void) {
+  if (!m_spool) return;
+  if (!m_spoolListed) {
+    m_spoolIt = m_ctx->spoolPipes.insert(m_ctx->spoolPipes.end(), this);
+    m_spoolListed = true;
+  }
+  m_spoolOpen = true;
+}
+
+void AudioPipe::spoolDrainer(void) {
+  std::unique_lock<std::mutex> lk(spoolMutex);
+  while (!spoolStop) {
+    for (auto it = spoolPipes.begin(); it != spoolPipes.end(); ++it) (*it)->drainSpool();
+    spoolCond.wait_for(lk, std::chrono::milliseconds(FLUSH_TICK_MS));
+  }
+}
+
+void AudioPipe::setShm(ShmChannel* shm) {
+  if (m_multiplex || m_spool || m_shm) {
+    delete shm;
+    return;
+  }
+  m_shm = shm;
+  std::lock_guard<std::mutex> lk(shmMutex);
+  if (shmThread.joinable()) return;
+
+  // one thread serves every shared memory pipe; the wake eventfd is the entry with no pipe behind it
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  shmEpoll = epoll_create1(EPOLL_CLOEXEC);
+  shmWake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (shmEpoll < 0 || shmWake < 0 || epoll_ctl(shmEpoll, EPOLL_CTL_ADD, shmWake, &ev) < 0) {
+    lwsl_err("AudioPipe::setShm unable to start the shared memory thread: %s\n", strerror(errno));
+    return;
+  }
+  shmThread = std::thread(&AudioPipe::shmService);
+}
+
+// media thread only: returns the bytes lost because the consumer had not made room for them
+size_t AudioPipe::shmWrite(const uint8_t* data, size_t len, uint64_t captureUs) {
+  size_t dropped = m_shm->write(data, len, captureUs ? captureUs : wallClockUs());
+  if (dropped < len) countShmWrite(len - dropped);
+  countQueued(dropped);
+  return dropped;
+}
+
+void AudioPipe::countShmWrite(size_t len) {
+  m_counters.bytesSent.fetch_add(len, std::memory_order_relaxed);
+  m_counters.framesSent.fetch_add(1, std::memory_order_relaxed);
+}
+
+// shm thread only: open the channel to the consumer, and report how that went
+void AudioPipe::shmConnect(AudioPipe* ap) {
+  char hello[512];
+  std::string err;
+  snprintf(hello, sizeof(hello), 
+    "{\"type\":\"shm\",\"version\":%u,\"uuid\":\"%s\",\"bugname\":\"%s\",\"name\":\"%s\",\"slots\":%lu,\"slotCapacity\":%lu}",
+    ShmChannel::VERSION, ap->m_uuid.c_str(), ap->m_bugname.c_str(), ap->m_shm->name().c_str(), 
+    (unsigned long) ap->m_shm->slotCount(), (unsigned long) ap->m_shm->slotCapacity());
+  bool ok = !ap->m_closeRequested && ap->m_shm->open(hello, err);
+
+  bool closed;
   {
-    std::lock_guard<std::mutex> guard(mutex_disconnects);
-    pendingDisconnects.push_back(ap);
-    lwsl_notice("%s after adding disconnect there are %lu pending disconnects\n", 
-      ap->m_uuid.c_str(), pendingDisconnects.size());
+    std::lock_guard<std::mutex> lk(shmMutex);
+    closed = ap->m_closeRequested;
+    if (ok && !closed) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = ap;
+      if (epoll_ctl(shmEpoll, EPOLL_CTL_ADD, ap->m_shm->controlFd(), &ev) < 0) {
+        ok = false;
+        err = std::string("epoll_ctl: ") + strerror(errno);
+      }
+      else ap->m_state = LWS_CLIENT_CONNECTED;
+    }
+  }
+
+  //NB: after any of the events below, whoever holds a pointer to this pipe must let go of it
+  if (closed) {
+    ap->notify(AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0);
+    delete ap;
+    return;
+  }
+  if (!ok) {
+    lwsl_notice("%s unable to connect to %s: %s\n", ap->m_uuid.c_str(), ap->m_host.c_str(), err.c_str());
+    ap->m_state = LWS_CLIENT_FAILED;
+    ap->notify(AudioPipe::CONNECT_FAIL, err.c_str(), err.length());
+    delete ap;
+    return;
   }
-  lws_cancel_service(ap->m_vhd->context);
+
+  ap->m_counters.connects.fetch_add(1, std::memory_order_relaxed);
+  ap->m_counters.connectUs.fetch_add(lws_now_usecs() - ap->m_connectStartUs, std::memory_order_relaxed);
+  ap->m_established = true;
+  lwsl_notice("%s sharing audio with %s through %s\n", ap->m_uuid.c_str(), ap->m_host.c_str(), ap->m_shm->name().c_str());
+  ap->notify(AudioPipe::CONNECT_SUCCESS, NULL, 0);
 }
-void AudioPipe::addPendingWrite(AudioPipe* ap) {
+
+// shm thread only: hand on whatever the consumer has sent, and retire the pipe once the control channel is closed
+void AudioPipe::shmReceive(AudioPipe* ap, uint8_t* buf, size_t len) {
+  ssize_t n;
+  while ((n = ap->m_shm->receive(buf, len)) > 0) {
+    if ((size_t) n > len) {
+      lwsl_notice("AudioPipe::shmReceive %s max buffer exceeded, discarding message.\n", ap->m_uuid.c_str());
+      continue;
+    }
+    buf[n] = '\0';
+    ap->notify(AudioPipe::MESSAGE, (char *) buf, n);
+  }
+  if (0 == n) return;
+
+  bool closed;
   {
-    std::lock_guard<std::mutex> guard(mutex_writes);
-    pendingWrites.push_back(ap);
+    std::lock_guard<std::mutex> lk(shmMutex);
+    closed = ap->m_closeRequested;
+    ap->m_state = LWS_CLIENT_DISCONNECTED;
+    epoll_ctl(shmEpoll, EPOLL_CTL_DEL, ap->m_shm->controlFd(), nullptr);
+  }
+  if (!closed) lwsl_notice("%s shared memory consumer closed the channel\n", ap->m_uuid.c_str());
+  ap->notify(closed ? AudioPipe::CONNECTION_CLOSED_GRACEFULLY : AudioPipe::CONNECTION_DROPPED, NULL, 0);
+  delete ap;
+}
+
+void AudioPipe::shmService(void) {
+  std::vector<uint8_t> buf(MAX_RECV_BUF_SIZE);
+  struct epoll_event events[16];
+  while (true) {
+    std::list<AudioPipe*> connects;
+    {
+      std::lock_guard<std::mutex> lk(shmMutex);
+      if (shmStop) break;
+      connects.swap(shmConnects);
+    }
+    for (auto it = connects.begin(); it != connects.end(); ++it) shmConnect(*it);
+
+    int n = epoll_wait(shmEpoll, events, sizeof(events) / sizeof(events[0]), -1);
+    for (int i = 0; i < n; i++) {
+      if (nullptr == events[i].data.ptr) {
+        uint64_t count;
+        ssize_t rc = read(shmWake, &count, sizeof(count));
+        (void) rc;
+        continue;
+      }
+      // leave room for a terminating NUL
+      shmReceive(static_cast<AudioPipe*>(events[i].data.ptr), buf.data(), buf.size() - 1);
+    }
+  }
+}
+
+// service thread only: sample the bytes/sec sent on this context for least-loaded selection
+void AudioPipe::loadTick(lws_sorted_usec_list_t *sul) {
+  ServiceContext* ctx = lws_container_of(sul, ContextTimer, sul)->ctx;
+  uint64_t sent = ctx->counters.bytesSent.load(std::memory_order_relaxed);
+  ctx->bytesPerSec.store(sent - ctx->lastBytesSent, std::memory_order_relaxed);
+  ctx->lastBytesSent = sent;
+
+  lws_sul_schedule(ctx->context, 0, &ctx->loadTimer.sul, loadTick, LWS_US_PER_SEC);
+}
+
+// forks of the same call share a context; otherwise take the least loaded one
+AudioPipe::ServiceContext* AudioPipe::acquireContext(const std::string& uuid) {
+  std::lock_guard<std::mutex> guard(mutex_affinity);
+  auto it = uuid.empty() ? sessionContexts.end() : sessionContexts.find(uuid);
+  if (it != sessionContexts.end()) {
+    it->second.second++;
+    it->second.first->activePipes++;
+    return it->second.first;
+  }
+
+  ServiceContext* best = nullptr;
+  uint64_t bestLoad = 0;
+  for (unsigned int i = 0; i < numContexts; i++) {
+    uint64_t load = (uint64_t) contexts[i].activePipes.load() * LOAD_BYTES_PER_PIPE + contexts[i].bytesPerSec.load();
+    if (!best || load < bestLoad) {
+      best = &contexts[i];
+      bestLoad = load;
+    }
+  }
+  best->activePipes++;
+  if (!uuid.empty()) sessionContexts[uuid] = std::make_pair(best, 1U);
+  return best;
+}
+
+// a session pipe taking over a pooled connection joins that connection's context
+void AudioPipe::bindContext(AudioPipe* ap) {
+  std::lock_guard<std::mutex> guard(mutex_affinity);
+  auto it = sessionContexts.find(ap->m_uuid);
+  if (it != sessionContexts.end()) it->second.second++;
+  else sessionContexts[ap->m_uuid] = std::make_pair(ap->m_ctx, 1U);
+}
+
+void AudioPipe::releaseContext(AudioPipe* ap) {
+  if (!ap->m_ctx || ap->m_ctxReleased) return;
+  ap->m_ctxReleased = true;
+  ap->m_ctx->activePipes--;
+  if (ap->m_uuid.empty()) return;
+
+  std::lock_guard<std::mutex> guard(mutex_affinity);
+  auto it = sessionContexts.find(ap->m_uuid);
+  if (it != sessionContexts.end() && 0 == --it->second.second) sessionContexts.erase(it);
+}
+
+void AudioPipe::getLatency(std::vector<LatencyHistogram::Snapshot>& snapshots) {
+  snapshots.resize(numContexts);
+  for (unsigned int i = 0; i < numContexts; i++) contexts[i].latency.snapshot(snapshots[i]);
+}
+
+void AudioPipe::getContextLoad(std::vector<ContextLoad>& loads) {
+  loads.clear();
+  for (unsigned int i = 0; i < numContexts; i++) {
+    ContextLoad load;
+    load.index = i;
+    load.cpu = contexts[i].cpu;
+    load.activePipes = contexts[i].activePipes.load();
+    load.bytesSent = contexts[i].counters.bytesSent.load();
+    contexts[i].counters.get(load.stats);
+    load.bytesPerSec = contexts[i].bytesPerSec.load();
+    loads.push_back(load);
   }
-  lws_cancel_service(ap->m_vhd->context);
+}
+
+// O(1): the pipe is attached to its wsi as opaque user data when the connect is issued
+AudioPipe* AudioPipe::findPendingConnect(struct lws *wsi) {
+  AudioPipe* ap = static_cast<AudioPipe*>(lws_get_opaque_user_data(wsi));
+  if (ap && ap->m_state == LWS_CLIENT_CONNECTING) return ap;
+  return NULL;
+}
+
+void AudioPipe::addPendingConnect(AudioPipe* ap) {
+  ap->m_ctx = acquireContext(ap->m_uuid);
+  if (enqueuePending(ap, PENDING_CONNECT)) lws_cancel_service(ap->m_ctx->context);
+}
+void AudioPipe::addPendingDisconnect(AudioPipe* ap) {
+  ap->m_state = LWS_CLIENT_DISCONNECTING;
+  if (enqueuePending(ap, PENDING_DISCONNECT)) lws_cancel_service(ap->m_ctx->context);
+}
+void AudioPipe::addPendingWrite(AudioPipe* ap) {
+  // if the pipe is already queued the service thread has a wakeup coming and will see this data too
+  if (enqueuePending(ap, PENDING_WRITE)) lws_cancel_service(ap->m_ctx->context);
 }
 
 bool AudioPipe::lws_service_thread(unsigned int nServiceThread) {
@@ -412,6 +1421,7 @@ bool AudioPipe::lws_service_thread(unsigned int nServiceThread) {
   memset(&info, 0, sizeof info); 
   info.port = CONTEXT_PORT_NO_LISTEN; 
   info.protocols = protocols;
+  info.user = &contexts[nServiceThread];
   info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
 
   info.ka_time = nTcpKeepaliveSecs;                    // tcp keep-alive timer
@@ -421,19 +1431,46 @@ bool AudioPipe::lws_service_thread(unsigned int nServiceThread) {
   info.keepalive_timeout = 5;           // seconds to allow remote client to hold on to an idle HTTP/1.1 connection 
   info.timeout_secs_ah_idle = 10;       // secs to allow a client to hold an ah without using it
   info.retry_and_idle_policy = &retry;
+#if defined(LWS_WITH_TLS) && defined(LWS_WITH_TLS_SESSIONS)
+  if (tlsSessions.enabled()) {
+    // this vhost's own cache; sessions are shared with the other service threads through tlsSessions
+    info.tls_session_timeout = tlsSessions.ttl();
+    info.tls_session_cache_max = 64;
+  }
+#endif
+
+#ifdef __linux__
+  if (pinServiceThreads) {
+    unsigned int ncpus = std::max(1U, std::thread::hardware_concurrency());
+    int cpu = nServiceThread % ncpus;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (0 == pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) {
+      contexts[nServiceThread].cpu = cpu;
+      lwsl_notice("AudioPipe::lws_service_thread pinned service thread %d to cpu %d.\n", nServiceThread, cpu);
+    }
+    else {
+      lwsl_err("AudioPipe::lws_service_thread failed pinning service thread %d to cpu %d.\n", nServiceThread, cpu);
+    }
+  }
+#endif
 
   lwsl_notice("AudioPipe::lws_service_thread creating context in service thread %d.\n", nServiceThread);
 
-  contexts[nServiceThread] = lws_create_context(&info);
-  if (!contexts[nServiceThread]) {
+  contexts[nServiceThread].context = lws_create_context(&info);
+  if (!contexts[nServiceThread].context) {
     lwsl_err("AudioPipe::lws_service_thread failed creating context in service thread %d..\n", nServiceThread); 
     return false;
   }
+  lws_sul_schedule(contexts[nServiceThread].context, 0, &contexts[nServiceThread].loadTimer.sul, loadTick, LWS_US_PER_SEC);
 
   int n;
   do {
-    n = lws_service(contexts[nServiceThread], 0);
+    n = lws_service(contexts[nServiceThread].context, 0);
+    reap(&contexts[nServiceThread], false);
   } while (n >= 0 && !stopFlags[this_id]);
+  reap(&contexts[nServiceThread], true);
 
   // Cleanup once work is done or stopped
   {
@@ -444,14 +1481,32 @@ bool AudioPipe::lws_service_thread(unsigned int nServiceThread) {
   return true;
 }
 
-void AudioPipe::initialize(const char* protocol, unsigned int nThreads, int loglevel, log_emit_function logger) {
-  assert(nThreads > 0 && nThreads <= 10);
+void AudioPipe::initialize(const char* protocol, unsigned int nThreads, bool pinThreads, int loglevel, log_emit_function logger) {
+  assert(nThreads > 0);
 
   numContexts = nThreads;
   protocolName = protocol;
+  pinServiceThreads = pinThreads;
+  contexts = new ServiceContext[numContexts];
+  for (unsigned int i = 0; i < numContexts; i++) {
+    contexts[i].context = nullptr;
+    contexts[i].cpu = -1;
+    for (int q = 0; q < PENDING_QUEUE_COUNT; q++) contexts[i].pending[q].store(nullptr);
+    memset(&contexts[i].flushTimer.sul, 0, sizeof(contexts[i].flushTimer.sul));
+    contexts[i].flushTimer.ctx = &contexts[i];
+    memset(&contexts[i].loadTimer.sul, 0, sizeof(contexts[i].loadTimer.sul));
+    contexts[i].loadTimer.ctx = &contexts[i];
+    contexts[i].activePipes.store(0);
+    contexts[i].bytesPerSec.store(0);
+    contexts[i].lastBytesSent = 0;
+    contexts[i].spoolSignalled.store(false);
+  }
   lws_set_log_level(loglevel, logger);
+  dnsCache.start(DNS_RESOLVER_THREADS);
+  balancer.start(nHealthCheckSecs, nHealthCheckTimeoutMs);
 
-  lwsl_notice("AudioPipe::initialize starting %d threads with subprotocol %s\n", nThreads, protocol); 
+  lwsl_notice("AudioPipe::initialize starting %d threads with subprotocol %s%s\n", nThreads, protocol,
+    pinThreads ? ", pinned to cpus" : ""); 
   for (unsigned int i = 0; i < numContexts; i++) {
     std::lock_guard<std::mutex> lock(mapMutex);
     std::thread t(&AudioPipe::lws_service_thread, i);
@@ -463,6 +1518,23 @@ void AudioPipe::initialize(const char* protocol, unsigned int nThreads, int logl
 
 bool AudioPipe::deinitialize() {
   lwsl_notice("AudioPipe::deinitialize\n"); 
+  {
+    std::lock_guard<std::mutex> lk(spoolMutex);
+    spoolStop = true;
+  }
+  spoolCond.notify_one();
+  if (spoolThread.joinable()) spoolThread.join();
+  {
+    std::lock_guard<std::mutex> lk(shmMutex);
+    shmStop = true;
+  }
+  if (shmThread.joinable()) {
+    uint64_t one = 1;
+    ssize_t rc = write(shmWake, &one, sizeof(one));
+    (void) rc;
+    shmThread.join();
+  }
+
   std::lock_guard<std::mutex> lock(mapMutex);
   if (!threadIds.empty()) {
       std::thread::id id = threadIds.front();
@@ -480,85 +1552,487 @@ bool AudioPipe::deinitialize() {
   } while (pendingDisconnects.size() > 0);
 */
 
+  // no lookup may complete into a context once it is gone
+  dnsCache.stop();
   for (unsigned int i = 0; i < numContexts; i++)
   {
     lwsl_notice("AudioPipe::deinitialize destroying context %d of %d\n", i + 1, numContexts);
-    lws_context_destroy(contexts[i]);
+    lws_context_destroy(contexts[i].context);
   }
+  balancer.stop();
   std::this_thread::sleep_for(std::chrono::seconds(2));
   return true;
 }
 
 // instance members
 AudioPipe::AudioPipe(const char* uuid, const char* host, unsigned int port, const char* path,
-  int sslFlags, size_t bufLen, size_t minFreespace, const char* username, const char* password, char* bugname, notifyHandler_t callback) :
+  int sslFlags, size_t bufLen, size_t frameLen, const char* username, const char* password, char* bugname, notifyHandler_t callback) :
   m_uuid(uuid), m_host(host), m_port(port), m_path(path), m_sslFlags(sslFlags),
-  m_audio_buffer_min_freespace(minFreespace), m_audio_buffer_max_len(bufLen), m_gracefulShutdown(false),
-  m_audio_buffer_write_offset(LWS_PRE), m_recv_buf(nullptr), m_recv_buf_ptr(nullptr), m_bugname(bugname),
-  m_state(LWS_CLIENT_IDLE), m_wsi(nullptr), m_vhd(nullptr), m_callback(callback) {
+  m_audio_ring(bufLen, frameLen), m_gracefulShutdown(false),
+  m_recv_buf(nullptr), m_recv_buf_ptr(nullptr), m_bugname(bugname),
+  m_state(LWS_CLIENT_IDLE), m_wsi(nullptr), m_vhd(nullptr), m_ctx(nullptr), m_ctxReleased(false), m_callback(callback),
+  m_flushIntervalMs(0), m_nextFlush(0), m_flushRegistered(false), m_connectingInline(false), m_resolving(false),
+  m_closeRequested(false),
+  m_reconnectMaxAttempts(0), m_reconnectBackoffMs(0), m_reconnectAttempt(0), m_history(nullptr), m_streamOffset(0), m_audioQueued(0),
+  m_replay_buf(nullptr), m_replay_len(0), m_replay_sent(0), m_warm(false), m_pooled(false), m_claimed(false), m_adopt(nullptr),
+  m_playback(nullptr), m_frame_hdr_len(0), m_hdrChannels(0), m_samplesPerFrame(0), m_frameUs(0), m_frameSeq(0), m_sendPosition(0), m_sendCaptureUs(0),
+  m_send_hdr_len(0), m_multiplex(false), m_attached(false), m_gracefulSent(false), m_carrier(nullptr), m_isCarrier(false), m_muxRefs(0), m_muxDead(false), m_retired(false),
+  m_connectStartUs(0), m_established(false), m_spool(nullptr), m_spooling(false), m_spoolClosed(false),
+  m_spoolListed(false), m_spoolOpen(false), m_spoolMoved(false), m_spoolDone(false),
+  m_shm(nullptr), m_endpointIndex(0), m_pingIntervalMs(0), m_pingTimeoutMs(0), m_pingDueUs(0), m_pingSentUs(0),
+  m_pingPending(false), m_pingSeq(0), m_rttUs(0), m_dropReason(nullptr) {
+
+  for (int q = 0; q < PENDING_QUEUE_COUNT; q++) {
+    m_pending_next[q] = nullptr;
+    m_pending[q].store(false);
+  }
 
   if (username && password) {
     m_username.assign(username);
     m_password.assign(password);
   }
 
-  m_audio_buffer = new uint8_t[m_audio_buffer_max_len];
+  // owned by the service thread: audio is copied out of the ring into here, behind LWS_PRE headroom;
+  // a whole number of frames, so an encoded frame is never split between two messages
+  m_send_buf_len = std::min(m_audio_ring.capacity(), (size_t) MAX_AUDIO_WRITE_LEN);
+  m_send_buf_len = std::max(m_audio_ring.frameLen(), m_send_buf_len / m_audio_ring.frameLen() * m_audio_ring.frameLen());
+  m_send_buf = new uint8_t[LWS_PRE + m_send_buf_len];
+
+  memset(&m_timer.sul, 0, sizeof(m_timer.sul));
+  m_timer.ap = this;
+  memset(&m_pingTimer.sul, 0, sizeof(m_pingTimer.sul));
+  m_pingTimer.ap = this;
 }
 AudioPipe::~AudioPipe() {
-  if (m_audio_buffer) delete [] m_audio_buffer;
-  if (m_recv_buf) delete [] m_recv_buf;
+  for (auto it = m_text_frames.begin(); it != m_text_frames.end(); ++it) delete [] it->buf;
+  if (m_send_buf) delete [] m_send_buf;
+  if (m_recv_buf) free(m_recv_buf);
+  if (m_history) delete m_history;
+  if (m_replay_buf) delete [] m_replay_buf;
+  if (m_playback) delete m_playback;
+  if (m_spool) {
+    if (!m_retired) {
+      // retire() has already taken it off the drainer's list, unless it never connected
+      std::lock_guard<std::mutex> lk(spoolMutex);
+      spoolPipes.remove(this);
+    }
+    delete m_spool;
+  }
+  if (m_shm) delete m_shm;
+  if (!m_endpoints.empty()) balancer.release(endpointKey());
 }
 
 void AudioPipe::connect(void) {
+  if (m_shm) {
+    // the shm thread connects to the consumer; it never blocks for long, but it is no place for the media thread
+    m_connectStartUs = lws_now_usecs();
+    {
+      std::lock_guard<std::mutex> lk(shmMutex);
+      m_state = LWS_CLIENT_CONNECTING;
+      shmConnects.push_back(this);
+    }
+    uint64_t one = 1;
+    ssize_t rc = write(shmWake, &one, sizeof(one));
+    (void) rc;
+    return;
+  }
+  if (m_multiplex) {
+    joinCarrier();
+    return;
+  }
+  if (nPoolSize > 0) {
+    // hand over an idle pooled connection if there is one, and top the pool back up either way
+    std::string key = poolKey();
+    AudioPipe* warm = takeWarm(key, m_uuid);
+    refillPool(this, key);
+    if (warm) {
+      m_adopt = warm;
+      m_ctx = warm->m_ctx;
+      bindContext(this);
+      if (enqueuePending(this, PENDING_CONNECT)) lws_cancel_service(m_ctx->context);
+      return;
+    }
+  }
   addPendingConnect(this);
 }
 
 bool AudioPipe::connect_client(struct lws_per_vhost_data *vhd) {
-  assert(m_audio_buffer != nullptr);
-  assert(m_vhd == nullptr);
+  assert(m_send_buf != nullptr);
+  assert(vhd != nullptr);
 
   struct lws_client_connect_info i;
 
+  // resolve the host off the service thread; lws would otherwise block every connection on this thread in getaddrinfo
+  m_vhd = vhd;
+  if (m_state != LWS_CLIENT_CONNECTING) m_connectStartUs = lws_now_usecs();
+  bool unixSocket = '+' == m_host[0];    // lws's notation for the path of a unix domain socket
+  if (unixSocket) m_address = m_host;
+  else switch (dnsCache.lookup(m_host, m_address, onResolved, this)) {
+    case DnsCache::PENDING:
+      m_state = LWS_CLIENT_CONNECTING;
+      m_resolving = true;
+      return true;
+    case DnsCache::FAILED:
+      lwsl_notice("%s unable to resolve %s\n", m_uuid.c_str(), m_host.c_str());
+      // NB: may retire this
+      connectFailed(this, "dns lookup failed");
+      return false;
+    default:
+      break;
+  }
+
   memset(&i, 0, sizeof(i));
   i.context = vhd->context;
   i.port = m_port;
-  i.address = m_host.c_str();
+  i.address = m_address.c_str();
   i.path = m_path.c_str();
-  i.host = i.address;
-  i.origin = i.address;
+  i.host = unixSocket ? "localhost" : m_host.c_str();    // the name, for the Host header, SNI and certificate checks
+  i.origin = i.host;
   i.ssl_connection = m_sslFlags;
+#if defined(LWS_WITH_CONMON)
+  // have lws time the stages of the connection, so we can report how long the TLS handshake took
+  if (m_sslFlags & LCCSCF_USE_SSL) i.ssl_connection |= LCCSCF_CONMON;
+#endif
   i.protocol = protocolName.c_str();
   i.pwsi = &(m_wsi);
+  i.opaque_user_data = this;
 
   m_state = LWS_CLIENT_CONNECTING;
-  m_vhd = vhd;
 
+  // offer a session from an earlier handshake with this host, possibly made on another service thread;
+  // lws tags sessions with the address it connects to, so that is the key here too
+  if (m_sslFlags & LCCSCF_USE_SSL) tlsSessions.load(vhd->vhost, m_address.c_str(), m_port);
+
+  m_connectingInline = true;
   m_wsi = lws_client_connect_via_info(&i);
+  m_connectingInline = false;
   lwsl_notice("%s attempting connection, wsi is %p\n", m_uuid.c_str(), m_wsi);
 
-  return nullptr != m_wsi;
+  if (nullptr == m_wsi) {
+    // NB: may retire this
+    connectFailed(this, "unable to initiate connection");
+    return false;
+  }
+  return true;
+}
+
+// resolver thread: a lookup this pipe was waiting on has completed, so have its service thread carry on connecting
+void AudioPipe::onResolved(void* opaque) {
+  AudioPipe* ap = static_cast<AudioPipe*>(opaque);
+  if (enqueuePending(ap, PENDING_CONNECT)) lws_cancel_service(ap->m_ctx->context);
+}
+
+// service thread only: write queued text and audio until there is nothing left or the socket pushes back.
+// Returns -1 if the connection should be closed, 1 if a multiplexed stream has sent everything and can leave it.
+int AudioPipe::writeQueued(struct lws* wsi) {
+  do {
+    // check for text frames to send; each queued message goes out as its own frame, straight from its buffer
+    uint64_t textAt;
+    {
+      TextFrame frame = { nullptr, 0, false, 0 };
+      {
+        std::lock_guard<std::mutex> lk(m_text_mutex);
+        auto it = nextText(textAt);
+        if (it != m_text_frames.end()) {
+          frame = *it;
+          m_text_frames.erase(it);
+        }
+      }
+      if (frame.buf) {
+        int n = frame.len;
+        int m = lws_write(wsi, frame.buf + LWS_PRE, n, LWS_WRITE_TEXT);
+        delete [] frame.buf;
+        if (m < 0) {
+          lwsl_err("AudioPipe::writeQueued %s lws_write failed wsi %p..\n", m_uuid.c_str(), wsi); 
+          return -1;
+        }
+        countWrite(wsi, n, m, false);
+        continue;
+      }
+    }
+
+    if (m_state == LWS_CLIENT_DISCONNECTING) {
+      if (m_multiplex) return 1;
+      lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+      return -1;
+    }
+
+    // after a reconnect, audio the far end may have missed goes out ahead of anything newer
+    if (m_replay_sent < m_replay_len) {
+      size_t datalen = std::min(m_replay_len - m_replay_sent, (size_t) MAX_AUDIO_WRITE_LEN);
+      int sent = lws_write(wsi, (unsigned char *) m_replay_buf + LWS_PRE + m_replay_sent, datalen, LWS_WRITE_BINARY);
+      if (sent < 0) {
+        lwsl_err("AudioPipe::writeQueued %s lws_write failed wsi %p..\n", m_uuid.c_str(), wsi); 
+        return -1;
+      }
+      countWrite(wsi, datalen, sent, true);
+      m_replay_sent += datalen;
+      continue;
+    }
+
+    // check for audio packets from the ring, which is drained without taking any lock.  A multiplexed stream's id
+    // sits in front of the audio.  With framing on, the frame header follows it.
+    size_t hdrLen = m_send_hdr_len + m_frame_hdr_len;
+    uint8_t* payload = m_send_buf + LWS_PRE + hdrLen;
+    size_t maxLen = m_send_buf_len;
+    if (textAt) {
+      uint64_t consumed = m_audio_ring.consumed();
+      if (textAt <= consumed) continue;
+      maxLen = std::min(maxLen, (size_t) (textAt - consumed));
+    }
+    size_t datalen = m_audio_ring.pop(payload, maxLen, &m_sendPosition, &m_sendCaptureUs);
+    if (0 == datalen) break;
+    if (m_frame_hdr_len) writeFrameHeader(m_send_buf + LWS_PRE + m_send_hdr_len);
+
+    int sent = lws_write(wsi, (unsigned char *) m_send_buf + LWS_PRE, hdrLen + datalen, LWS_WRITE_BINARY);
+    if (sent < 0) {
+      lwsl_err("AudioPipe::writeQueued %s lws_write failed wsi %p..\n", m_uuid.c_str(), wsi); 
+      return -1;
+    }
+    // the whole frame is ours to forget now: what the socket did not take, lws buffers and sends ahead of anything else
+    countWrite(wsi, hdrLen + datalen, sent, true);
+    measureLatency(m_sendCaptureUs, datalen);
+    m_streamOffset += datalen;
+    if (m_history) m_history->push(payload, datalen);
+  } while (!lws_send_pipe_choked(wsi));
+
+  return 0;
+}
+
+// with m_text_mutex held: the next text frame to send, or end().  Text that keeps its place in the audio goes out in
+// turn once the audio ahead of it has; other text does not wait for it.  textAt is set to where the first frame still
+// waiting for audio sits, or 0
+std::deque<AudioPipe::TextFrame>::iterator AudioPipe::nextText(uint64_t& textAt) {
+  bool ordered = false;
+  textAt = 0;
+  for (auto it = m_text_frames.begin(); it != m_text_frames.end(); ++it) {
+    if (!it->inOrder) return it;
+    if (ordered) continue;
+    ordered = true;
+    if (textDue(*it)) return it;
+    textAt = it->position;
+  }
+  return m_text_frames.end();
 }
 
-void AudioPipe::bufferForSending(const char* text) {
-  if (m_state != LWS_CLIENT_CONNECTED) return;
+bool AudioPipe::hasQueued(void) {
   {
     std::lock_guard<std::mutex> lk(m_text_mutex);
-    m_metadata.append(text);
+    uint64_t textAt;
+    if (nextText(textAt) != m_text_frames.end()) return true;
+  }
+  return m_replay_sent < m_replay_len || !m_audio_ring.empty();
+}
+
+// service thread only: back off, then try the connection again; returns false if we should give up instead
+bool AudioPipe::scheduleReconnect(const char* reason) {
+  unsigned int attempt = m_reconnectAttempt.load();
+  if ((m_closeRequested && !hasSpooled()) || attempt >= m_reconnectMaxAttempts) return false;
+
+  // exponential backoff with jitter, so calls dropped together by a server restart do not all come back at once
+  unsigned int backoff = m_reconnectBackoffMs;
+  for (unsigned int n = 0; n < attempt && backoff < MAX_RECONNECT_BACKOFF_MS; n++) backoff <<= 1;
+  backoff = std::min(backoff, (unsigned int) MAX_RECONNECT_BACKOFF_MS);
+  uint32_t r = 0;
+  lws_get_random(m_ctx->context, &r, sizeof(r));
+  unsigned int delay = backoff / 2 + r % (backoff / 2 + 1);
+
+  m_state = LWS_CLIENT_RECONNECTING;
+  m_reconnectAttempt = attempt + 1;
+  m_counters.reconnects.fetch_add(1, std::memory_order_relaxed);
+  m_ctx->counters.reconnects.fetch_add(1, std::memory_order_relaxed);
+  m_wsi = nullptr;
+  m_replay_len = m_replay_sent = 0;
+
+  // text queued for the old connection is dropped, and the glue re-sends the initial metadata on reconnect.  Text
+  // that keeps its place in the audio stays with the audio still to be sent
+  {
+    std::lock_guard<std::mutex> lk(m_text_mutex);
+    for (auto it = m_text_frames.begin(); it != m_text_frames.end(); ) {
+      if (it->inOrder) ++it;
+      else {
+        delete [] it->buf;
+        it = m_text_frames.erase(it);
+      }
+    }
+  }
+
+  char msg[128];
+  lwsl_notice("%s reconnect attempt %u of %u in %u ms\n", m_uuid.c_str(), attempt + 1, m_reconnectMaxAttempts, delay);
+  if (reason) snprintf(msg, sizeof(msg), "{\"attempt\":%u,\"delayMs\":%u,\"reason\":\"%s\"}", attempt + 1, delay, reason);
+  else snprintf(msg, sizeof(msg), "{\"attempt\":%u,\"delayMs\":%u}", attempt + 1, delay);
+  notify(AudioPipe::RECONNECTING, msg, strlen(msg));
+
+  lws_sul_schedule(m_ctx->context, 0, &m_timer.sul, reconnectTick, delay * LWS_US_PER_MS);
+  return true;
+}
+
+// service thread only: the connection is up; the first ping goes out one interval from now
+void AudioPipe::startPing(void) {
+  m_pingDueUs = m_pingSentUs = 0;
+  m_pingPending = false;
+  if (0 == m_pingIntervalMs || m_warm) return;
+  lws_sul_schedule(m_ctx->context, 0, &m_pingTimer.sul, pingTick, m_pingIntervalMs * LWS_US_PER_MS);
+}
+
+// service thread only: the connection is going or gone
+void AudioPipe::stopPing(void) {
+  lws_sul_cancel(&m_pingTimer.sul);
+  m_pingDueUs = m_pingSentUs = 0;
+  m_pingPending = false;
+}
+
+// service thread only: the socket is writeable and a ping is due; its payload is its sequence number
+int AudioPipe::writePing(struct lws* wsi) {
+  uint8_t buf[LWS_PRE + sizeof(uint64_t)];
+  uint64_t seq = ++m_pingSeq;
+  memcpy(buf + LWS_PRE, &seq, sizeof(seq));
+  m_pingPending = false;
+  m_pingSentUs = lws_now_usecs();
+  return lws_write(wsi, buf + LWS_PRE, sizeof(seq), LWS_WRITE_PING) < (int) sizeof(seq) ? -1 : 0;
+}
+
+// service thread only: a pong came back; if it answers the outstanding ping, record the round trip and schedule the next
+void AudioPipe::pongReceived(const void* payload, size_t len) {
+  uint64_t seq;
+  if (!m_pingDueUs || !m_pingSentUs || len != sizeof(seq)) return;
+  memcpy(&seq, payload, sizeof(seq));
+  if (seq != m_pingSeq) return;
+
+  lws_usec_t now = lws_now_usecs();
+  uint64_t rtt = now - m_pingSentUs;
+  m_rttUs.store(rtt, std::memory_order_relaxed);
+  Counters* counters[] = { &m_counters, &m_ctx->counters };
+  for (Counters* c : counters) {
+    c->pongs.fetch_add(1, std::memory_order_relaxed);
+    c->pingRttUs.fetch_add(rtt, std::memory_order_relaxed);
+  }
+
+  lws_usec_t next = m_pingDueUs + m_pingIntervalMs * LWS_US_PER_MS;
+  m_pingDueUs = m_pingSentUs = 0;
+  lws_sul_schedule(m_ctx->context, 0, &m_pingTimer.sul, pingTick, next > now ? next - now : 0);
+}
+
+void AudioPipe::setEndpoints(const std::vector<EndpointBalancer::Endpoint>& endpoints) {
+  if (m_multiplex || m_shm || !m_endpoints.empty() || endpoints.empty()) return;
+  m_endpoints = endpoints;
+  m_endpointIndex = 0;
+  balancer.acquire(endpointKey());
+}
+
+// service thread only: move on to the next endpoint of the set, if any are left to try
+bool AudioPipe::failover(void) {
+  if (m_endpointIndex + 1 >= m_endpoints.size()) return false;
+  const EndpointBalancer::Endpoint& next = m_endpoints[++m_endpointIndex];
+  lwsl_notice("%s unable to connect to %s:%u, trying %s:%u\n", m_uuid.c_str(), m_host.c_str(), m_port, 
+    next.host.c_str(), next.port);
+  balancer.release(endpointKey());
+  {
+    std::lock_guard<std::mutex> lk(m_endpointMutex);
+    m_host = next.host;
+    m_port = next.port;
+  }
+  m_path = next.path;
+  m_sslFlags = next.sslFlags;
+  balancer.acquire(endpointKey());
+  return true;
+}
+
+// service thread only: announce and queue the retained audio so the far end can fill any gap left by the drop
+void AudioPipe::queueReplay(void) {
+  if (!m_history || m_history->empty()) return;
+
+  m_replay_len = m_history->peek(m_replay_buf + LWS_PRE, m_history->capacity());
+  m_replay_sent = 0;
+
+  // offset is the position of the first replayed byte in the audio stream, so the server can discard what it already has
+  char text[128];
+  snprintf(text, sizeof(text), "{\"type\":\"replay\",\"offset\":%llu,\"length\":%lu}",
+    (unsigned long long) (m_streamOffset - m_replay_len), (unsigned long) m_replay_len);
+  bufferForSending(text);
+  lwsl_notice("%s replaying %lu bytes of audio from offset %llu\n", m_uuid.c_str(), 
+    (unsigned long) m_replay_len, (unsigned long long) (m_streamOffset - m_replay_len));
+}
+
+void AudioPipe::bufferForSending(const char* text, bool inOrder) {
+  // text in order with the audio is kept for as long as the audio is, through a reconnect or into the spool
+  if (inOrder ? !isAcceptingAudio() : m_state != LWS_CLIENT_CONNECTED) return;
+
+  // the control channel keeps message boundaries itself, and the kernel queues the message for us
+  if (m_shm) {
+    size_t len = strlen(text);
+    if (m_shm->sendText(text, len)) {
+      m_counters.bytesSent.fetch_add(len, std::memory_order_relaxed);
+      m_counters.textFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+    else lwsl_notice("%s shared memory consumer is not reading, discarding text message\n", m_uuid.c_str());
+    return;
+  }
+
+  // allocated once with room for the websocket header so the service thread can write it as is
+  TextFrame frame;
+  frame.inOrder = inOrder;
+  frame.position = inOrder ? m_audioQueued : 0;    // only the media thread asks for order, and may read the count
+  frame.len = strlen(text);
+  frame.buf = new uint8_t[LWS_PRE + frame.len];
+  memcpy(frame.buf + LWS_PRE, text, frame.len);
+  {
+    std::lock_guard<std::mutex> lk(m_text_mutex);
+    m_text_frames.push_back(frame);
   }
   addPendingWrite(this);
 }
 
-void AudioPipe::unlockAudioBuffer() {
-  if (m_audio_buffer_write_offset > LWS_PRE) addPendingWrite(this);
-  m_audio_mutex.unlock();
+void AudioPipe::binaryWriteDone() {
+  if (m_shm) {
+    m_shm->ring();
+    return;
+  }
+  // in flush-tick mode the service thread collects the audio on its next tick, no wakeup needed
+  if (m_flushIntervalMs > 0) return;
+  if (!m_audio_ring.empty()) addPendingWrite(this);
+}
+
+void AudioPipe::setReconnectPolicy(unsigned int maxAttempts, unsigned int initialBackoffMs, size_t replayLen) {
+  m_reconnectMaxAttempts = maxAttempts;
+  m_reconnectBackoffMs = initialBackoffMs;
+  // replay is not supported on a multiplexed stream, or with frame headers
+  if (maxAttempts > 0 && replayLen > 0 && !m_history && !m_multiplex && !m_frame_hdr_len) {
+    m_history = new AudioRing(replayLen, m_audio_ring.frameLen());
+    m_replay_buf = new uint8_t[LWS_PRE + m_history->capacity()];
+  }
 }
 
 void AudioPipe::close() {
-  if (m_state != LWS_CLIENT_CONNECTED) return;
-  addPendingDisconnect(this);
+  if (m_shm) {
+    // the shm thread sees the channel close, and retires the pipe
+    std::lock_guard<std::mutex> lk(shmMutex);
+    m_closeRequested = true;
+    if (m_state == LWS_CLIENT_CONNECTED) m_shm->shutdown();
+    return;
+  }
+  m_closeRequested = true;
+  if (m_multiplex) {
+    // the service thread detaches the stream, leaving the connection up for any others
+    if (enqueuePending(this, PENDING_DISCONNECT)) lws_cancel_service(m_ctx->context);
+  }
+  else if (m_state == LWS_CLIENT_CONNECTED) {
+    // the spool drainer closes the connection once everything spooled has gone out
+    if (m_spool) spoolCond.notify_one();
+    else addPendingDisconnect(this);
+  }
+  else if (m_reconnectAttempt > 0) {
+    // the service thread cancels any pending retry
+    if (enqueuePending(this, PENDING_DISCONNECT)) lws_cancel_service(m_ctx->context);
+  }
 }
 
 void AudioPipe::do_graceful_shutdown() {
   m_gracefulShutdown = true;
+  if (m_shm) {
+    // the consumer finds the end of the audio marked in the ring
+    if (m_state == LWS_CLIENT_CONNECTED) m_shm->end();
+    return;
+  }
   addPendingWrite(this);
 }
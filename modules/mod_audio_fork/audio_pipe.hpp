@@ -2,14 +2,29 @@
 #define __AUDIO_PIPE_HPP__
 
 #include <string>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <list>
 #include <mutex>
 #include <queue>
 #include <unordered_map>
 #include <thread>
+#include <vector>
 
 #include <libwebsockets.h>
 
+#include "audio_ring.hpp"
+#include "audio_spool.hpp"
+#include "buffer_pool.hpp"
+#include "dns_cache.hpp"
+#include "endpoint_balancer.hpp"
+#include "latency_histogram.hpp"
+#include "playback_buffer.hpp"
+#include "shm_channel.hpp"
+#include "tls_session_cache.hpp"
+
 class AudioPipe {
 public:
   enum LwsState_t {
@@ -18,17 +33,21 @@ public:
     LWS_CLIENT_CONNECTED,
     LWS_CLIENT_FAILED,
     LWS_CLIENT_DISCONNECTING,
-    LWS_CLIENT_DISCONNECTED
+    LWS_CLIENT_DISCONNECTED,
+    LWS_CLIENT_RECONNECTING
   };
   enum NotifyEvent_t {
     CONNECT_SUCCESS,
     CONNECT_FAIL,
     CONNECTION_DROPPED,
     CONNECTION_CLOSED_GRACEFULLY,
-    MESSAGE
+    MESSAGE,
+    RECONNECTING,
+    RECONNECTED
   };
   typedef void (*log_emit_function)(int level, const char *line);
-  typedef void (*notifyHandler_t)(const char *sessionId, const char* bugname, NotifyEvent_t event, const char* message);
+  // message, when present, is NUL-terminated and only valid for the duration of the call
+  typedef void (*notifyHandler_t)(const char *sessionId, const char* bugname, NotifyEvent_t event, const char* message, size_t len);
 
   struct lws_per_vhost_data {
     struct lws_context *context;
@@ -36,38 +55,209 @@ public:
     const struct lws_protocols *protocol;
   };
 
-  static void initialize(const char* protocolName, unsigned int nThreads, int loglevel, log_emit_function logger);
+  enum PendingQueue_t {
+    PENDING_CONNECT,
+    PENDING_DISCONNECT,
+    PENDING_WRITE,
+    PENDING_QUEUE_COUNT
+  };
+
+  struct ServiceContext;
+
+  // transport counters, as reported
+  struct Stats {
+    uint64_t bytesSent;
+    uint64_t framesSent;        // binary frames
+    uint64_t textFrames;
+    uint64_t partialWrites;     // writes the socket took only part of
+    uint64_t droppedBytes;      // audio discarded on buffer overrun
+    uint64_t queueHighWater;    // most audio bytes ever waiting to be sent
+    uint64_t connects;          // connections established
+    uint64_t connectUs;         // total time from starting to connect to the websocket being up, name lookup included
+    uint64_t tlsHandshakes;
+    uint64_t tlsHandshakeUs;    // total, where lws was built with LWS_WITH_CONMON
+    uint64_t reconnects;        // reconnect attempts
+    uint64_t spooledBytes;      // audio written to disk while the connection was down or behind
+    uint64_t spoolDrainedBytes; // spooled audio since queued for sending
+    uint64_t spoolDroppedBytes; // audio lost because the spool was full or could not be written
+    uint64_t pongs;             // answers to our keepalive pings
+    uint64_t pingRttUs;         // total round trip time of those pings
+    uint64_t pingTimeouts;      // connections given up on for want of a pong
+  };
+
+  // the same, kept per pipe and summed over the pipes of each service context.  The service thread updates them,
+  // except for droppedBytes, queueHighWater and the spool counters, which the media thread and the spool drainer do.
+  // A shared memory pipe belongs to no service context, and its media thread counts what it writes
+  struct Counters {
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> framesSent;
+    std::atomic<uint64_t> textFrames;
+    std::atomic<uint64_t> partialWrites;
+    std::atomic<uint64_t> droppedBytes;
+    std::atomic<uint64_t> queueHighWater;
+    std::atomic<uint64_t> connects;
+    std::atomic<uint64_t> connectUs;
+    std::atomic<uint64_t> tlsHandshakes;
+    std::atomic<uint64_t> tlsHandshakeUs;
+    std::atomic<uint64_t> reconnects;
+    std::atomic<uint64_t> spooledBytes;
+    std::atomic<uint64_t> spoolDrainedBytes;
+    std::atomic<uint64_t> spoolDroppedBytes;
+    std::atomic<uint64_t> pongs;
+    std::atomic<uint64_t> pingRttUs;
+    std::atomic<uint64_t> pingTimeouts;
+
+    Counters() : bytesSent(0), framesSent(0), textFrames(0), partialWrites(0), droppedBytes(0), queueHighWater(0),
+      connects(0), connectUs(0), tlsHandshakes(0), tlsHandshakeUs(0), reconnects(0), 
+      spooledBytes(0), spoolDrainedBytes(0), spoolDroppedBytes(0), pongs(0), pingRttUs(0), pingTimeouts(0) {}
+    void get(Stats& stats) const {
+      stats.bytesSent = bytesSent.load(std::memory_order_relaxed);
+      stats.framesSent = framesSent.load(std::memory_order_relaxed);
+      stats.textFrames = textFrames.load(std::memory_order_relaxed);
+      stats.partialWrites = partialWrites.load(std::memory_order_relaxed);
+      stats.droppedBytes = droppedBytes.load(std::memory_order_relaxed);
+      stats.queueHighWater = queueHighWater.load(std::memory_order_relaxed);
+      stats.connects = connects.load(std::memory_order_relaxed);
+      stats.connectUs = connectUs.load(std::memory_order_relaxed);
+      stats.tlsHandshakes = tlsHandshakes.load(std::memory_order_relaxed);
+      stats.tlsHandshakeUs = tlsHandshakeUs.load(std::memory_order_relaxed);
+      stats.reconnects = reconnects.load(std::memory_order_relaxed);
+      stats.spooledBytes = spooledBytes.load(std::memory_order_relaxed);
+      stats.spoolDrainedBytes = spoolDrainedBytes.load(std::memory_order_relaxed);
+      stats.spoolDroppedBytes = spoolDroppedBytes.load(std::memory_order_relaxed);
+      stats.pongs = pongs.load(std::memory_order_relaxed);
+      stats.pingRttUs = pingRttUs.load(std::memory_order_relaxed);
+      stats.pingTimeouts = pingTimeouts.load(std::memory_order_relaxed);
+    }
+  };
+
+  // lws timer owned by a service context; kept as plain data so lws_container_of can find the owner
+  struct ContextTimer {
+    lws_sorted_usec_list_t sul;
+    ServiceContext* ctx;
+  };
+
+  // one per lws service thread; pipes are queued only to the context that owns them
+  struct ServiceContext {
+    struct lws_context *context;
+    int cpu;                                  // cpu the service thread is pinned to, or -1
+    std::atomic<AudioPipe*> pending[PENDING_QUEUE_COUNT];
+    ContextTimer flushTimer;
+    std::list<AudioPipe*> flushPipes;         // connected pipes in flush-tick mode, service thread only
+    ContextTimer loadTimer;
+    std::atomic<unsigned int> activePipes;    // pipes assigned to this context and not yet closed or failed
+    Counters counters;
+    LatencyHistogram latency;                 // capture to lws_write, per frame of audio
+    std::atomic<uint64_t> bytesPerSec;        // sampled once a second by the service thread
+    uint64_t lastBytesSent;
+    BufferPool recvPool;                      // incoming text messages, service thread only
+    std::vector<AudioPipe*> retired;          // retired pipes waiting to be deleted, service thread only
+    std::list<AudioPipe*> spoolPipes;         // spooling pipes that have connected, service thread only
+    std::atomic<bool> spoolSignalled;         // the spool drainer has flagged one of them
+  };
+
+  // per-pipe lws timer, same arrangement as ContextTimer
+  struct PipeTimer {
+    lws_sorted_usec_list_t sul;
+    AudioPipe* ap;
+  };
+
+  // idle, already upgraded connections to one destination, ready to hand to new sessions
+  struct WarmPool {
+    std::list<AudioPipe*> idle;
+    unsigned int connecting;
+    std::string hostKey;
+  };
+
+  struct ContextLoad {
+    unsigned int index;
+    int cpu;
+    unsigned int activePipes;
+    uint64_t bytesSent;
+    uint64_t bytesPerSec;
+    Stats stats;
+  };
+
+  static void initialize(const char* protocolName, unsigned int nThreads, bool pinThreads, int loglevel, log_emit_function logger);
   static bool deinitialize();
   static bool lws_service_thread(unsigned int nServiceThread);
+  static void getContextLoad(std::vector<ContextLoad>& loads);
+  // one per service context
+  static void getLatency(std::vector<LatencyHistogram::Snapshot>& snapshots);
+  // the clock audio is dated by, in microseconds since the epoch
+  static uint64_t wallClockUs(void) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+  static void getTlsSessionStats(TlsSessionCache::Stats& stats) {
+    tlsSessions.getStats(stats);
+  }
+  static void flushTlsSessions(void) {
+    tlsSessions.flush();
+  }
+  static void getDnsCache(std::vector<DnsCache::EntryInfo>& entries, DnsCache::Stats& stats) {
+    dnsCache.dump(entries, stats);
+  }
+  static void flushDnsCache(void) {
+    dnsCache.flush();
+  }
+  // put an endpoint set in order of preference for a call
+  static void balanceEndpoints(std::vector<EndpointBalancer::Endpoint>& endpoints, const std::string& uuid, 
+    EndpointBalancer::Policy_t policy) {
+    balancer.order(endpoints, uuid, policy);
+  }
+  static void getEndpoints(std::vector<EndpointBalancer::EndpointInfo>& endpoints) {
+    balancer.dump(endpoints);
+  }
 
   // constructor
   AudioPipe(const char* uuid, const char* host, unsigned int port, const char* path, int sslFlags, 
-    size_t bufLen, size_t minFreespace, const char* username, const char* password, char* bugname, notifyHandler_t callback);
+    size_t bufLen, size_t frameLen, const char* username, const char* password, char* bugname, notifyHandler_t callback);
   ~AudioPipe();  
 
   LwsState_t getLwsState(void) { return m_state; }
-  void connect(void);
-  void bufferForSending(const char* text);
-  size_t binarySpaceAvailable(void) {
-    return m_audio_buffer_max_len - m_audio_buffer_write_offset;
-  }
-  size_t binaryMinSpace(void) {
-    return m_audio_buffer_min_freespace;
+  const char* getBugname(void) const { return m_bugname.c_str(); }
+  // true while audio should still be queued: connected, or riding out a drop until a reconnect succeeds.
+  // A spooling pipe takes audio from the start, before it has connected
+  bool isAcceptingAudio(void) {
+    LwsState_t state = m_state;
+    if (m_spool) return !m_closeRequested && state != LWS_CLIENT_FAILED && state != LWS_CLIENT_DISCONNECTING && 
+      state != LWS_CLIENT_DISCONNECTED;
+    return state == LWS_CLIENT_CONNECTED || (m_reconnectAttempt > 0 && 
+      (state == LWS_CLIENT_RECONNECTING || state == LWS_CLIENT_CONNECTING));
   }
-  char * binaryWritePtr(void) { 
-    return (char *) m_audio_buffer + m_audio_buffer_write_offset;
-  }
-  void binaryWritePtrAdd(size_t len) {
-    m_audio_buffer_write_offset += len;
+  void connect(void);
+  // inOrder, from the media thread only, holds the message back until the audio already queued has gone out
+  void bufferForSending(const char* text, bool inOrder = false);
+  // called from the media thread only; returns the number of bytes of older audio dropped to make room.
+  // captureUs is when the audio was read from the channel, if not just now
+  size_t binaryWrite(const uint8_t* data, size_t len, uint64_t captureUs = 0) {
+    size_t dropped;
+    if (m_shm) return shmWrite(data, len, captureUs);
+    uint64_t endUs = m_frameUs ? (captureUs ? captureUs : wallClockUs()) : 0;
+    if (m_spool && spooling(len)) {
+      dropped = spoolWrite(data, len, endUs);
+      if (!dropped) m_audioQueued += len;
+    }
+    else {
+      dropped = m_audio_ring.push(data, len, endUs);
+      m_audioQueued += std::min(len, m_audio_ring.capacity());
+    }
+    countQueued(dropped);
+    return dropped;
   }
-  void binaryWritePtrResetToZero(void) {
-    m_audio_buffer_write_offset = 0;
+  void binaryWriteDone(void) ;
+
+  // shared memory only, media thread: where the next frame of audio can be read straight into, with room for len
+  // bytes; nullptr if this is not a shared memory pipe or its ring is full
+  uint8_t* audioSlot(size_t& len) {
+    return m_shm ? m_shm->reserve(len) : nullptr;
   }
-  void lockAudioBuffer(void) {
-    m_audio_mutex.lock();
+  // shared memory only, media thread: the slot audioSlot returned now holds len bytes, read at captureUs
+  void commitAudio(size_t len, uint64_t captureUs) {
+    m_shm->commit(len, captureUs ? captureUs : wallClockUs());
+    countShmWrite(len);
   }
-  void unlockAudioBuffer(void) ;
-  bool hasBasicAuth(void) {
+  bool hasBasicAuth(void) const {
     return !m_username.empty() && !m_password.empty();
   }
 
@@ -81,8 +271,89 @@ public:
     return m_gracefulShutdown;
   }
 
+  // 0 (default) requests a write as soon as audio is queued; otherwise audio is written once per interval
+  void setFlushInterval(unsigned int ms) {
+    m_flushIntervalMs = ms;
+  }
+
+  /**
+   * the endpoint set this pipe was balanced onto, in order of preference, the first being the one it was constructed
+   * with.  It is counted against that endpoint, and if its first connect fails it tries the next one, and so on,
+   * before giving up or falling back on the reconnect policy.  Not for multiplexed forks; call before connect
+   */
+  void setEndpoints(const std::vector<EndpointBalancer::Endpoint>& endpoints);
+
+  /**
+   * send a websocket ping every intervalMs while connected, and treat the connection as dropped by the far end if the
+   * pong is not back within timeoutMs.  0 (default) sends none; call before connect
+   */
+  void setPingPolicy(unsigned int intervalMs, unsigned int timeoutMs) {
+    m_pingIntervalMs = intervalMs;
+    m_pingTimeoutMs = timeoutMs;
+  }
+
+  // 0 attempts (default) disables reconnecting; the last replayLen bytes of audio sent are kept and re-sent after a reconnect
+  void setReconnectPolicy(unsigned int maxAttempts, unsigned int initialBackoffMs, size_t replayLen);
+
   void close() ;
 
+  // carry this fork over one connection shared with the call's other multiplexed forks to the same url; call before connect
+  void setMultiplex(void);
+  // service thread only: true if bugname is another fork sharing this fork's multiplexed connection
+  bool hasSibling(const char* bugname) const;
+
+  // how much audio one frame of the ring holds.  Audio is then dated as it is queued, and the time each frame waits
+  // to be sent is measured.  Call before connect
+  void setFrameDuration(unsigned int frameMs);
+
+  // put a header in front of the audio in every binary frame; samplesPerFrame describes one frame of the ring.
+  // Call after setFrameDuration and before connect
+  void setFrameHeader(unsigned int channels, unsigned int samplesPerFrame);
+
+  /**
+   * send audio by way of a spool on disk whenever the connection is down or more than half the buffer is waiting to
+   * go out, rather than dropping it; a background thread feeds it back in order as the connection catches up.  A
+   * failed connect is then retried under the reconnect policy, and the connection is only closed once everything
+   * spooled has been sent.  The pipe owns the spool.  Not for multiplexed forks; call before connect
+   */
+  void setSpool(AudioSpool* spool);
+
+  /**
+   * hand the audio to a consumer on this host through shared memory, with the text messages on a unix domain socket
+   * (see ShmChannel), in place of the websocket.  The pipe owns the channel.  Reconnecting, spooling, multiplexing,
+   * pooling, frame headers and audio from the server do not apply; call before connect
+   */
+  void setShm(ShmChannel* shm);
+  bool isShm(void) const {
+    return nullptr != m_shm;
+  }
+
+  // take binary frames from the server as audio to play into the call; the pipe owns the buffer.  Call before connect
+  void setPlayback(PlaybackBuffer* playback) {
+    m_playback = playback;
+  }
+  PlaybackBuffer* getPlayback(void) {
+    return m_playback;
+  }
+
+  // any thread: this pipe's counters
+  void getStats(Stats& stats) const {
+    m_counters.get(stats);
+  }
+  // the endpoint; one in a set can change while the pipe is connecting
+  std::string getHost(void) {
+    std::lock_guard<std::mutex> lk(m_endpointMutex);
+    return m_host;
+  }
+  unsigned int getPort(void) {
+    std::lock_guard<std::mutex> lk(m_endpointMutex);
+    return m_port;
+  }
+  // round trip time of the latest ping answered, 0 if none has been
+  uint64_t getRttUs(void) const {
+    return m_rttUs.load(std::memory_order_relaxed);
+  }
+
   // no default constructor or copying
   AudioPipe() = delete;
   AudioPipe(const AudioPipe&) = delete;
@@ -90,58 +361,215 @@ public:
 
 private:
 
+  struct TextFrame {
+    uint8_t* buf;
+    size_t len;
+    bool inOrder;
+    uint64_t position;    // with inOrder, the audio up to here leaves the ring first
+  };
+
   static int lws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len); 
-  static unsigned int nchild;
-  static struct lws_context *contexts[];
+  static ServiceContext* contexts;
   static unsigned int numContexts;
+  static bool pinServiceThreads;
+  static std::mutex mutex_affinity;
+  static std::unordered_map<std::string, std::pair<ServiceContext*, unsigned int> > sessionContexts;
   static std::string protocolName;
-  static std::mutex mutex_connects;
-  static std::mutex mutex_disconnects;
-  static std::mutex mutex_writes;
-  static std::list<AudioPipe*> pendingConnects;
-  static std::list<AudioPipe*> pendingDisconnects;
-  static std::list<AudioPipe*> pendingWrites;
   static log_emit_function logger;
+  static TlsSessionCache tlsSessions;
+  static DnsCache dnsCache;
+  static EndpointBalancer balancer;
+  static std::mutex poolMutex;
+  static std::unordered_map<std::string, WarmPool> warmPools;
+  static std::unordered_map<std::string, unsigned int> warmPerHost;    // idle + connecting, by host:port
+  static std::mutex muxMutex;
+  static std::unordered_map<std::string, AudioPipe*> carriers;         // open multiplexed connections, by uuid and url
+  static std::mutex spoolMutex;
+  static std::condition_variable spoolCond;
+  static std::list<AudioPipe*> spoolPipes;      // pipes with a spool, for the drainer thread
+  static std::thread spoolThread;
+  static bool spoolStop;
+  static std::mutex shmMutex;
+  static std::list<AudioPipe*> shmConnects;    // shared memory pipes waiting to be connected by shmService
+  static std::thread shmThread;
+  static int shmEpoll;
+  static int shmWake;
+  static bool shmStop;
 
   static std::mutex mapMutex;
   static std::unordered_map<std::thread::id, bool> stopFlags;
   static std::queue<std::thread::id> threadIds;
 
-  static AudioPipe* findAndRemovePendingConnect(struct lws *wsi);
   static AudioPipe* findPendingConnect(struct lws *wsi);
+  static ServiceContext* acquireContext(const std::string& uuid);
+  static void releaseContext(AudioPipe* ap);
+  static void bindContext(AudioPipe* ap);
+  static void loadTick(lws_sorted_usec_list_t *sul);
+  static bool enqueuePending(AudioPipe* ap, PendingQueue_t queue);
+  static AudioPipe* dequeueAllPending(ServiceContext* ctx, PendingQueue_t queue);
   static void addPendingConnect(AudioPipe* ap);
   static void addPendingDisconnect(AudioPipe* ap);
   static void addPendingWrite(AudioPipe* ap);
-  static void processPendingConnects(lws_per_vhost_data *vhd);
-  static void processPendingDisconnects(lws_per_vhost_data *vhd);
-  static void processPendingWrites(void);
+  static void processPendingConnects(ServiceContext* ctx, lws_per_vhost_data *vhd);
+  static void processPendingDisconnects(ServiceContext* ctx);
+  static void processPendingWrites(ServiceContext* ctx);
+  static void processSpoolSignals(ServiceContext* ctx);
+  static void flushTick(lws_sorted_usec_list_t *sul);
+  static void addFlushPipe(AudioPipe* ap);
+  static void removeFlushPipe(AudioPipe* ap);
+  static void reconnectTick(lws_sorted_usec_list_t *sul);
+  static void pingTick(lws_sorted_usec_list_t *sul);
+  static void connectFailed(AudioPipe* ap, const char* reason);
+  static void retire(AudioPipe* ap);
+  static void reap(ServiceContext* ctx, bool all);
+  static void onResolved(void* opaque);
+  static void refillPool(const AudioPipe* tmpl, const std::string& key);
+  static AudioPipe* takeWarm(const std::string& key, const std::string& uuid);
+  static void warmEstablished(AudioPipe* ap);
+  static bool releaseWarm(AudioPipe* ap);
+  static void warmIdleTick(lws_sorted_usec_list_t *sul);
+  static void adoptWarm(AudioPipe* ap, AudioPipe* warm, lws_per_vhost_data *vhd);
+  static int carrierWriteable(AudioPipe* carrier, struct lws* wsi);
+  static void attachStream(AudioPipe* ap);
+  static void leaveCarrier(AudioPipe* ap);
+  static void warmCallback(const char *sessionId, const char* bugname, NotifyEvent_t event, const char* message, size_t len) {}
+  static void spoolDrainer(void);
+  static void shmService(void);
+  static void shmConnect(AudioPipe* ap);
+  static void shmReceive(AudioPipe* ap, uint8_t* buf, size_t len);
   
   bool connect_client(struct lws_per_vhost_data *vhd);
+  std::string poolKey(void) const;
+  bool scheduleReconnect(const char* reason = nullptr);
+  void startPing(void);
+  void stopPing(void);
+  int writePing(struct lws* wsi);
+  void pongReceived(const void* payload, size_t len);
+  bool failover(void);
+  std::string endpointKey(void) const {
+    return m_host + ":" + std::to_string(m_port);
+  }
+  void queueReplay(void);
+  void notify(NotifyEvent_t event, const char* message, size_t len);
+  int writeQueued(struct lws* wsi);
+  bool hasQueued(void);
+  std::deque<TextFrame>::iterator nextText(uint64_t& textAt);
+  // audio kept for a spooling pipe and not sent yet, which a closed fork still waits for
+  bool hasSpooled(void) const {
+    return m_spool && !(m_spool->empty() && m_audio_ring.empty());
+  }
+  bool textDue(const TextFrame& frame) const {
+    return !frame.inOrder || frame.position <= m_audio_ring.consumed();
+  }
+  void joinCarrier(void);
+  void allocSendBuffer(void);
+  void writeFrameHeader(uint8_t* p);
+  void countQueued(size_t dropped);
+  void countWrite(struct lws* wsi, size_t offered, int sent, bool binary);
+  void countEstablished(struct lws* wsi);
+  void measureLatency(uint64_t captureUs, size_t len);
+  bool spooling(size_t len);
+  size_t spoolWrite(const uint8_t* data, size_t len, uint64_t endUs);
+  void drainSpool(void);
+  void openSpool(void);
+  size_t shmWrite(const uint8_t* data, size_t len, uint64_t captureUs);
+  void countShmWrite(size_t len);
+  bool ringHasRoom(size_t len) const {
+    return m_audio_ring.empty() || m_audio_ring.size() + len <= m_audio_ring.capacity() / 2;
+  }
 
   LwsState_t m_state;
   std::string m_uuid;
   std::string m_host;
+  std::string m_address;    // what m_host resolved to for the current connection attempt
   std::string m_bugname;
   unsigned int m_port;
   std::string m_path;
-  std::string m_metadata;
+  std::deque<TextFrame> m_text_frames;    // payload at buf + LWS_PRE
   std::mutex m_text_mutex;
-  std::mutex m_audio_mutex;
   int m_sslFlags;
   struct lws *m_wsi;
-  uint8_t *m_audio_buffer;
-  size_t m_audio_buffer_max_len;
-  size_t m_audio_buffer_write_offset;
-  size_t m_audio_buffer_min_freespace;
+  AudioRing m_audio_ring;
+  uint8_t *m_send_buf;
+  size_t m_send_buf_len;
   uint8_t* m_recv_buf;
   uint8_t* m_recv_buf_ptr;
   size_t m_recv_buf_len;
   struct lws_per_vhost_data* m_vhd;
+  ServiceContext* m_ctx;
+  bool m_ctxReleased;
+  AudioPipe* m_pending_next[PENDING_QUEUE_COUNT];
+  std::atomic<bool> m_pending[PENDING_QUEUE_COUNT];
   notifyHandler_t m_callback;
   log_emit_function m_logger;
   std::string m_username;
   std::string m_password;
   bool m_gracefulShutdown;
+  unsigned int m_flushIntervalMs;
+  lws_usec_t m_nextFlush;
+  std::list<AudioPipe*>::iterator m_flushIt;
+  bool m_flushRegistered;
+  bool m_connectingInline;    // inside lws_client_connect_via_info, which can report errors before returning
+  bool m_resolving;           // waiting on dnsCache, which holds a pointer to us until it calls back
+  std::atomic<bool> m_closeRequested;
+  unsigned int m_reconnectMaxAttempts;
+  unsigned int m_reconnectBackoffMs;
+  std::atomic<unsigned int> m_reconnectAttempt;    // non-zero from a drop until the next successful connect
+  PipeTimer m_timer;          // reconnect backoff, or idle expiry for a pooled connection
+  AudioRing* m_history;       // audio already written to the socket, kept for replay; service thread only
+  uint64_t m_streamOffset;    // total audio bytes written, i.e. the offset of the next live byte
+  uint64_t m_audioQueued;     // total audio bytes put in the ring or the spool, where the ring's stream will reach; media thread only
+  uint8_t* m_replay_buf;      // replayed audio at m_replay_buf + LWS_PRE
+  size_t m_replay_len;
+  size_t m_replay_sent;
+  bool m_warm;                // a pooled connection not yet handed to a session
+  bool m_pooled;              // counted in its WarmPool; guarded by poolMutex
+  bool m_claimed;             // taken by a session that has not adopted it yet; guarded by poolMutex
+  std::string m_poolKey;
+  AudioPipe* m_adopt;         // warm pipe whose connection this pipe takes over when its connect is processed
+  size_t m_send_hdr_len;      // stream id ahead of the audio in m_send_buf, for a multiplexed fork
+  bool m_multiplex;           // a stream on a shared connection, which m_carrier owns
+  bool m_attached;            // in m_carrier->m_streams; service thread only
+  bool m_gracefulSent;        // the end-of-stream frame has gone out; service thread only
+  AudioPipe* m_carrier;
+  bool m_isCarrier;           // the shared connection itself, with no session of its own
+  std::list<AudioPipe*> m_streams;    // service thread only
+  std::string m_muxKey;
+  unsigned int m_muxRefs;     // streams that joined and have not left yet; guarded by muxMutex
+  bool m_muxDead;             // retired, but kept for streams still to attach; guarded by muxMutex
+  bool m_retired;             // finished with; deleted once out of every pending queue.  Service thread only
+  size_t m_frame_hdr_len;     // frame header after any stream id in m_send_buf, when framing is on
+  unsigned int m_hdrChannels;
+  unsigned int m_samplesPerFrame;
+  uint64_t m_frameUs;
+  uint32_t m_frameSeq;
+  uint64_t m_sendPosition;    // stream position of the audio in m_send_buf, and when it was captured
+  uint64_t m_sendCaptureUs;
+  PlaybackBuffer* m_playback;
+  Counters m_counters;
+  lws_usec_t m_connectStartUs;    // when the current connection attempt began, name lookup included
+  bool m_established;         // has connected at least once; service thread only
+  AudioSpool* m_spool;
+  bool m_spooling;            // new audio goes to the spool until the drainer has caught up; media thread only
+  bool m_spoolClosed;         // the drainer has asked for the connection to close after the last of the spool; drainer only
+  bool m_spoolListed;         // on the context's spoolPipes; service thread only
+  std::list<AudioPipe*>::iterator m_spoolIt;
+  std::atomic<bool> m_spoolOpen;    // connected, so the drainer may move audio into the ring; set by the service thread
+  std::atomic<bool> m_spoolMoved;   // the drainer has put audio in the ring
+  std::atomic<bool> m_spoolDone;    // the drainer has sent the last of the audio of a closed fork
+  ShmChannel* m_shm;
+  std::vector<EndpointBalancer::Endpoint> m_endpoints;    // the set, when balanced; service thread only once connecting
+  size_t m_endpointIndex;     // the one in use
+  std::mutex m_endpointMutex; // guards m_host and m_port while they can change
+  unsigned int m_pingIntervalMs;
+  unsigned int m_pingTimeoutMs;
+  PipeTimer m_pingTimer;      // next ping, or the deadline for the pong to the last one
+  lws_usec_t m_pingDueUs;     // when the unanswered ping was asked for, 0 if none is outstanding; service thread only
+  lws_usec_t m_pingSentUs;    // when it was written
+  bool m_pingPending;         // waiting for the socket to be writeable to send it
+  uint64_t m_pingSeq;         // payload of the latest ping, so a stale pong is not taken for its answer
+  std::atomic<uint64_t> m_rttUs;
+  const char* m_dropReason;   // why we took the connection down ourselves, if we did; service thread only
 };
 
 #endif
@@ -0,0 +1,152 @@
+#ifndef __AUDIO_RING_HPP__
+#define __AUDIO_RING_HPP__
+
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * single-producer / single-consumer ring of linear audio.
+ *
+ * The media thread pushes and the lws service thread pops; neither side takes a lock.
+ * On overrun the producer discards the oldest audio a frame (e.g. 20 ms) at a time,
+ * which it does by advancing the read index with a CAS.  The consumer copies out and
+ * then claims what it copied with a CAS on the same index; if the producer dropped
+ * frames in the meantime the claim fails and the consumer simply copies again.
+ */
+class AudioRing {
+public:
+  AudioRing(size_t capacity, size_t frameLen) :
+    m_frameLen(std::max(frameLen, (size_t) 1)), m_head(0), m_tail(0), m_dropped(0), m_times(nullptr), m_timeSlots(0), m_frameUs(0) {
+    m_capacity = std::max(m_frameLen, (capacity + m_frameLen - 1) / m_frameLen * m_frameLen);
+    m_data = new uint8_t[m_capacity];
+  }
+  ~AudioRing() {
+    delete [] m_data;
+    if (m_times) delete [] m_times;
+  }
+
+  /**
+   * keep the capture time of every frame from now on, frameUs being the length of a frame; call before the first push.
+   * There is one slot more than the ring holds frames, so a slot is only reused once its frame is wholly consumed.
+   */
+  void enableTimestamps(uint64_t frameUs) {
+    m_frameUs = frameUs;
+    m_timeSlots = m_capacity / m_frameLen + 1;
+    m_times = new uint64_t[m_timeSlots];
+    memset(m_times, 0, m_timeSlots * sizeof(uint64_t));
+  }
+
+  // producer: append audio, dropping the oldest frames if needed; returns the number of bytes dropped.
+  // endUs, with timestamps enabled, is the wall clock time in microseconds of the end of the audio.
+  size_t push(const uint8_t* data, size_t len, uint64_t endUs = 0) {
+    size_t dropped = 0;
+    if (len > m_capacity) {
+      dropped += len - m_capacity;
+      data += len - m_capacity;
+      len = m_capacity;
+    }
+
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    uint64_t tail = m_tail.load(std::memory_order_acquire);
+    while (m_capacity - (head - tail) < len) {
+      uint64_t n = std::min((uint64_t) m_frameLen, head - tail);
+      if (m_tail.compare_exchange_weak(tail, tail + n, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        dropped += n;
+        tail += n;
+      }
+    }
+
+    // date each frame that starts in this audio, counting back from its end
+    if (m_times) {
+      for (uint64_t f = (head + m_frameLen - 1) / m_frameLen * m_frameLen; f < head + len; f += m_frameLen) {
+        m_times[(f / m_frameLen) % m_timeSlots] = endUs - (head + len - f) * m_frameUs / m_frameLen;
+      }
+    }
+
+    size_t offset = head % m_capacity;
+    size_t first = std::min(len, m_capacity - offset);
+    memcpy(m_data + offset, data, first);
+    if (first < len) memcpy(m_data, data + first, len - first);
+    m_head.store(head + len, std::memory_order_release);
+
+    if (dropped) m_dropped.fetch_add(dropped, std::memory_order_relaxed);
+    return dropped;
+  }
+
+  // consumer: copy up to maxLen bytes of the oldest audio into dst and remove it from the ring; optionally
+  // return where it sits in the stream of everything ever pushed, and (with timestamps enabled) when it was captured
+  size_t pop(uint8_t* dst, size_t maxLen, uint64_t* position = nullptr, uint64_t* captureUs = nullptr) {
+    uint64_t tail = m_tail.load(std::memory_order_acquire);
+    while (true) {
+      uint64_t head = m_head.load(std::memory_order_acquire);
+      size_t len = std::min((uint64_t) maxLen, head - tail);
+      if (0 == len) return 0;
+
+      size_t offset = tail % m_capacity;
+      size_t first = std::min(len, m_capacity - offset);
+      memcpy(dst, m_data + offset, first);
+      if (first < len) memcpy(dst + first, m_data, len - first);
+      if (position) *position = tail;
+      if (captureUs && m_times) {
+        uint64_t frame = tail / m_frameLen;
+        *captureUs = m_times[frame % m_timeSlots] + (tail - frame * m_frameLen) * m_frameUs / m_frameLen;
+      }
+
+      // fails only if the producer dropped frames underneath us, in which case tail is reloaded
+      if (m_tail.compare_exchange_strong(tail, tail + len, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return len;
+      }
+    }
+  }
+
+  // copy up to maxLen bytes of the oldest audio without removing it; only safe when nothing is pushing concurrently
+  size_t peek(uint8_t* dst, size_t maxLen) const {
+    uint64_t tail = m_tail.load(std::memory_order_acquire);
+    size_t len = std::min((uint64_t) maxLen, m_head.load(std::memory_order_acquire) - tail);
+    size_t offset = tail % m_capacity;
+    size_t first = std::min(len, m_capacity - offset);
+    memcpy(dst, m_data + offset, first);
+    if (first < len) memcpy(dst + first, m_data, len - first);
+    return len;
+  }
+
+  // total bytes ever consumed or dropped, i.e. the position in the stream of the oldest audio still in the ring
+  uint64_t consumed(void) const {
+    return m_tail.load(std::memory_order_acquire);
+  }
+  size_t size(void) const {
+    return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+  }
+  bool empty(void) const {
+    return 0 == size();
+  }
+  size_t capacity(void) const {
+    return m_capacity;
+  }
+  size_t frameLen(void) const {
+    return m_frameLen;
+  }
+  uint64_t droppedBytes(void) const {
+    return m_dropped.load(std::memory_order_relaxed);
+  }
+
+  // no default constructor or copying
+  AudioRing() = delete;
+  AudioRing(const AudioRing&) = delete;
+  void operator=(const AudioRing&) = delete;
+
+private:
+  uint8_t* m_data;
+  size_t m_capacity;
+  size_t m_frameLen;
+  std::atomic<uint64_t> m_head;   // total bytes ever written; owned by the producer
+  std::atomic<uint64_t> m_tail;   // total bytes ever consumed or dropped
+  std::atomic<uint64_t> m_dropped;
+  uint64_t* m_times;      // capture time of each frame's first byte, by frame number modulo m_timeSlots
+  size_t m_timeSlots;
+  uint64_t m_frameUs;
+};
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef __AUDIO_SPOOL_HPP__
+#define __AUDIO_SPOOL_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * overflow for a fork's audio, on disk, for when the far end cannot take it as fast as it comes.
+ *
+ * Audio is appended to a chain of segment files, each preallocated to a fixed size and memory-mapped, so an
+ * append is a copy into the page cache.  One thread appends (the media thread) and one consumes (the drainer),
+ * without locking each other out: each segment publishes how much of it has been written, and the mutex is
+ * only taken to move from one segment to the next.  The consumer can prepare a spare segment ahead of time
+ * so the producer seldom has to create a file itself.  Segments are deleted as soon as they have been
+ * consumed, and whatever is left when the spool is destroyed.
+ *
+ * Each piece of audio is stored with the capture time of its end, so it keeps its place in time when replayed.
+ */
+class AudioSpool {
+public:
+  AudioSpool(const std::string& prefix, size_t segmentLen, size_t maxLen) :
+    m_prefix(prefix), m_segmentLen(std::max(segmentLen, (size_t) MIN_SEGMENT_LEN)), m_maxLen(maxLen),
+    m_writeSeg(nullptr), m_readSeg(nullptr), m_spare(nullptr), m_readLen(0), m_seq(0),
+    m_appended(0), m_consumed(0), m_segments(0) {}
+  ~AudioSpool() {
+    for (auto it = m_chain.begin(); it != m_chain.end(); ++it) destroySegment(*it);
+    if (m_spare) destroySegment(m_spare);
+  }
+
+  // producer: append audio, endUs being when its last sample was captured; false if the spool is full or a segment
+  // could not be created, in which case the audio is not kept
+  bool append(const uint8_t* data, size_t len, uint64_t endUs) {
+    size_t recLen = RECORD_HEADER_LEN + len;
+    if (recLen > m_segmentLen) return false;
+    if (m_appended.load(std::memory_order_relaxed) - m_consumed.load(std::memory_order_acquire) + len > m_maxLen) return false;
+
+    size_t end = m_writeSeg ? m_writeSeg->end.load(std::memory_order_relaxed) : 0;
+    if (!m_writeSeg || m_writeSeg->len - end < recLen) {
+      Segment* next = nullptr;
+      {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        std::swap(next, m_spare);
+      }
+      if (!next && !(next = createSegment())) return false;
+      if (m_writeSeg) m_writeSeg->sealed.store(true, std::memory_order_release);
+      {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_chain.push_back(next);
+      }
+      m_writeSeg = next;
+      end = 0;
+    }
+
+    uint32_t n = (uint32_t) len;
+    uint8_t* p = m_writeSeg->base + end;
+    memcpy(p, &n, sizeof(n));
+    memcpy(p + sizeof(n), &endUs, sizeof(endUs));
+    memcpy(p + RECORD_HEADER_LEN, data, len);
+    m_writeSeg->end.store(end + recLen, std::memory_order_release);
+    m_appended.fetch_add(len, std::memory_order_release);
+    return true;
+  }
+
+  // consumer: the oldest audio not yet consumed, left where it is until consume(); false if there is none
+  bool peek(const uint8_t*& data, size_t& len, uint64_t& endUs) {
+    while (true) {
+      if (!m_readSeg) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_chain.empty()) return false;
+        m_readSeg = m_chain.front();
+      }
+      Segment* seg = m_readSeg;
+      if (seg->readPos < seg->end.load(std::memory_order_acquire)) {
+        uint32_t n;
+        const uint8_t* p = seg->base + seg->readPos;
+        memcpy(&n, p, sizeof(n));
+        memcpy(&endUs, p + sizeof(n), sizeof(endUs));
+        data = p + RECORD_HEADER_LEN;
+        len = m_readLen = n;
+        return true;
+      }
+
+      // the producer seals a segment after its last append, so once it is sealed and read to the end it is done with
+      if (!seg->sealed.load(std::memory_order_acquire)) return false;
+      if (seg->readPos < seg->end.load(std::memory_order_acquire)) continue;
+      {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_chain.pop_front();
+      }
+      destroySegment(seg);
+      m_readSeg = nullptr;
+    }
+  }
+
+  // consumer: done with what peek returned
+  void consume(void) {
+    m_readSeg->readPos += RECORD_HEADER_LEN + m_readLen;
+    m_consumed.fetch_add(m_readLen, std::memory_order_release);
+    m_readLen = 0;
+  }
+
+  // consumer: once the spool is in use, keep a segment ready for the producer to move on to
+  void prepare(void) {
+    if (0 == m_appended.load(std::memory_order_acquire)) return;
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      if (m_spare) return;
+    }
+    Segment* spare = createSegment();
+    if (!spare) return;
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (m_spare) destroySegment(spare);
+    else m_spare = spare;
+  }
+
+  // any thread: bytes of audio appended and not yet consumed
+  size_t pending(void) const {
+    return m_appended.load(std::memory_order_acquire) - m_consumed.load(std::memory_order_acquire);
+  }
+  bool empty(void) const {
+    return 0 == pending();
+  }
+  uint64_t segmentsCreated(void) const {
+    return m_segments.load(std::memory_order_relaxed);
+  }
+
+  // no default constructor or copying
+  AudioSpool() = delete;
+  AudioSpool(const AudioSpool&) = delete;
+  void operator=(const AudioSpool&) = delete;
+
+private:
+  static const size_t MIN_SEGMENT_LEN = 64 * 1024;
+  static const size_t RECORD_HEADER_LEN = sizeof(uint32_t) + sizeof(uint64_t);
+
+  struct Segment {
+    std::string path;
+    uint8_t* base;
+    size_t len;
+    std::atomic<size_t> end;        // bytes written, published by the producer
+    std::atomic<bool> sealed;       // the producer has moved on to a later segment
+    size_t readPos;                 // consumer only
+  };
+
+  Segment* createSegment(void) {
+    std::string path = m_prefix + "_" + std::to_string(m_seq++) + ".spool";
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return nullptr;
+
+    // reserve the blocks up front, so a full disk shows up here rather than as a fault on a later write
+    int err = posix_fallocate(fd, 0, m_segmentLen);
+    if (EINVAL == err || EOPNOTSUPP == err) err = ftruncate(fd, m_segmentLen);
+    void* base = 0 == err ? mmap(nullptr, m_segmentLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (MAP_FAILED == base) {
+      std::remove(path.c_str());
+      return nullptr;
+    }
+
+    Segment* seg = new Segment;
+    seg->path = path;
+    seg->base = (uint8_t *) base;
+    seg->len = m_segmentLen;
+    seg->end.store(0);
+    seg->sealed.store(false);
+    seg->readPos = 0;
+    m_segments.fetch_add(1, std::memory_order_relaxed);
+    return seg;
+  }
+
+  static void destroySegment(Segment* seg) {
+    munmap(seg->base, seg->len);
+    std::remove(seg->path.c_str());
+    delete seg;
+  }
+
+  std::string m_prefix;
+  size_t m_segmentLen;
+  size_t m_maxLen;
+  std::mutex m_mutex;               // guards m_chain and m_spare
+  std::deque<Segment*> m_chain;     // oldest first
+  Segment* m_writeSeg;              // producer only
+  Segment* m_readSeg;               // consumer only
+  Segment* m_spare;
+  size_t m_readLen;                 // of the audio last peeked; consumer only
+  std::atomic<uint64_t> m_seq;
+  std::atomic<uint64_t> m_appended;
+  std::atomic<uint64_t> m_consumed;
+  std::atomic<uint64_t> m_segments;
+};
+
+#endif
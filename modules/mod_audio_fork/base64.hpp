@@ -5,6 +5,10 @@
     done by Peter Thorson (webmaster@zaphoyd.com) in 2012. All modifications to
     the code are redistributed under the same license as the original, which is
     listed below.
+
+    The decoder was later rewritten for mod_audio_fork to decode into a
+    caller-provided buffer (or in place), using SSSE3/AVX2 where the CPU
+    supports it.
     ******
 
    base64.cpp and base64.h
@@ -37,6 +41,13 @@
 #define _BASE64_HPP_
 
 #include <string>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_SIMD 1
+#include <immintrin.h>
+#endif
 
 namespace drachtio {
 
@@ -123,53 +134,206 @@ inline std::string base64_encode(std::string const & input) {
     );
 }
 
-/// Decode a base64 encoded string into a string of raw bytes
-/**
- * @param input The base64 encoded input data
- * @return A string representing the decoded raw bytes
- */
-inline std::string base64_decode(std::string const & input) {
-    size_t in_len = input.size();
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-    std::string ret;
+namespace detail {
 
-    while (in_len-- && ( input[in_] != '=') && is_base64(input[in_])) {
-        char_array_4[i++] = input[in_]; in_++;
-        if (i ==4) {
-            for (i = 0; i <4; i++) {
-                char_array_4[i] = static_cast<unsigned char>(base64_chars.find(char_array_4[i]));
-            }
+/// 6-bit value of each base64 character, or 0xff for anything else
+inline const unsigned char * base64_decode_table() {
+    struct table {
+        unsigned char v[256];
+        table() {
+            for (int i = 0; i < 256; i++) v[i] = 0xff;
+            for (int i = 0; i < 64; i++) v[static_cast<unsigned char>(base64_chars[i])] = static_cast<unsigned char>(i);
+        }
+    };
+    static const table t;
+    return t.v;
+}
 
-            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+/// Decode a quantum at a time, stopping at '=' or the first character that
+/// is not base64; a partial quantum at the end yields what bytes it can
+inline size_t base64_decode_scalar(const unsigned char * in, size_t len, unsigned char * out) {
+    const unsigned char * table = base64_decode_table();
+    unsigned char * o = out;
+    size_t i = 0;
+
+    while (len - i >= 4) {
+        unsigned char a = table[in[i]], b = table[in[i + 1]], c = table[in[i + 2]], d = table[in[i + 3]];
+        if ((a | b | c | d) & 0x80) break;
+        *o++ = static_cast<unsigned char>((a << 2) | (b >> 4));
+        *o++ = static_cast<unsigned char>((b << 4) | (c >> 2));
+        *o++ = static_cast<unsigned char>((c << 6) | d);
+        i += 4;
+    }
 
-            for (i = 0; (i < 3); i++) {
-                ret += char_array_3[i];
-            }
-            i = 0;
-        }
+    unsigned char quad[4] = {0, 0, 0, 0};
+    int n = 0;
+    while (i < len && n < 3 && table[in[i]] != 0xff) quad[n++] = table[in[i++]];
+    if (n > 1) *o++ = static_cast<unsigned char>((quad[0] << 2) | (quad[1] >> 4));
+    if (n > 2) *o++ = static_cast<unsigned char>((quad[1] << 4) | (quad[2] >> 2));
+    return o - out;
+}
+
+#ifdef BASE64_SIMD
+
+/*
+ * The vector decoders translate 16 (or 32) characters at once using nibble
+ * lookup tables, after W. Mula and D. Lemire, "Faster Base64 Encoding and
+ * Decoding using AVX2 Instructions".  A block containing anything other than
+ * the 64 base64 characters - padding, whitespace, the end of the data - is
+ * left to the scalar decoder.  Each block is read before its output is
+ * stored, and the output lags the input, so out may equal in.
+ *
+ * Every store is a full vector, of which only 12 (or 24) bytes are decoded
+ * data, so a block is only taken while at least that much output room
+ * remains: 24 characters left for SSE, 44 for AVX2.
+ */
+
+__attribute__((target("ssse3")))
+inline size_t base64_decode_ssse3(const unsigned char * in, size_t len, unsigned char * out, size_t * consumed) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0, o = 0;
+
+    while (len - i >= 24) {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()))) break;
+
+        const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+
+        // 4 x 6 bits -> 3 bytes per quantum, then drop the empty fourth byte of each
+        str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+        str = _mm_shuffle_epi8(str, pack);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + o), str);
+        i += 16;
+        o += 12;
     }
+    *consumed = i;
+    return o;
+}
 
-    if (i) {
-        for (j = i; j <4; j++)
-            char_array_4[j] = 0;
+__attribute__((target("avx2")))
+inline size_t base64_decode_avx2(const unsigned char * in, size_t len, unsigned char * out, size_t * consumed) {
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+    size_t i = 0, o = 0;
+
+    while (len - i >= 44) {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) break;
+
+        const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+        const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+        str = _mm256_shuffle_epi8(str, pack);
+        str = _mm256_permutevar8x32_epi32(str, lanes);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + o), str);
+        i += 32;
+        o += 24;
+    }
+    *consumed = i;
+    return o;
+}
 
-        for (j = 0; j <4; j++)
-            char_array_4[j] = static_cast<unsigned char>(base64_chars.find(char_array_4[j]));
+enum base64_isa { BASE64_SCALAR, BASE64_SSSE3, BASE64_AVX2 };
 
-        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+inline base64_isa base64_detect() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return BASE64_AVX2;
+    if (__builtin_cpu_supports("ssse3")) return BASE64_SSSE3;
+    return BASE64_SCALAR;
+}
 
-        for (j = 0; (j < i - 1); j++) {
-            ret += static_cast<std::string::value_type>(char_array_3[j]);
-        }
+#endif // BASE64_SIMD
+
+} // namespace detail
+
+/// The most bytes that decoding len base64 characters can produce
+inline size_t base64_decoded_size(size_t len) {
+    return len / 4 * 3 + 2;
+}
+
+/// Decode base64 into a caller-provided buffer
+/**
+ * Decoding stops at the first '=' or character that is not base64, as it
+ * always has. out may be the same buffer as in, to decode in place.
+ *
+ * @param in The base64 encoded input data
+ * @param len The length of input in characters
+ * @param out Where to put the decoded bytes; at least base64_decoded_size(len)
+ * @return The number of bytes decoded
+ */
+inline size_t base64_decode(const char * in, size_t len, unsigned char * out) {
+    const unsigned char * src = reinterpret_cast<const unsigned char *>(in);
+    size_t o = 0;
+#ifdef BASE64_SIMD
+    static const detail::base64_isa isa = detail::base64_detect();
+    size_t consumed = 0;
+    if (isa == detail::BASE64_AVX2) {
+        o = detail::base64_decode_avx2(src, len, out, &consumed);
+        src += consumed;
+        len -= consumed;
     }
+    if (isa != detail::BASE64_SCALAR) {
+        // picks up any whole 16 character blocks the wider loop left behind
+        size_t n = detail::base64_decode_ssse3(src, len, out + o, &consumed);
+        o += n;
+        src += consumed;
+        len -= consumed;
+    }
+#endif
+    return o + detail::base64_decode_scalar(src, len, out + o);
+}
+
+/// Decode a nul-terminated base64 string over itself
+/**
+ * @param str The base64 encoded input data; overwritten by the decoded bytes
+ * @return The number of bytes decoded, which are no longer nul-terminated
+ */
+inline size_t base64_decode_inplace(char * str) {
+    size_t len = 0;
+    while (str[len]) len++;
+    return base64_decode(str, len, reinterpret_cast<unsigned char *>(str));
+}
 
+/// Decode a base64 encoded string into a string of raw bytes
+/**
+ * @param input The base64 encoded input data
+ * @return A string representing the decoded raw bytes
+ */
+inline std::string base64_decode(std::string const & input) {
+    std::string ret(base64_decoded_size(input.size()), '\0');
+    ret.resize(base64_decode(input.data(), input.size(), reinterpret_cast<unsigned char *>(&ret[0])));
     return ret;
 }
 
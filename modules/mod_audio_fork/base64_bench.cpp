@@ -0,0 +1,110 @@
+/**
+ * times base64 decoding of playAudio-sized clips: the byte-at-a-time decoder base64.hpp used to have, the table
+ * driven scalar decoder on its own, and base64_decode / base64_decode_inplace with whatever vector path the cpu has.
+ *
+ *   make check && ./base64_bench [clip KB] [iterations]
+ */
+#include "base64.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+  // the decoder base64.hpp had before it was vectorized, kept for comparison
+  std::string legacy_base64_decode(std::string const & input) {
+    size_t in_len = input.size();
+    int i = 0;
+    int j = 0;
+    int in_ = 0;
+    unsigned char char_array_4[4], char_array_3[3];
+    std::string ret;
+
+    while (in_len-- && ( input[in_] != '=') && drachtio::is_base64(input[in_])) {
+      char_array_4[i++] = input[in_]; in_++;
+      if (i ==4) {
+        for (i = 0; i <4; i++) {
+          char_array_4[i] = static_cast<unsigned char>(drachtio::base64_chars.find(char_array_4[i]));
+        }
+        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+        for (i = 0; (i < 3); i++) ret += char_array_3[i];
+        i = 0;
+      }
+    }
+    if (i) {
+      for (j = i; j <4; j++) char_array_4[j] = 0;
+      for (j = 0; j <4; j++) char_array_4[j] = static_cast<unsigned char>(drachtio::base64_chars.find(char_array_4[j]));
+      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+      for (j = 0; (j < i - 1); j++) ret += static_cast<std::string::value_type>(char_array_3[j]);
+    }
+    return ret;
+  }
+
+  // runs fn iterations times and reports the mean time per clip and the throughput over the encoded input
+  template<typename F>
+  void measure(const char* name, size_t encodedLen, int iterations, F fn) {
+    size_t check = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; n++) check += fn();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-24s %10.3f us/clip %10.1f MB/s   (%lu)\n", name, secs * 1e6 / iterations,
+      encodedLen * (double) iterations / secs / 1e6, (unsigned long) check);
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t clipKB = argc > 1 ? std::max(1, ::atoi(argv[1])) : 400;
+  int iterations = argc > 2 ? std::max(1, ::atoi(argv[2])) : 200;
+
+  // random bytes stand in for audio; base64 neither knows nor cares
+  std::vector<unsigned char> raw(clipKB * 1024);
+  std::mt19937 rng(42);
+  for (size_t i = 0; i < raw.size(); i++) raw[i] = static_cast<unsigned char>(rng());
+  const std::string encoded = drachtio::base64_encode(raw.data(), raw.size());
+
+  std::vector<unsigned char> out(drachtio::base64_decoded_size(encoded.size()));
+  std::vector<char> work(encoded.size() + 1);
+
+  // all of them must agree with the old decoder before any timing means anything
+  const std::string expected = legacy_base64_decode(encoded);
+  size_t n = drachtio::detail::base64_decode_scalar(reinterpret_cast<const unsigned char *>(encoded.data()), encoded.size(), out.data());
+  bool ok = n == expected.size() && 0 == memcmp(out.data(), expected.data(), n);
+  n = drachtio::base64_decode(encoded.data(), encoded.size(), out.data());
+  ok = ok && n == expected.size() && 0 == memcmp(out.data(), expected.data(), n);
+  memcpy(work.data(), encoded.c_str(), encoded.size() + 1);
+  n = drachtio::base64_decode_inplace(work.data());
+  ok = ok && n == expected.size() && 0 == memcmp(work.data(), expected.data(), n);
+  if (!ok || expected.size() != raw.size()) {
+    fprintf(stderr, "decoders disagree\n");
+    return 1;
+  }
+
+  printf("%lu KB clip, %lu base64 characters, %d iterations\n", (unsigned long) clipKB, (unsigned long) encoded.size(), iterations);
+  measure("legacy", encoded.size(), iterations, [&]() {
+    return legacy_base64_decode(encoded).size();
+  });
+  measure("scalar", encoded.size(), iterations, [&]() {
+    return drachtio::detail::base64_decode_scalar(reinterpret_cast<const unsigned char *>(encoded.data()), encoded.size(),
+      out.data());
+  });
+  measure("base64_decode", encoded.size(), iterations, [&]() {
+    return drachtio::base64_decode(encoded.data(), encoded.size(), out.data());
+  });
+
+  // the copy back in is part of each iteration here, as the string is decoded over itself
+  measure("base64_decode_inplace", encoded.size(), iterations, [&]() {
+    memcpy(work.data(), encoded.c_str(), encoded.size() + 1);
+    return drachtio::base64_decode_inplace(work.data());
+  });
+  return 0;
+}
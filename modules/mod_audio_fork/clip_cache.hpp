@@ -0,0 +1,210 @@
+#ifndef __CLIP_CACHE_HPP__
+#define __CLIP_CACHE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * process-wide store of the audio files written for playAudio, keyed by their content.
+ *
+ * Servers tend to push the same prompts to many calls.  Rather than every session writing its own copy
+ * to a temp file and deleting it when the call ends, a clip is written once under a name derived from
+ * its hash, and every session that asks to play it is handed the same file.  Each session holds a
+ * reference until its cleanup; files no session holds stay around for the next call that wants them,
+ * until the total size of the cache goes over its budget, when the least recently used are deleted.
+ *
+ * A clip is identified by two independent 64 bit hashes of its bytes, its length and its file type.
+ */
+class ClipCache {
+public:
+  struct Stats {
+    size_t entries;
+    size_t bytes;
+    size_t inUse;       // entries held by at least one session
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+  };
+
+  ClipCache() : m_maxBytes(0), m_bytes(0), m_hits(0), m_misses(0), m_evictions(0), m_seq(0) {}
+  ~ClipCache() {
+    purge(true);
+  }
+
+  // dir should be somewhere cheap to write, e.g. a tmpfs; a budget of 0 disables the cache
+  void configure(const std::string& dir, size_t maxBytes) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_dir = dir;
+    m_maxBytes = maxBytes;
+  }
+  bool enabled(void) const {
+    return m_maxBytes > 0;
+  }
+
+  /**
+   * find or store a clip, returning the path of a file holding it, with a reference held for the caller.
+   * Returns false if the clip cannot be cached, in which case the caller writes a file of its own.
+   */
+  bool acquire(const char* data, size_t len, const char* fileType, std::string& path) {
+    if (!enabled() || len > m_maxBytes) return false;
+
+    std::string key = makeKey(data, len, fileType);
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      auto it = m_entries.find(key);
+      if (m_entries.end() != it) {
+        it->second.refs++;
+        m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+        path = it->second.path;
+        m_hits++;
+        return true;
+      }
+    }
+
+    // write outside the lock, to a name of our own, so a slow disk does not hold up other sessions
+    std::string final = m_dir + "/audio_fork_clip_" + key;
+    std::string partial = final + "." + std::to_string(m_seq++) + ".part";
+    {
+      std::ofstream f(partial.c_str(), std::ofstream::binary);
+      f.write(data, len);
+      f.close();
+      if (f.fail()) {
+        std::remove(partial.c_str());
+        return false;
+      }
+    }
+
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto it = m_entries.find(key);
+    if (m_entries.end() != it) {
+      // someone else stored the same clip while we were writing it
+      std::remove(partial.c_str());
+      it->second.refs++;
+      m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+      path = it->second.path;
+      m_hits++;
+      return true;
+    }
+    if (0 != std::rename(partial.c_str(), final.c_str())) {
+      std::remove(partial.c_str());
+      return false;
+    }
+    m_lru.push_front(key);
+    Entry& entry = m_entries[key];
+    entry.path = final;
+    entry.bytes = len;
+    entry.refs = 1;
+    entry.lru = m_lru.begin();
+    m_byPath[final] = key;
+    m_bytes += len;
+    m_misses++;
+    evict();
+    path = final;
+    return true;
+  }
+
+  // drop a reference taken by acquire; returns false if path is not one of ours
+  bool release(const char* path) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto byPath = m_byPath.find(path);
+    if (m_byPath.end() == byPath) return false;
+    auto it = m_entries.find(byPath->second);
+    if (it->second.refs > 0) it->second.refs--;
+    evict();
+    return true;
+  }
+
+  // delete every file no session is using, or every file at all when unloading
+  void purge(bool all = false) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+      if (it->second.refs > 0 && !all) {
+        ++it;
+        continue;
+      }
+      it = erase(it);
+    }
+  }
+
+  void getStats(Stats& stats) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    stats.entries = m_entries.size();
+    stats.bytes = m_bytes;
+    stats.inUse = 0;
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+      if (it->second.refs > 0) stats.inUse++;
+    }
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+  }
+
+  // no copying
+  ClipCache(const ClipCache&) = delete;
+  void operator=(const ClipCache&) = delete;
+
+private:
+  struct Entry {
+    std::string path;
+    size_t bytes;
+    unsigned int refs;
+    std::list<std::string>::iterator lru;
+  };
+  typedef std::unordered_map<std::string, Entry> Entries;
+
+  // FNV-1a and a multiply-xorshift mix, both 64 bit, over the whole clip
+  static std::string makeKey(const char* data, size_t len, const char* fileType) {
+    uint64_t h1 = 0xcbf29ce484222325ULL;
+    uint64_t h2 = 0x9e3779b97f4a7c15ULL ^ len;
+    for (size_t i = 0; i < len; i++) {
+      uint8_t c = (uint8_t) data[i];
+      h1 = (h1 ^ c) * 0x100000001b3ULL;
+      h2 = (h2 + c) * 0xff51afd7ed558ccdULL;
+      h2 ^= h2 >> 29;
+    }
+    char key[64];
+    snprintf(key, sizeof(key), "%016llx%016llx_%zu", (unsigned long long) h1, (unsigned long long) h2, len);
+    return std::string(key) + fileType;
+  }
+
+  // with the mutex held: delete the least recently used files that no session holds, until under budget
+  void evict(void) {
+    auto it = m_lru.end();
+    while (m_bytes > m_maxBytes && it != m_lru.begin()) {
+      --it;
+      auto entry = m_entries.find(*it);
+      if (entry->second.refs > 0) continue;
+      ++it;
+      erase(entry);
+      m_evictions++;
+    }
+  }
+
+  Entries::iterator erase(Entries::iterator it) {
+    std::remove(it->second.path.c_str());
+    m_byPath.erase(it->second.path);
+    m_lru.erase(it->second.lru);
+    m_bytes -= it->second.bytes;
+    return m_entries.erase(it);
+  }
+
+  std::mutex m_mutex;
+  std::string m_dir;
+  std::atomic<size_t> m_maxBytes;
+  Entries m_entries;
+  std::unordered_map<std::string, std::string> m_byPath;
+  std::list<std::string> m_lru;   // most recently used first
+  size_t m_bytes;
+  uint64_t m_hits;
+  uint64_t m_misses;
+  uint64_t m_evictions;
+  std::atomic<uint64_t> m_seq;
+};
+
+#endif
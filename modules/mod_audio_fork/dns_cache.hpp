@@ -0,0 +1,249 @@
+#ifndef __DNS_CACHE_HPP__
+#define __DNS_CACHE_HPP__
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <resolv.h>
+
+/**
+ * in-process cache of host name lookups, resolved on worker threads so that a slow resolver never
+ * blocks an lws service thread.
+ *
+ * Addresses come from getaddrinfo, so /etc/hosts and nsswitch behave exactly as they would inside lws;
+ * the record TTL is then read with a direct query, falling back to a default when there is none (e.g. a
+ * name from /etc/hosts).  Failed lookups are cached too, for a short negative TTL.
+ */
+class DnsCache {
+public:
+  enum Result_t {
+    FOUND,
+    PENDING,
+    FAILED
+  };
+  // called on a resolver thread once the lookup a caller was waiting on completes, successful or not
+  typedef void (*resolvedHandler_t)(void* opaque);
+
+  struct EntryInfo {
+    std::string host;
+    std::vector<std::string> addresses;
+    long ttl;         // seconds left
+    bool negative;
+  };
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t negativeHits;
+  };
+
+  DnsCache(unsigned int negativeTtlSecs = 5, unsigned int maxTtlSecs = 300, unsigned int defaultTtlSecs = 30) :
+    m_negativeTtl(negativeTtlSecs), m_maxTtl(maxTtlSecs), m_defaultTtl(defaultTtlSecs), m_running(false),
+    m_hits(0), m_misses(0), m_negativeHits(0) {}
+  ~DnsCache() {
+    stop();
+  }
+
+  void start(unsigned int nThreads) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (m_running) return;
+    m_running = true;
+    for (unsigned int i = 0; i < nThreads; i++) m_threads.push_back(std::thread(&DnsCache::worker, this));
+  }
+
+  // waits for lookups under way to finish; whoever is still waiting on one is dropped without being called
+  void stop(void) {
+    std::vector<std::thread> threads;
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_running = false;
+      m_waiters.clear();
+      m_queue.clear();
+      threads.swap(m_threads);
+      m_cond.notify_all();
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it) it->join();
+  }
+
+  /**
+   * FOUND: address holds a numeric address to connect to.  FAILED: the name recently failed to resolve.
+   * PENDING: a lookup is under way and handler(opaque) will be called when it completes.
+   */
+  Result_t lookup(const std::string& host, std::string& address, resolvedHandler_t handler, void* opaque) {
+    if (isNumeric(host)) {
+      address = host;
+      return FOUND;
+    }
+
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto it = m_entries.find(host);
+    if (it != m_entries.end() && time(nullptr) < it->second.expires) {
+      Entry& entry = it->second;
+      if (entry.addresses.empty()) {
+        m_negativeHits++;
+        return FAILED;
+      }
+      // rotate through the addresses of a multi-homed name
+      address = entry.addresses[entry.next++ % entry.addresses.size()];
+      m_hits++;
+      return FOUND;
+    }
+
+    m_misses++;
+    std::vector<Waiter>& waiters = m_waiters[host];
+    if (waiters.empty()) {
+      m_queue.push_back(host);
+      m_cond.notify_one();
+    }
+    waiters.push_back(std::make_pair(handler, opaque));
+    return PENDING;
+  }
+
+  void flush(void) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_entries.clear();
+  }
+
+  void dump(std::vector<EntryInfo>& entries, Stats& stats) {
+    time_t now = time(nullptr);
+    std::lock_guard<std::mutex> lk(m_mutex);
+    entries.clear();
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+      EntryInfo info;
+      info.host = it->first;
+      info.addresses = it->second.addresses;
+      info.ttl = (long) (it->second.expires - now);
+      info.negative = it->second.addresses.empty();
+      entries.push_back(info);
+    }
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.negativeHits = m_negativeHits;
+  }
+
+  // no copying
+  DnsCache(const DnsCache&) = delete;
+  void operator=(const DnsCache&) = delete;
+
+private:
+  struct Entry {
+    std::vector<std::string> addresses;   // empty for a failed lookup
+    time_t expires;
+    unsigned int next;
+  };
+  typedef std::pair<resolvedHandler_t, void*> Waiter;
+
+  static bool isNumeric(const std::string& host) {
+    unsigned char buf[sizeof(struct in6_addr)];
+    return 1 == inet_pton(AF_INET, host.c_str(), buf) || 1 == inet_pton(AF_INET6, host.c_str(), buf);
+  }
+
+  // smallest TTL among the answer records of the given type, if the resolver returns any
+  static bool queryTtl(const std::string& host, int type, uint32_t& ttl) {
+    struct __res_state res;
+    unsigned char answer[4096];
+    bool found = false;
+
+    memset(&res, 0, sizeof(res));
+    if (0 != res_ninit(&res)) return false;
+    int len = res_nquery(&res, host.c_str(), ns_c_in, type, answer, sizeof(answer));
+    ns_msg msg;
+    if (len > 0 && 0 == ns_initparse(answer, len, &msg)) {
+      for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        ns_rr rr;
+        if (0 != ns_parserr(&msg, ns_s_an, i, &rr) || ns_rr_type(rr) != type) continue;
+        ttl = found ? std::min(ttl, (uint32_t) ns_rr_ttl(rr)) : ns_rr_ttl(rr);
+        found = true;
+      }
+    }
+    res_nclose(&res);
+    return found;
+  }
+
+  void resolve(const std::string& host, Entry& entry) {
+    struct addrinfo hints, *result = nullptr;
+    int family = AF_UNSPEC;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    entry.next = 0;
+    if (0 == getaddrinfo(host.c_str(), nullptr, &hints, &result)) {
+      for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+        char buf[INET6_ADDRSTRLEN];
+        if (0 != getnameinfo(ai->ai_addr, ai->ai_addrlen, buf, sizeof(buf), nullptr, 0, NI_NUMERICHOST)) continue;
+        if (entry.addresses.empty()) family = ai->ai_family;
+        bool dup = false;
+        for (auto it = entry.addresses.begin(); it != entry.addresses.end() && !dup; ++it) dup = (*it == buf);
+        if (!dup) entry.addresses.push_back(buf);
+      }
+      freeaddrinfo(result);
+    }
+
+    uint32_t ttl = m_negativeTtl;
+    if (!entry.addresses.empty()) {
+      if (!queryTtl(host, family == AF_INET6 ? ns_t_aaaa : ns_t_a, ttl)) ttl = m_defaultTtl;
+      ttl = std::max(1U, std::min(ttl, m_maxTtl));
+    }
+    entry.expires = time(nullptr) + ttl;
+  }
+
+  void worker(void) {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (true) {
+      m_cond.wait(lk, [this] { return !m_running || !m_queue.empty(); });
+      if (!m_running) break;
+
+      std::string host = m_queue.front();
+      m_queue.pop_front();
+
+      lk.unlock();
+      Entry entry;
+      resolve(host, entry);
+      lk.lock();
+      if (!m_running) break;
+
+      m_entries[host] = entry;
+
+      // handlers are expected to do no more than queue work, so they are called under the lock
+      auto it = m_waiters.find(host);
+      if (it != m_waiters.end()) {
+        std::vector<Waiter> waiters;
+        waiters.swap(it->second);
+        m_waiters.erase(it);
+        for (auto w = waiters.begin(); w != waiters.end(); ++w) w->first(w->second);
+      }
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::unordered_map<std::string, Entry> m_entries;
+  std::unordered_map<std::string, std::vector<Waiter> > m_waiters;
+  std::deque<std::string> m_queue;
+  std::vector<std::thread> m_threads;
+  unsigned int m_negativeTtl;
+  unsigned int m_maxTtl;
+  unsigned int m_defaultTtl;
+  bool m_running;
+  uint64_t m_hits;
+  uint64_t m_misses;
+  uint64_t m_negativeHits;
+};
+
+#endif
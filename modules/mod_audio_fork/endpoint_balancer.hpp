@@ -0,0 +1,282 @@
+#ifndef __ENDPOINT_BALANCER_HPP__
+#define __ENDPOINT_BALANCER_HPP__
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * spreads forks over a set of interchangeable endpoints, and keeps track of which of them are up.
+ *
+ * For each fork the endpoints of its set are put in order of preference: by fewest connections, or by a
+ * rendezvous hash of the call uuid, so a call keeps going to the same endpoint while the set is unchanged and
+ * only the calls of an endpoint that goes away move.  Endpoints that are down go to the back of the list either
+ * way, to be tried only if everything else fails.  An endpoint is down after a number of failures in a row, of
+ * connects or of the background probes, which do no more than open a TCP (or unix socket) connection to each
+ * endpoint every few seconds; one success brings it back up.  Endpoints unused for a while are forgotten.
+ */
+class EndpointBalancer {
+public:
+  enum Policy_t {
+    LEAST_CONNECTIONS,
+    HASH
+  };
+
+  struct Endpoint {
+    std::string host;     // a leading + for a unix domain socket, as lws has it
+    unsigned int port;
+    std::string path;
+    int sslFlags;
+
+    std::string key(void) const {
+      return host + ":" + std::to_string(port);
+    }
+  };
+
+  struct EndpointInfo {
+    std::string key;
+    bool healthy;
+    unsigned int active;
+    unsigned int failures;    // in a row
+    uint64_t connects;
+    uint64_t connectFailures;
+    uint64_t probes;
+    uint64_t probeFailures;
+  };
+
+  EndpointBalancer(unsigned int failuresToDown = 2, unsigned int expirySecs = 600) :
+    m_failuresToDown(std::max(1U, failuresToDown)), m_expirySecs(expirySecs), m_running(false),
+    m_intervalSecs(0), m_timeoutMs(0) {}
+  ~EndpointBalancer() {
+    stop();
+  }
+
+  static bool parsePolicy(const char* name, Policy_t& policy) {
+    if (0 == strcasecmp(name, "least-connections")) policy = LEAST_CONNECTIONS;
+    else if (0 == strcasecmp(name, "hash")) policy = HASH;
+    else return false;
+    return true;
+  }
+
+  // probe every endpoint in use every intervalSecs, giving each timeoutMs to accept; 0 seconds turns probing off
+  void start(unsigned int intervalSecs, unsigned int timeoutMs) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (m_running || 0 == intervalSecs) return;
+    m_running = true;
+    m_intervalSecs = intervalSecs;
+    m_timeoutMs = timeoutMs;
+    m_thread = std::thread(&EndpointBalancer::prober, this);
+  }
+  void stop(void) {
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      m_running = false;
+      m_cond.notify_all();
+    }
+    if (m_thread.joinable()) m_thread.join();
+  }
+
+  // put the endpoints in order of preference for the call with this uuid, best first
+  void order(std::vector<Endpoint>& endpoints, const std::string& uuid, Policy_t policy) {
+    struct Rank {
+      bool down;
+      unsigned int active;
+      uint64_t score;
+      size_t index;
+    };
+    std::vector<Rank> ranks;
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      time_t now = time(nullptr);
+      for (size_t i = 0; i < endpoints.size(); i++) {
+        State& state = m_states[endpoints[i].key()];
+        state.lastUsed = now;
+        Rank rank = { !state.healthy, policy == LEAST_CONNECTIONS ? state.active : 0, score(uuid, endpoints[i].key()), i };
+        ranks.push_back(rank);
+      }
+    }
+    std::sort(ranks.begin(), ranks.end(), [](const Rank& a, const Rank& b) {
+      if (a.down != b.down) return !a.down;
+      if (a.active != b.active) return a.active < b.active;
+      return a.score > b.score;
+    });
+    std::vector<Endpoint> ordered;
+    for (auto it = ranks.begin(); it != ranks.end(); ++it) ordered.push_back(endpoints[it->index]);
+    endpoints.swap(ordered);
+  }
+
+  // a fork is now using, or has stopped using, the endpoint
+  void acquire(const std::string& key) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    State& state = m_states[key];
+    state.active++;
+    state.lastUsed = time(nullptr);
+  }
+  void release(const std::string& key) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto it = m_states.find(key);
+    if (it != m_states.end() && it->second.active > 0) it->second.active--;
+  }
+
+  // the outcome of a connect to the endpoint
+  void connected(const std::string& key) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    State& state = m_states[key];
+    state.connects++;
+    up(state);
+  }
+  void failed(const std::string& key) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    State& state = m_states[key];
+    state.connectFailures++;
+    down(state);
+  }
+
+  void dump(std::vector<EndpointInfo>& endpoints) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    endpoints.clear();
+    for (auto it = m_states.begin(); it != m_states.end(); ++it) {
+      const State& state = it->second;
+      EndpointInfo info = { it->first, state.healthy, state.active, state.failures, state.connects, state.connectFailures,
+        state.probes, state.probeFailures };
+      endpoints.push_back(info);
+    }
+  }
+
+  // no copying
+  EndpointBalancer(const EndpointBalancer&) = delete;
+  void operator=(const EndpointBalancer&) = delete;
+
+private:
+  struct State {
+    bool healthy;
+    unsigned int active;
+    unsigned int failures;
+    time_t lastUsed;
+    uint64_t connects;
+    uint64_t connectFailures;
+    uint64_t probes;
+    uint64_t probeFailures;
+
+    State() : healthy(true), active(0), failures(0), lastUsed(0), connects(0), connectFailures(0), probes(0), probeFailures(0) {}
+  };
+
+  void up(State& state) {
+    state.failures = 0;
+    state.healthy = true;
+  }
+  void down(State& state) {
+    if (++state.failures >= m_failuresToDown) state.healthy = false;
+  }
+
+  // rendezvous weight of an endpoint for a call: FNV-1a over both, then the splitmix64 finalizer to spread the bits
+  static uint64_t score(const std::string& uuid, const std::string& key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (auto c : uuid) h = (h ^ (uint8_t) c) * 1099511628211ULL;
+    h = (h ^ '|') * 1099511628211ULL;
+    for (auto c : key) h = (h ^ (uint8_t) c) * 1099511628211ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+  }
+
+  // true if the endpoint accepts a connection within timeoutMs
+  static bool probe(const std::string& key, unsigned int timeoutMs) {
+    size_t colon = key.rfind(':');
+    std::string host = key.substr(0, colon);
+    std::string port = key.substr(colon + 1);
+
+    if ('+' == host[0]) {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (host.length() - 1 >= sizeof(addr.sun_path)) return false;
+      memcpy(addr.sun_path, host.c_str() + 1, host.length() - 1);
+      return tryConnect(AF_UNIX, (struct sockaddr *) &addr, sizeof(addr), timeoutMs);
+    }
+
+    struct addrinfo hints, *result = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (0 != getaddrinfo(host.c_str(), port.c_str(), &hints, &result)) return false;
+    bool ok = false;
+    for (struct addrinfo* ai = result; ai && !ok; ai = ai->ai_next) {
+      ok = tryConnect(ai->ai_family, ai->ai_addr, ai->ai_addrlen, timeoutMs);
+    }
+    freeaddrinfo(result);
+    return ok;
+  }
+
+  static bool tryConnect(int family, const struct sockaddr* addr, socklen_t len, unsigned int timeoutMs) {
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    bool ok = 0 == connect(fd, addr, len);
+    if (!ok && EINPROGRESS == errno) {
+      struct pollfd pfd = { fd, POLLOUT, 0 };
+      int err = 0;
+      socklen_t errlen = sizeof(err);
+      ok = 1 == poll(&pfd, 1, timeoutMs) && 0 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) && 0 == err;
+    }
+    ::close(fd);
+    return ok;
+  }
+
+  void prober(void) {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (m_running) {
+      // forget endpoints nobody has used for a while, and probe the rest without holding the lock
+      std::vector<std::string> keys;
+      time_t now = time(nullptr);
+      for (auto it = m_states.begin(); it != m_states.end(); ) {
+        if (0 == it->second.active && now - it->second.lastUsed > (time_t) m_expirySecs) it = m_states.erase(it);
+        else keys.push_back((it++)->first);
+      }
+
+      for (auto it = keys.begin(); it != keys.end() && m_running; ++it) {
+        lk.unlock();
+        bool ok = probe(*it, m_timeoutMs);
+        lk.lock();
+        auto found = m_states.find(*it);
+        if (found == m_states.end()) continue;
+        State& state = found->second;
+        state.probes++;
+        if (ok) up(state);
+        else {
+          state.probeFailures++;
+          down(state);
+        }
+      }
+      m_cond.wait_for(lk, std::chrono::seconds(m_intervalSecs));
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::unordered_map<std::string, State> m_states;    // by host:port
+  std::thread m_thread;
+  unsigned int m_failuresToDown;
+  unsigned int m_expirySecs;
+  bool m_running;
+  unsigned int m_intervalSecs;
+  unsigned int m_timeoutMs;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef __LATENCY_HISTOGRAM_HPP__
+#define __LATENCY_HISTOGRAM_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * histogram of latencies in microseconds, laid out the way HdrHistogram does it.
+ *
+ * Values below 32 us get a bucket each; above that every power of two is split into 16 linear buckets, so
+ * any value is known to within about 6%, up to 2^27 us (over two minutes), beyond which values are clamped.
+ * Recording is a relaxed increment, so the one thread that records never waits, and any thread can take a
+ * snapshot at any time; a snapshot taken during a record may be missing that one value.
+ */
+class LatencyHistogram {
+public:
+  static const unsigned int SUB_BITS = 4;
+  static const unsigned int SUB_BUCKETS = 1 << SUB_BITS;
+  static const unsigned int LINEAR = 2 * SUB_BUCKETS;
+  static const unsigned int MAX_BIT = 26;
+  static const size_t BUCKETS = LINEAR + (MAX_BIT - SUB_BITS) * SUB_BUCKETS;
+
+  struct Summary {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+  };
+
+  // counts copied out of a histogram, which can be added up across histograms or compared against an earlier copy
+  class Snapshot {
+  public:
+    Snapshot() : m_counts(BUCKETS, 0), m_max(0) {}
+
+    void add(const Snapshot& other) {
+      for (size_t i = 0; i < BUCKETS; i++) m_counts[i] += other.m_counts[i];
+      m_max = std::max(m_max, other.m_max);
+    }
+
+    // keep only what was recorded since earlier; the max is then the top of the highest bucket still counted
+    void subtract(const Snapshot& earlier) {
+      size_t highest = 0;
+      for (size_t i = 0; i < BUCKETS; i++) {
+        m_counts[i] -= std::min(m_counts[i], earlier.m_counts[i]);
+        if (m_counts[i]) highest = i;
+      }
+      m_max = std::min(m_max, highest ? upperBound(highest) : 0);
+    }
+
+    void summarize(Summary& summary) const {
+      summary.count = 0;
+      for (size_t i = 0; i < BUCKETS; i++) summary.count += m_counts[i];
+      summary.p50 = percentile(summary.count, 50.0);
+      summary.p90 = percentile(summary.count, 90.0);
+      summary.p99 = percentile(summary.count, 99.0);
+      summary.max = summary.count ? m_max : 0;
+    }
+
+  private:
+    friend class LatencyHistogram;
+
+    // the value at or below which pct percent of the values fall, as the top of its bucket but never above the max
+    uint64_t percentile(uint64_t count, double pct) const {
+      if (0 == count) return 0;
+      uint64_t rank = std::max((uint64_t) 1, (uint64_t) (count * pct / 100.0 + 0.5));
+      uint64_t seen = 0;
+      for (size_t i = 0; i < BUCKETS; i++) {
+        seen += m_counts[i];
+        if (seen >= rank) return std::min(upperBound(i), m_max);
+      }
+      return m_max;
+    }
+
+    std::vector<uint64_t> m_counts;
+    uint64_t m_max;
+  };
+
+  LatencyHistogram() : m_max(0) {
+    for (size_t i = 0; i < BUCKETS; i++) m_counts[i].store(0, std::memory_order_relaxed);
+  }
+
+  // single writer
+  void record(uint64_t us) {
+    m_counts[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+    if (us > m_max.load(std::memory_order_relaxed)) m_max.store(us, std::memory_order_relaxed);
+  }
+
+  void snapshot(Snapshot& snapshot) const {
+    for (size_t i = 0; i < BUCKETS; i++) snapshot.m_counts[i] = m_counts[i].load(std::memory_order_relaxed);
+    snapshot.m_max = m_max.load(std::memory_order_relaxed);
+  }
+
+  // no copying
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  void operator=(const LatencyHistogram&) = delete;
+
+private:
+  static size_t bucket(uint64_t us) {
+    if (us < LINEAR) return (size_t) us;
+    us = std::min(us, ((uint64_t) 2 << MAX_BIT) - 1);
+    unsigned int bit = 63 - __builtin_clzll(us);
+    unsigned int shift = bit - SUB_BITS;
+    return LINEAR + (bit - SUB_BITS - 1) * SUB_BUCKETS + ((us >> shift) & (SUB_BUCKETS - 1));
+  }
+
+  static uint64_t upperBound(size_t index) {
+    if (index < LINEAR) return index;
+    size_t n = index - LINEAR;
+    unsigned int shift = n / SUB_BUCKETS + 1;
+    uint64_t lower = (uint64_t) (SUB_BUCKETS + n % SUB_BUCKETS) << shift;
+    return lower + ((uint64_t) 1 << shift) - 1;
+  }
+
+  std::atomic<uint64_t> m_counts[BUCKETS];
+  std::atomic<uint64_t> m_max;
+};
+
+#endif
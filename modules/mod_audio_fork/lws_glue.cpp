@@ -12,14 +12,39 @@
 #include <fstream>
 #include <sstream>
 #include <regex>
+#include <vector>
 
 #include "base64.hpp"
 #include "parser.hpp"
 #include "mod_audio_fork.h"
 #include "audio_pipe.hpp"
+#include "audio_encoder.hpp"
+#include "clip_cache.hpp"
+#include "shm_channel.hpp"
+#include "speech_gate.hpp"
 
 #define RTP_PACKETIZATION_PERIOD 20
 #define FRAME_SIZE_8000  320 /*which means each 20ms frame as 320 bytes at 8 khz (1 channel only)*/
+#define MAX_FLUSH_INTERVAL_MS 1000
+#define MAX_REPLAY_SECS 5
+#define DEFAULT_RECONNECT_BACKOFF_MS 500
+#define DEFAULT_PING_TIMEOUT_MS 2000
+#define MIN_PING_MS 100
+#define DEFAULT_OPUS_BITRATE_PER_CHANNEL 32000
+#define DEFAULT_OPUS_COMPLEXITY 5
+#define DEFAULT_PLAYBACK_BUFFER_MS 60
+#define DEFAULT_PLAYBACK_MAX_SECS 30
+#define MAX_PLAYBACK_MAX_SECS 120
+#define DEFAULT_VAD_MODE 2
+#define DEFAULT_VAD_ENERGY_THRESHOLD 100
+#define DEFAULT_VAD_VOICE_MS 60
+#define DEFAULT_VAD_HANGOVER_MS 300
+#define DEFAULT_VAD_PREROLL_MS 200
+#define DEFAULT_VAD_SILENCE_MARKER_MS 1000
+#define DEFAULT_SPOOL_MAX_MB 64
+
+extern "C" int parse_ws_uri(switch_channel_t *channel, const char* szServerUri, char* host, char *path, unsigned int* pPort, 
+  int* pSslFlags, int* pTransport);
 
 namespace {
   static const char *requestedBufferSecs = std::getenv("MOD_AUDIO_FORK_BUFFER_SECS");
@@ -27,14 +52,24 @@ namespace {
   static const char *requestedNumServiceThreads = std::getenv("MOD_AUDIO_FORK_SERVICE_THREADS");
   static const char* mySubProtocolName = std::getenv("MOD_AUDIO_FORK_SUBPROTOCOL_NAME") ?
     std::getenv("MOD_AUDIO_FORK_SUBPROTOCOL_NAME") : "audio.drachtio.org";
-  static unsigned int nServiceThreads = std::max(1, std::min(requestedNumServiceThreads ? ::atoi(requestedNumServiceThreads) : 1, 5));
+  static unsigned int nServiceThreads = std::max(1, requestedNumServiceThreads ? ::atoi(requestedNumServiceThreads) : (int) std::thread::hardware_concurrency());
+  static const char *requestedThreadAffinity = std::getenv("MOD_AUDIO_FORK_SERVICE_THREAD_AFFINITY");
+  static bool pinServiceThreads = requestedThreadAffinity && switch_true(requestedThreadAffinity);
+  static const char *requestedClipCacheMB = std::getenv("MOD_AUDIO_FORK_CLIP_CACHE_MB");
+  static size_t nClipCacheMB = std::max(0, requestedClipCacheMB ? ::atoi(requestedClipCacheMB) : 0);
+  static const char *clipCacheDir = std::getenv("MOD_AUDIO_FORK_CLIP_CACHE_DIR");
+  static const char *requestedLatencyEventSecs = std::getenv("MOD_AUDIO_FORK_LATENCY_EVENT_SECS");
+  static int nLatencyEventSecs = std::max(0, requestedLatencyEventSecs ? ::atoi(requestedLatencyEventSecs) : 0);
+  static const char *spoolDir = std::getenv("MOD_AUDIO_FORK_SPOOL_DIR");
+  static const char *requestedSpoolSegmentKB = std::getenv("MOD_AUDIO_FORK_SPOOL_SEGMENT_KB");
+  static size_t nSpoolSegmentKB = std::max(64, requestedSpoolSegmentKB ? ::atoi(requestedSpoolSegmentKB) : 1024);
   static unsigned int idxCallCount = 0;
   static uint32_t playCount = 0;
+  static ClipCache clipCache;
 
-  void processIncomingMessage(private_t* tech_pvt, switch_core_session_t* session, const char* message) {
-    std::string msg = message;
+  void processIncomingMessage(private_t* tech_pvt, switch_core_session_t* session, const char* message, size_t len) {
     std::string type;
-    cJSON* json = parse_json(session, msg, type) ;
+    cJSON* json = parse_json(session, message, len, type) ;
     if (json) {
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) processIncomingMessage - received %s message\n", tech_pvt->id, type.c_str());
       cJSON* jsonData = cJSON_GetObjectItem(json, "data");
@@ -87,12 +122,21 @@ namespace {
           if (validAudio) {
             char szFilePath[256];
 
-            std::string rawAudio = drachtio::base64_decode(jsonAudio->valuestring);
-            switch_snprintf(szFilePath, 256, "%s%s%s_%d.tmp%s", SWITCH_GLOBAL_dirs.temp_dir, 
-              SWITCH_PATH_SEPARATOR, tech_pvt->sessionId, playCount++, fileType);
-            std::ofstream f(szFilePath, std::ofstream::binary);
-            f << rawAudio;
-            f.close();
+            // decode over the detached string itself rather than into a copy; it is deleted below
+            size_t rawLen = drachtio::base64_decode_inplace(jsonAudio->valuestring);
+
+            // a clip we have already written for this or another call is played from the same file
+            std::string cachedPath;
+            if (clipCache.acquire(jsonAudio->valuestring, rawLen, fileType, cachedPath)) {
+              switch_copy_string(szFilePath, cachedPath.c_str(), sizeof(szFilePath));
+            }
+            else {
+              switch_snprintf(szFilePath, 256, "%s%s%s_%d.tmp%s", SWITCH_GLOBAL_dirs.temp_dir, 
+                SWITCH_PATH_SEPARATOR, tech_pvt->sessionId, playCount++, fileType);
+              std::ofstream f(szFilePath, std::ofstream::binary);
+              f.write(jsonAudio->valuestring, rawLen);
+              f.close();
+            }
 
             // add the file to the list of files played for this session, we'll delete when session closes
             struct playout* playout = (struct playout *) malloc(sizeof(struct playout));
@@ -117,6 +161,10 @@ namespace {
       else if (0 == type.compare("killAudio")) {
         tech_pvt->responseHandler(session, EVENT_KILL_AUDIO, NULL);
 
+        // drop any audio streamed to us that has not been played yet
+        AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe[0]);
+        if (pAudioPipe && pAudioPipe->getPlayback()) pAudioPipe->getPlayback()->clear();
+
         // kill any current playback on the channel
         switch_channel_t *channel = switch_core_session_get_channel(session);
         switch_channel_set_flag_value(channel, CF_BREAK, 2);
@@ -156,47 +204,142 @@ namespace {
     }
   }
 
-  static void eventCallback(const char* sessionId, const char* bugname, AudioPipe::NotifyEvent_t event, const char* message) {
+  // queue text to the far end; on a multiplexed connection it is tagged with the fork it comes from
+  void sendText(private_t* tech_pvt, AudioPipe* pAudioPipe, const char* text, bool inOrder = false) {
+    if (!tech_pvt->multiplex) {
+      pAudioPipe->bufferForSending(text, inOrder);
+      return;
+    }
+
+    cJSON* json = cJSON_Parse(text);
+    if (json && json->type == cJSON_Object) {
+      cJSON_DeleteItemFromObject(json, "streamId");
+    }
+    else {
+      // not a JSON object, so wrap it in one
+      if (json) cJSON_Delete(json);
+      json = cJSON_CreateObject();
+      cJSON_AddStringToObject(json, "text", text);
+    }
+    cJSON_AddStringToObject(json, "streamId", pAudioPipe->getBugname());
+    char* jsonString = cJSON_PrintUnformatted(json);
+    pAudioPipe->bufferForSending(jsonString, inOrder);
+    free(jsonString);
+    cJSON_Delete(json);
+  }
+
+  // the AudioPipes of a fork sending to several urls are named bugname#N after the first, so their events can be told apart
+  switch_media_bug_t* findBug(switch_channel_t *channel, const char* pipeName, int& destination) {
+    destination = 0;
+    switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, pipeName);
+    if (bug) return bug;
+
+    const char* hash = strrchr(pipeName, '#');
+    if (!hash || !isdigit(hash[1])) return nullptr;
+    std::string bugname(pipeName, hash - pipeName);
+    bug = (switch_media_bug_t*) switch_channel_get_private(channel, bugname.c_str());
+    private_t* tech_pvt = bug ? (private_t*) switch_core_media_bug_get_user_data(bug) : nullptr;
+    int n = ::atoi(hash + 1);
+    if (!tech_pvt || n < 1 || n >= tech_pvt->destinations) return nullptr;
+    destination = n;
+    return bug;
+  }
+
+  // a message on a multiplexed connection belongs to the fork named by its streamId, if that is one of ours
+  private_t* routeMessage(private_t* tech_pvt, switch_core_session_t* session, AudioPipe* pAudioPipe, const char* message) {
+    if (!tech_pvt->multiplex || !pAudioPipe) return tech_pvt;
+
+    private_t* target = tech_pvt;
+    cJSON* json = cJSON_Parse(message);
+    if (json) {
+      const char* streamId = cJSON_GetObjectCstr(json, "streamId");
+      if (streamId && 0 != strcmp(streamId, pAudioPipe->getBugname()) && pAudioPipe->hasSibling(streamId)) {
+        int destination;
+        switch_media_bug_t *bug = findBug(switch_core_session_get_channel(session), streamId, destination);
+        private_t* sibling = bug ? (private_t*) switch_core_media_bug_get_user_data(bug) : nullptr;
+        if (sibling) target = sibling;
+      }
+      cJSON_Delete(json);
+    }
+    return target;
+  }
+
+  // event body identifying the destination, for a fork sending to more than one url
+  std::string destinationJson(private_t* tech_pvt, int destination, const char* reason) {
+    std::stringstream json;
+    json << "{";
+    if (tech_pvt->destinations > 1) json << "\"destination\":" << destination << (reason ? "," : "");
+    if (reason) json << "\"reason\":\"" << reason << "\"";
+    json << "}";
+    return json.str();
+  }
+
+  static void eventCallback(const char* sessionId, const char* bugname, AudioPipe::NotifyEvent_t event, const char* message, size_t len) {
     switch_core_session_t* session = switch_core_session_locate(sessionId);
     if (session) {
       switch_channel_t *channel = switch_core_session_get_channel(session);
-      switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, bugname);
+      int destination;
+      switch_media_bug_t *bug = findBug(channel, bugname, destination);
       if (bug) {
         private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
         if (tech_pvt) {
+          AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe[destination]);
           switch (event) {
             case AudioPipe::CONNECT_SUCCESS:
               switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "connection successful\n");
-              tech_pvt->responseHandler(session, EVENT_CONNECT_SUCCESS, NULL);
+              if (tech_pvt->destinations > 1) {
+                tech_pvt->responseHandler(session, EVENT_CONNECT_SUCCESS, (char *) destinationJson(tech_pvt, destination, NULL).c_str());
+              }
+              else tech_pvt->responseHandler(session, EVENT_CONNECT_SUCCESS, NULL);
               if (strlen(tech_pvt->initialMetadata) > 0) {
                 switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "sending initial metadata %s\n", tech_pvt->initialMetadata);
-                AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe);
-                pAudioPipe->bufferForSending(tech_pvt->initialMetadata);
+                sendText(tech_pvt, pAudioPipe, tech_pvt->initialMetadata);
+              }
+            break;
+            case AudioPipe::RECONNECTING:
+              switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "connection dropped, reconnecting: %s\n", message);
+              tech_pvt->responseHandler(session, EVENT_RECONNECTING, (char *) message);
+            break;
+            case AudioPipe::RECONNECTED:
+              switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "reconnected: %s\n", message);
+              tech_pvt->responseHandler(session, EVENT_RECONNECTED, (char *) message);
+              if (strlen(tech_pvt->initialMetadata) > 0) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "re-sending initial metadata %s\n", tech_pvt->initialMetadata);
+                sendText(tech_pvt, pAudioPipe, tech_pvt->initialMetadata);
               }
             break;
             case AudioPipe::CONNECT_FAIL:
             {
               // first thing: we can no longer access the AudioPipe
-              std::stringstream json;
-              json << "{\"reason\":\"" << message << "\"}";
-              tech_pvt->pAudioPipe = nullptr;
-              tech_pvt->responseHandler(session, EVENT_CONNECT_FAIL, (char *) json.str().c_str());
+              switch_mutex_lock(tech_pvt->mutex);
+              tech_pvt->pAudioPipe[destination] = nullptr;
+              switch_mutex_unlock(tech_pvt->mutex);
+              tech_pvt->responseHandler(session, EVENT_CONNECT_FAIL, (char *) destinationJson(tech_pvt, destination, message).c_str());
               switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "connection failed: %s\n", message);
             }
             break;
             case AudioPipe::CONNECTION_DROPPED:
               // first thing: we can no longer access the AudioPipe
-              tech_pvt->pAudioPipe = nullptr;
-              tech_pvt->responseHandler(session, EVENT_DISCONNECT, NULL);
-              switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "connection dropped from far end\n");
+              switch_mutex_lock(tech_pvt->mutex);
+              tech_pvt->pAudioPipe[destination] = nullptr;
+              switch_mutex_unlock(tech_pvt->mutex);
+              // the message, if any, is why we dropped the connection ourselves
+              if (tech_pvt->destinations > 1 || message) {
+                tech_pvt->responseHandler(session, EVENT_DISCONNECT, (char *) destinationJson(tech_pvt, destination, message).c_str());
+              }
+              else tech_pvt->responseHandler(session, EVENT_DISCONNECT, NULL);
+              switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "connection dropped: %s\n", 
+                message ? message : "from far end");
             break;
             case AudioPipe::CONNECTION_CLOSED_GRACEFULLY:
               // first thing: we can no longer access the AudioPipe
-              tech_pvt->pAudioPipe = nullptr;
+              switch_mutex_lock(tech_pvt->mutex);
+              tech_pvt->pAudioPipe[destination] = nullptr;
+              switch_mutex_unlock(tech_pvt->mutex);
               switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "connection closed gracefully\n");
             break;
             case AudioPipe::MESSAGE:
-              processIncomingMessage(tech_pvt, session, message);
+              processIncomingMessage(routeMessage(tech_pvt, session, pAudioPipe, message), session, message, len);
             break;
           }
         }
@@ -204,18 +347,182 @@ namespace {
       switch_core_session_rwunlock(session);
     }
   }
-  switch_status_t fork_data_init(private_t *tech_pvt, switch_core_session_t *session, char * host, 
-    unsigned int port, char* path, int sslFlags, int sampling, int desiredSampling, int channels, 
+  // transport counters as JSON; times are averages over the connections counted
+  void addStatsJson(cJSON* json, const AudioPipe::Stats& stats) {
+    cJSON_AddNumberToObject(json, "bytesSent", stats.bytesSent);
+    cJSON_AddNumberToObject(json, "framesSent", stats.framesSent);
+    cJSON_AddNumberToObject(json, "textFrames", stats.textFrames);
+    cJSON_AddNumberToObject(json, "partialWrites", stats.partialWrites);
+    cJSON_AddNumberToObject(json, "droppedBytes", stats.droppedBytes);
+    cJSON_AddNumberToObject(json, "queueHighWater", stats.queueHighWater);
+    cJSON_AddNumberToObject(json, "connects", stats.connects);
+    cJSON_AddNumberToObject(json, "connectMs", stats.connects ? stats.connectUs / stats.connects / 1000.0 : 0);
+    cJSON_AddNumberToObject(json, "tlsHandshakes", stats.tlsHandshakes);
+    cJSON_AddNumberToObject(json, "tlsHandshakeMs", stats.tlsHandshakes ? stats.tlsHandshakeUs / stats.tlsHandshakes / 1000.0 : 0);
+    cJSON_AddNumberToObject(json, "reconnects", stats.reconnects);
+    cJSON_AddNumberToObject(json, "spooledBytes", stats.spooledBytes);
+    cJSON_AddNumberToObject(json, "spoolDrainedBytes", stats.spoolDrainedBytes);
+    cJSON_AddNumberToObject(json, "spoolDroppedBytes", stats.spoolDroppedBytes);
+    cJSON_AddNumberToObject(json, "pongs", stats.pongs);
+    cJSON_AddNumberToObject(json, "rttMs", stats.pongs ? stats.pingRttUs / stats.pongs / 1000.0 : 0);
+    cJSON_AddNumberToObject(json, "pingTimeouts", stats.pingTimeouts);
+  }
+
+  void addLatencyJson(cJSON* json, const LatencyHistogram::Snapshot& snapshot) {
+    LatencyHistogram::Summary summary;
+    snapshot.summarize(summary);
+    cJSON_AddNumberToObject(json, "frames", summary.count);
+    cJSON_AddNumberToObject(json, "p50Ms", summary.p50 / 1000.0);
+    cJSON_AddNumberToObject(json, "p90Ms", summary.p90 / 1000.0);
+    cJSON_AddNumberToObject(json, "p99Ms", summary.p99 / 1000.0);
+    cJSON_AddNumberToObject(json, "maxMs", summary.max / 1000.0);
+  }
+
+  // capture-to-wire latency, overall and for each service thread
+  cJSON* latencyJson(const std::vector<LatencyHistogram::Snapshot>& snapshots) {
+    LatencyHistogram::Snapshot total;
+    cJSON* json = cJSON_CreateObject();
+    cJSON* jsonContexts = cJSON_CreateArray();
+    for (size_t i = 0; i < snapshots.size(); i++) {
+      cJSON* ctx = cJSON_CreateObject();
+      cJSON_AddNumberToObject(ctx, "context", i);
+      addLatencyJson(ctx, snapshots[i]);
+      cJSON_AddItemToArray(jsonContexts, ctx);
+      total.add(snapshots[i]);
+    }
+    cJSON* jsonTotal = cJSON_CreateObject();
+    addLatencyJson(jsonTotal, total);
+    cJSON_AddItemToObject(json, "total", jsonTotal);
+    cJSON_AddItemToObject(json, "contexts", jsonContexts);
+    return json;
+  }
+
+  // scheduler thread: report the latencies of the interval just ended, and come back at the end of the next one
+  void latencyEventTask(switch_scheduler_task_t *task) {
+    static std::vector<LatencyHistogram::Snapshot> last;
+    std::vector<LatencyHistogram::Snapshot> snapshots;
+    AudioPipe::getLatency(snapshots);
+
+    std::vector<LatencyHistogram::Snapshot> interval(snapshots);
+    for (size_t i = 0; i < interval.size() && i < last.size(); i++) interval[i].subtract(last[i]);
+    last.swap(snapshots);
+
+    cJSON* json = latencyJson(interval);
+    cJSON_AddNumberToObject(json, "intervalSecs", nLatencyEventSecs);
+    char* jsonString = cJSON_PrintUnformatted(json);
+    switch_event_t *event;
+    if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, EVENT_LATENCY) == SWITCH_STATUS_SUCCESS) {
+      switch_event_add_body(event, "%s", jsonString);
+      switch_event_fire(&event);
+    }
+    free(jsonString);
+    cJSON_Delete(json);
+
+    task->runtime = switch_epoch_time_now(NULL) + nLatencyEventSecs;
+  }
+
+  // tell the far end how the audio is encoded, by adding it to the initial metadata when that is a JSON object
+  void advertiseAudioFormat(private_t* tech_pvt, switch_core_session_t* session, AudioEncoder* encoder, int sampling, int channels) {
+    cJSON* json = strlen(tech_pvt->initialMetadata) > 0 ? cJSON_Parse(tech_pvt->initialMetadata) : cJSON_CreateObject();
+    if (!json || json->type != cJSON_Object) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, 
+        "(%u) metadata is not a JSON object, so the %s encoding cannot be advertised in it\n", tech_pvt->id, encoder->name());
+      if (json) cJSON_Delete(json);
+      return;
+    }
+
+    cJSON* format = cJSON_CreateObject();
+    cJSON_AddStringToObject(format, "encoding", encoder->name());
+    cJSON_AddNumberToObject(format, "sampleRate", sampling);
+    cJSON_AddNumberToObject(format, "channels", channels);
+    cJSON_AddNumberToObject(format, "frameMs", encoder->frameMs());
+    cJSON_AddNumberToObject(format, "frameBytes", encoder->frameBytes());
+    cJSON_AddNumberToObject(format, "bitrate", encoder->bitrate());
+    cJSON_AddItemToObject(json, "audioFormat", format);
+
+    char* jsonString = cJSON_PrintUnformatted(json);
+    if (strlen(jsonString) < MAX_METADATA_LEN) strcpy(tech_pvt->initialMetadata, jsonString);
+    else {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, 
+        "(%u) metadata too long to add the audio format to\n", tech_pvt->id);
+    }
+    free(jsonString);
+    cJSON_Delete(json);
+  }
+
+  // hand linear audio to every destination taking it, through the fork's encoder if it has one; the audio is encoded
+  // once whatever the number of destinations, and the bytes each one has to drop are added to its entry in dropped.
+  // captureUs is when the audio was read from the bug
+  void writeAudio(private_t* tech_pvt, AudioPipe** pipes, size_t* dropped, const uint8_t* data, size_t len, uint64_t captureUs) {
+    auto write = [tech_pvt, pipes, dropped, captureUs](const uint8_t* out, size_t outLen) {
+      for (int i = 0; i < tech_pvt->destinations; i++) {
+        if (pipes[i]) dropped[i] += pipes[i]->binaryWrite(out, outLen, captureUs);
+      }
+      return outLen;
+    };
+    AudioEncoder* encoder = static_cast<AudioEncoder *>(tech_pvt->pEncoder);
+    if (!encoder) write(data, len);
+    else encoder->encode((const int16_t *) data, len / (sizeof(int16_t) * tech_pvt->channels), write);
+  }
+
+  // resample a frame read from the bug, if the fork needs it, and hand it to every destination taking audio
+  void forwardFrame(private_t* tech_pvt, AudioPipe** pipes, size_t* dropped, const uint8_t* data, size_t len, uint64_t captureUs) {
+    if (NULL == tech_pvt->resampler) {
+      writeAudio(tech_pvt, pipes, dropped, data, len, captureUs);
+      return;
+    }
+
+    uint8_t out[SWITCH_RECOMMENDED_BUFFER_SIZE];
+    const spx_int16_t *in = (const spx_int16_t *) data;
+    spx_uint32_t remaining = len / (sizeof(spx_int16_t) * tech_pvt->channels);
+
+    // upsampling can produce more than fits in one output buffer, so go round until the input is consumed
+    while (remaining > 0) {
+      spx_uint32_t in_len = remaining;
+      spx_uint32_t out_len = sizeof(out) / (sizeof(spx_int16_t) * tech_pvt->channels);
+
+      speex_resampler_process_interleaved_int(tech_pvt->resampler, in, &in_len, (spx_int16_t *) out, &out_len);
+
+      if (out_len > 0) {
+        // bytes written = num samples * 2 * num channels
+        size_t bytes_written = out_len << tech_pvt->channels;
+        writeAudio(tech_pvt, pipes, dropped, out, bytes_written, captureUs);
+      }
+      if (0 == in_len) break;
+      in += in_len * tech_pvt->channels;
+      remaining -= in_len;
+    }
+  }
+
+  // stand in for audio the speech gate held back, so the far end can keep time; the marker goes out after the audio
+  // already queued and before any that follows, the pre-roll included
+  void sendSilence(private_t* tech_pvt, AudioPipe** pipes, unsigned int ms) {
+    if (0 == ms) return;
+    char text[64];
+    snprintf(text, sizeof(text), "{\"type\":\"silence\",\"ms\":%u}", ms);
+    for (int i = 0; i < tech_pvt->destinations; i++) {
+      if (pipes[i]) sendText(tech_pvt, pipes[i], text, true);
+    }
+  }
+
+  // a fork that fails to start has never connected its pipes, so nothing else refers to them yet
+  void releasePipes(private_t* tech_pvt) {
+    for (int i = 0; i < tech_pvt->destinations; i++) {
+      delete static_cast<AudioPipe *>(tech_pvt->pAudioPipe[i]);
+      tech_pvt->pAudioPipe[i] = nullptr;
+    }
+    tech_pvt->destinations = 0;
+  }
+
+  switch_status_t fork_data_init(private_t *tech_pvt, switch_core_session_t *session, fork_destination_t* destinations, 
+    int nDestinations, int sampling, int desiredSampling, int channels, 
     char *bugname, char* metadata, responseHandler_t responseHandler) {
 
     const char* username = nullptr;
     const char* password = nullptr;
     int err;
-    switch_codec_implementation_t read_impl;
     switch_channel_t *channel = switch_core_session_get_channel(session);
 
-    switch_core_session_get_read_impl(session, &read_impl);
-  
     if (username = switch_channel_get_variable(channel, "MOD_AUDIO_BASIC_AUTH_USERNAME")) {
       password = switch_channel_get_variable(channel, "MOD_AUDIO_BASIC_AUTH_PASSWORD");
     }
@@ -223,9 +530,9 @@ namespace {
     memset(tech_pvt, 0, sizeof(private_t));
   
     strncpy(tech_pvt->sessionId, switch_core_session_get_uuid(session), MAX_SESSION_ID);
-    strncpy(tech_pvt->host, host, MAX_WS_URL_LEN);
-    tech_pvt->port = port;
-    strncpy(tech_pvt->path, path, MAX_PATH_LEN);    
+    strncpy(tech_pvt->host, destinations[0].host, MAX_WS_URL_LEN);
+    tech_pvt->port = destinations[0].port;
+    strncpy(tech_pvt->path, destinations[0].path, MAX_PATH_LEN);    
     tech_pvt->sampling = desiredSampling;
     tech_pvt->responseHandler = responseHandler;
     tech_pvt->playout = NULL;
@@ -237,16 +544,220 @@ namespace {
     strncpy(tech_pvt->bugname, bugname, MAX_BUG_LEN);
     if (metadata) strncpy(tech_pvt->initialMetadata, metadata, MAX_METADATA_LEN);
     
-    size_t buflen = LWS_PRE + (FRAME_SIZE_8000 * desiredSampling / 8000 * channels * 1000 / RTP_PACKETIZATION_PERIOD * nAudioBufferSecs);
+    size_t framelen = FRAME_SIZE_8000 * desiredSampling / 8000 * channels;
+    size_t bytesPerSec = framelen * 1000 / RTP_PACKETIZATION_PERIOD;
+    unsigned int frameDurationMs = RTP_PACKETIZATION_PERIOD;
 
-    AudioPipe* ap = new AudioPipe(tech_pvt->sessionId, host, port, path, sslFlags, 
-      buflen, read_impl.decoded_bytes_per_packet, username, password, bugname, eventCallback);
-    if (!ap) {
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error allocating AudioPipe\n");
-      return SWITCH_STATUS_FALSE;
+    // optionally compress the audio on the way out
+    const char* encoding = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_ENCODING");
+    if (encoding) {
+      AudioEncoder::Encoding_t enc;
+      if (!AudioEncoder::parseEncoding(encoding, enc)) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) unknown encoding %s\n", tech_pvt->id, encoding);
+        return SWITCH_STATUS_FALSE;
+      }
+      if (enc != AudioEncoder::L16) {
+        const char* frameMs = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_OPUS_FRAME_MS");
+        const char* bitrate = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_OPUS_BITRATE");
+        const char* complexity = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_OPUS_COMPLEXITY");
+        int ms = frameMs ? ::atoi(frameMs) : RTP_PACKETIZATION_PERIOD;
+        int bps = bitrate ? std::max(6000, std::min(::atoi(bitrate), 510000)) : DEFAULT_OPUS_BITRATE_PER_CHANNEL * channels;
+        if (enc != AudioEncoder::OPUS) ms = RTP_PACKETIZATION_PERIOD;
+
+        std::string err;
+        AudioEncoder* encoder = new AudioEncoder(enc, desiredSampling, channels, ms, bps);
+        if (!encoder->init(err)) {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) error initializing %s encoder: %s\n", 
+            tech_pvt->id, encoder->name(), err.c_str());
+          delete encoder;
+          return SWITCH_STATUS_FALSE;
+        }
+        encoder->setComplexity(complexity ? ::atoi(complexity) : DEFAULT_OPUS_COMPLEXITY);
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) encoding %s, %u ms frames of %lu bytes\n", 
+          tech_pvt->id, encoder->name(), encoder->frameMs(), encoder->frameBytes());
+        tech_pvt->pEncoder = static_cast<void *>(encoder);
+
+        framelen = encoder->frameBytes();
+        bytesPerSec = framelen * 1000 / encoder->frameMs();
+        frameDurationMs = encoder->frameMs();
+        advertiseAudioFormat(tech_pvt, session, encoder, desiredSampling, channels);
+      }
+    }
+    size_t buflen = bytesPerSec * nAudioBufferSecs;
+
+    const char* flushMs = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_FLUSH_MS");
+    const char* reconnectAttempts = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_RECONNECT_ATTEMPTS");
+    bool multiplex = switch_true(switch_channel_get_variable(channel, "MOD_AUDIO_FORK_MULTIPLEX"));
+    bool frameHeader = switch_true(switch_channel_get_variable(channel, "MOD_AUDIO_FORK_FRAME_HEADER"));
+    bool bidirectional = switch_true(switch_channel_get_variable(channel, "MOD_AUDIO_FORK_BIDIRECTIONAL_AUDIO"));
+    bool spool = switch_true(switch_channel_get_variable(channel, "MOD_AUDIO_FORK_SPOOL"));
+    const char* pingIntervalMs = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_PING_INTERVAL_MS");
+    if (!pingIntervalMs) pingIntervalMs = std::getenv("MOD_AUDIO_FORK_PING_INTERVAL_MS");
+    const char* pingTimeoutMs = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_PING_TIMEOUT_MS");
+    if (!pingTimeoutMs) pingTimeoutMs = std::getenv("MOD_AUDIO_FORK_PING_TIMEOUT_MS");
+    const char* balance = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_BALANCE");
+    if (!balance) balance = std::getenv("MOD_AUDIO_FORK_BALANCE");
+    EndpointBalancer::Policy_t policy = EndpointBalancer::LEAST_CONNECTIONS;
+    if (balance && !EndpointBalancer::parsePolicy(balance, policy)) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, 
+        "(%u) invalid MOD_AUDIO_FORK_BALANCE %s, must be least-connections or hash\n", tech_pvt->id, balance);
     }
 
-    tech_pvt->pAudioPipe = static_cast<void *>(ap);
+    // one pipe per destination, each with its own buffer, so a slow server only ever loses its own audio
+    for (int i = 0; i < nDestinations; i++) {
+      char pipeName[MAX_BUG_LEN + 8];
+      if (0 == i) strncpy(pipeName, bugname, sizeof(pipeName));
+      else snprintf(pipeName, sizeof(pipeName), "%s#%d", bugname, i);
+
+      // a set of interchangeable endpoints is put in order for this call; we start with the first and fail over down the list
+      std::vector<EndpointBalancer::Endpoint> endpoints;
+      EndpointBalancer::Endpoint first = { destinations[i].host, destinations[i].port, destinations[i].path, destinations[i].sslFlags };
+      if (destinations[i].endpoints[0]) {
+        std::stringstream ss(destinations[i].endpoints);
+        std::string url;
+        while (std::getline(ss, url, '|')) {
+          fork_destination_t alternative;
+          if (!parse_ws_uri(channel, url.c_str(), alternative.host, alternative.path, &alternative.port, &alternative.sslFlags, 
+            &alternative.transport)) {
+            continue;
+          }
+          EndpointBalancer::Endpoint endpoint = { alternative.host, alternative.port, alternative.path, alternative.sslFlags };
+          endpoints.push_back(endpoint);
+        }
+        if (!endpoints.empty()) {
+          AudioPipe::balanceEndpoints(endpoints, tech_pvt->sessionId, policy);
+          first = endpoints[0];
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) %s chosen out of %lu endpoints\n", 
+            tech_pvt->id, first.key().c_str(), (unsigned long) endpoints.size());
+          if (0 == i) {
+            strncpy(tech_pvt->host, first.host.c_str(), MAX_WS_URL_LEN - 1);
+            tech_pvt->port = first.port;
+            strncpy(tech_pvt->path, first.path.c_str(), MAX_PATH_LEN - 1);
+          }
+        }
+      }
+
+      AudioPipe* ap = new AudioPipe(tech_pvt->sessionId, first.host.c_str(), first.port, first.path.c_str(), 
+        first.sslFlags, buflen, framelen, username, password, pipeName, eventCallback);
+      if (!ap) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error allocating AudioPipe\n");
+        releasePipes(tech_pvt);
+        return SWITCH_STATUS_FALSE;
+      }
+
+      tech_pvt->pAudioPipe[i] = static_cast<void *>(ap);
+      tech_pvt->destinations = i + 1;
+
+      // a consumer on this host can take the audio through shared memory, one frame to a slot, instead of a websocket
+      bool shm = FORK_TRANSPORT_SHM == destinations[i].transport;
+      if (shm) {
+        std::string name = std::string("/audio_fork_") + tech_pvt->sessionId + "_" + std::to_string(tech_pvt->id) + "_" + std::to_string(i);
+        size_t slots = buflen / framelen;
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) sharing audio through %s, %lu slots\n", 
+          tech_pvt->id, name.c_str(), (unsigned long) slots);
+        ap->setShm(new ShmChannel(destinations[i].host, name, SWITCH_RECOMMENDED_BUFFER_SIZE, slots));
+        if (multiplex || spool || bidirectional || frameHeader || (reconnectAttempts && ::atoi(reconnectAttempts) > 0)) {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, 
+            "(%u) multiplexing, spooling, reconnecting, frame headers and bidirectional audio do not apply to shared memory\n", tech_pvt->id);
+        }
+      }
+
+      // optionally share one connection with the call's other forks to the same url
+      if (multiplex && !shm) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) multiplexing as stream %s\n", tech_pvt->id, pipeName);
+        ap->setMultiplex();
+        tech_pvt->multiplex = 1;
+      }
+      // a multiplexed fork rides on whichever connection its first choice has, so only a pipe of its own fails over
+      else if (endpoints.size() > 1) {
+        ap->setEndpoints(endpoints);
+      }
+
+      // optionally play binary frames from the (first) server straight into the call
+      if (bidirectional && 0 == i && !multiplex && !shm) {
+        const char* playbackRate = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_BIDIRECTIONAL_AUDIO_SAMPLE_RATE");
+        const char* bufferMs = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_BIDIRECTIONAL_AUDIO_BUFFER_MS");
+        const char* maxSecs = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_BIDIRECTIONAL_AUDIO_MAX_SECS");
+        switch_codec_t* writeCodec = switch_core_session_get_write_codec(session);
+        int inRate = playbackRate ? ::atoi(playbackRate) : desiredSampling;
+        int outRate = writeCodec && writeCodec->implementation ? writeCodec->implementation->actual_samples_per_second : sampling;
+        int ms = bufferMs ? std::max(0, ::atoi(bufferMs)) : DEFAULT_PLAYBACK_BUFFER_MS;
+        int secs = maxSecs ? std::max(1, std::min(::atoi(maxSecs), MAX_PLAYBACK_MAX_SECS)) : DEFAULT_PLAYBACK_MAX_SECS;
+
+        std::string err;
+        PlaybackBuffer* playback = new PlaybackBuffer(inRate, outRate, ms, secs * 1000, SWITCH_RESAMPLE_QUALITY);
+        if (inRate <= 0 || !playback->init(err)) {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) error initializing playback of %d Hz audio: %s\n", 
+            tech_pvt->id, inRate, err.c_str());
+          delete playback;
+          releasePipes(tech_pvt);
+          return SWITCH_STATUS_FALSE;
+        }
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) playing %d Hz audio from the server at %d Hz, buffering %d ms\n", 
+          tech_pvt->id, inRate, outRate, ms);
+        ap->setPlayback(playback);
+      }
+      else if (bidirectional && 0 == i && !shm) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "(%u) bidirectional audio is not supported on a multiplexed fork\n", 
+          tech_pvt->id);
+      }
+
+      // date the audio as it is queued, for the latency histograms and any frame header
+      ap->setFrameDuration(frameDurationMs);
+
+      // optionally describe each binary frame: sequence, position, capture time and drops
+      if (frameHeader) {
+        ap->setFrameHeader(channels, desiredSampling * frameDurationMs / 1000);
+      }
+
+      // optionally coalesce writes: the service thread sends whatever has queued once per interval
+      if (flushMs) {
+        int ms = std::max(0, std::min(::atoi(flushMs), MAX_FLUSH_INTERVAL_MS));
+        ms = (ms + RTP_PACKETIZATION_PERIOD - 1) / RTP_PACKETIZATION_PERIOD * RTP_PACKETIZATION_PERIOD;
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) flushing audio every %d ms\n", tech_pvt->id, ms);
+        ap->setFlushInterval(ms);
+      }
+
+      // optionally ride out a dropped connection: reconnect with backoff and replay the most recent audio
+      if (reconnectAttempts && ::atoi(reconnectAttempts) > 0 && !shm) {
+        const char* backoffMs = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_RECONNECT_BACKOFF_MS");
+        const char* replaySecs = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_REPLAY_SECS");
+        int attempts = ::atoi(reconnectAttempts);
+        int backoff = backoffMs ? std::max(0, ::atoi(backoffMs)) : DEFAULT_RECONNECT_BACKOFF_MS;
+        int secs = replaySecs ? std::max(0, std::min(::atoi(replaySecs), MAX_REPLAY_SECS)) : 0;
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) reconnect up to %d times, backoff %d ms, replay %d secs\n", 
+          tech_pvt->id, attempts, backoff, secs);
+        ap->setReconnectPolicy(attempts, backoff, bytesPerSec * secs);
+      }
+
+      // optionally ping the server, to learn the round trip time and to notice within seconds if it stops answering
+      if (pingIntervalMs && ::atoi(pingIntervalMs) > 0 && !shm) {
+        int interval = std::max(::atoi(pingIntervalMs), MIN_PING_MS);
+        int timeout = pingTimeoutMs ? std::max(::atoi(pingTimeoutMs), MIN_PING_MS) : DEFAULT_PING_TIMEOUT_MS;
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) ping every %d ms, timeout %d ms\n", 
+          tech_pvt->id, interval, timeout);
+        ap->setPingPolicy(interval, timeout);
+      }
+
+      // optionally keep audio on disk, rather than lose it, while the connection is down or behind
+      if (spool && !multiplex && !shm) {
+        const char* maxMB = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_SPOOL_MAX_MB");
+        int mb = maxMB ? std::max(1, ::atoi(maxMB)) : DEFAULT_SPOOL_MAX_MB;
+        std::string prefix = std::string(spoolDir ? spoolDir : SWITCH_GLOBAL_dirs.temp_dir) + SWITCH_PATH_SEPARATOR + 
+          "audio_fork_" + tech_pvt->sessionId + "_" + std::to_string(tech_pvt->id) + "_" + std::to_string(i);
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) spooling up to %d MB to %s\n", 
+          tech_pvt->id, mb, prefix.c_str());
+        if (!reconnectAttempts || ::atoi(reconnectAttempts) <= 0) {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, 
+            "(%u) spooling without MOD_AUDIO_FORK_RECONNECT_ATTEMPTS only covers a slow connection, not a lost one\n", tech_pvt->id);
+        }
+        ap->setSpool(new AudioSpool(prefix, nSpoolSegmentKB * 1024, (size_t) mb * 1024 * 1024));
+      }
+      else if (spool && 0 == i && !shm) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "(%u) spooling is not supported on a multiplexed fork\n", 
+          tech_pvt->id);
+      }
+    }
 
     switch_mutex_init(&tech_pvt->mutex, SWITCH_MUTEX_NESTED, switch_core_session_get_pool(session));
 
@@ -255,6 +766,7 @@ namespace {
       tech_pvt->resampler = speex_resampler_init(channels, sampling, desiredSampling, SWITCH_RESAMPLE_QUALITY, &err);
       if (0 != err) {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error initializing resampler: %s.\n", speex_resampler_strerror(err));
+        releasePipes(tech_pvt);
         return SWITCH_STATUS_FALSE;
       }
     }
@@ -262,6 +774,41 @@ namespace {
       switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) no resampling needed for this call\n", tech_pvt->id);
     }
 
+    // optionally send only speech, reporting the length of each silence in its place
+    if (switch_true(switch_channel_get_variable(channel, "MOD_AUDIO_FORK_VAD"))) {
+      const char* var;
+      int mode = DEFAULT_VAD_MODE;
+      int threshold = DEFAULT_VAD_ENERGY_THRESHOLD;
+      int voiceMs = DEFAULT_VAD_VOICE_MS;
+      int hangoverMs = DEFAULT_VAD_HANGOVER_MS;
+      int prerollMs = DEFAULT_VAD_PREROLL_MS;
+      int markerMs = DEFAULT_VAD_SILENCE_MARKER_MS;
+
+      if (var = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_VAD_MODE")) mode = std::max(-1, std::min(::atoi(var), 3));
+      if (var = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_VAD_ENERGY_THRESHOLD")) threshold = std::max(0, ::atoi(var));
+      if (var = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_VAD_VOICE_MS")) voiceMs = std::max(0, ::atoi(var));
+      if (var = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_VAD_HANGOVER_MS")) hangoverMs = std::max(0, ::atoi(var));
+      if (var = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_VAD_PREROLL_MS")) prerollMs = std::max(0, std::min(::atoi(var), 1000));
+      if (var = switch_channel_get_variable(channel, "MOD_AUDIO_FORK_VAD_SILENCE_MARKER_MS")) markerMs = std::max(0, ::atoi(var));
+
+      // the gate does its own hangover, so the detector is asked to call the end of speech as soon as it hears it
+      tech_pvt->vad = switch_vad_init(sampling, channels);
+      if (!tech_pvt->vad) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) error initializing vad\n", tech_pvt->id);
+        releasePipes(tech_pvt);
+        return SWITCH_STATUS_FALSE;
+      }
+      switch_vad_set_mode(tech_pvt->vad, mode);
+      switch_vad_set_param(tech_pvt->vad, "voice_ms", voiceMs);
+      switch_vad_set_param(tech_pvt->vad, "silence_ms", RTP_PACKETIZATION_PERIOD);
+
+      tech_pvt->pGate = static_cast<void *>(new SpeechGate(sampling, channels, threshold, hangoverMs, prerollMs, markerMs, 
+        RTP_PACKETIZATION_PERIOD));
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, 
+        "(%u) sending speech only: vad mode %d, energy threshold %d, hangover %d ms, pre-roll %d ms\n", 
+        tech_pvt->id, mode, threshold, hangoverMs, prerollMs);
+    }
+
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) fork_data_init\n", tech_pvt->id);
 
     return SWITCH_STATUS_SUCCESS;
@@ -273,6 +820,20 @@ namespace {
       speex_resampler_destroy(tech_pvt->resampler);
       tech_pvt->resampler = nullptr;
     }
+    if (tech_pvt->pEncoder) {
+      delete static_cast<AudioEncoder *>(tech_pvt->pEncoder);
+      tech_pvt->pEncoder = nullptr;
+    }
+    if (tech_pvt->pGate) {
+      SpeechGate* gate = static_cast<SpeechGate *>(tech_pvt->pGate);
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "%s (%u) held back %lu ms of silence\n", 
+        tech_pvt->sessionId, tech_pvt->id, (unsigned long) gate->suppressedMs());
+      delete gate;
+      tech_pvt->pGate = nullptr;
+    }
+    if (tech_pvt->vad) {
+      switch_vad_destroy(&tech_pvt->vad);
+    }
     if (tech_pvt->mutex) {
       switch_mutex_destroy(tech_pvt->mutex);
       tech_pvt->mutex = nullptr;
@@ -294,7 +855,8 @@ namespace {
 }
 
 extern "C" {
-  int parse_ws_uri(switch_channel_t *channel, const char* szServerUri, char* host, char *path, unsigned int* pPort, int* pSslFlags) {
+  int parse_ws_uri(switch_channel_t *channel, const char* szServerUri, char* host, char *path, unsigned int* pPort, int* pSslFlags, 
+    int* pTransport) {
     int i = 0, offset;
     char server[MAX_WS_URL_LEN + MAX_PATH_LEN];
     char *saveptr;
@@ -315,6 +877,47 @@ extern "C" {
 
     // get the scheme
     strncpy(server, szServerUri, MAX_WS_URL_LEN + MAX_PATH_LEN);
+    *pTransport = FORK_TRANSPORT_WEBSOCKET;
+
+    // consumers on this host: ws+unix://socket-path[:request-path], or shm://socket-path
+    if (0 == strncmp(server, "ws+unix://", 10) || 0 == strncmp(server, "WS+UNIX://", 10)) {
+#if defined(LWS_WITH_UNIX_SOCK)
+      std::string rest(server + 10);
+      size_t colon = rest.find(':');
+      std::string socketPath = rest.substr(0, colon);
+      std::string requestPath = std::string::npos == colon ? "/" : rest.substr(colon + 1);
+      if (socketPath.empty() || socketPath.length() + 1 >= MAX_WS_URL_LEN || requestPath.length() >= MAX_PATH_LEN || 
+        '/' != requestPath[0]) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "parse_ws_uri - invalid format %s\n", szServerUri);
+        return 0;
+      }
+      // lws takes a leading + on the address as the path of a unix domain socket
+      snprintf(host, MAX_WS_URL_LEN, "+%s", socketPath.c_str());
+      strcpy(path, requestPath.c_str());
+      *pPort = 0;
+      *pSslFlags = 0;
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "parse_ws_uri - unix socket %s, path %s\n", socketPath.c_str(), path);
+      return 1;
+#else
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "parse_ws_uri - %s: libwebsockets was built without unix socket support\n", 
+        szServerUri);
+      return 0;
+#endif
+    }
+    if (0 == strncmp(server, "shm://", 6) || 0 == strncmp(server, "SHM://", 6)) {
+      if (0 == strlen(server + 6) || strlen(server + 6) >= MAX_WS_URL_LEN) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "parse_ws_uri - invalid format %s\n", szServerUri);
+        return 0;
+      }
+      strcpy(host, server + 6);
+      strcpy(path, "/");
+      *pPort = 0;
+      *pSslFlags = 0;
+      *pTransport = FORK_TRANSPORT_SHM;
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "parse_ws_uri - shared memory, control socket %s\n", host);
+      return 1;
+    }
+
     if (0 == strncmp(server, "https://", 8) || 0 == strncmp(server, "HTTPS://", 8)) {
       *pSslFlags = flags;
       offset = 8;
@@ -368,19 +971,93 @@ extern "C" {
     return 1;
   }
 
+  /**
+   * a destination is a url, or a set of interchangeable urls to spread forks over: either separated by |, or
+   * set://name for the set configured in the environment as MOD_AUDIO_FORK_ENDPOINTS_<name>
+   */
+  int parse_fork_destination(switch_channel_t *channel, const char* szUrl, fork_destination_t* destination) {
+    std::string urls(szUrl);
+    if (0 == strncmp(szUrl, "set://", 6) || 0 == strncmp(szUrl, "SET://", 6)) {
+      std::string var = std::string("MOD_AUDIO_FORK_ENDPOINTS_") + (szUrl + 6);
+      const char* value = std::getenv(var.c_str());
+      if (!value || !*value) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "parse_fork_destination - %s is not set\n", var.c_str());
+        return 0;
+      }
+      urls = value;
+    }
+    if (std::string::npos == urls.find('|')) {
+      return parse_ws_uri(channel, urls.c_str(), destination->host, destination->path, &destination->port, &destination->sslFlags,
+        &destination->transport);
+    }
+
+    // check each of them now, so a bad one is reported when the fork is started rather than when a call fails over to it
+    int count = 0;
+    std::string alternatives;
+    std::stringstream ss(urls);
+    std::string url;
+    while (std::getline(ss, url, '|')) {
+      if (url.empty()) continue;
+      fork_destination_t alternative;
+      if (++count > MAX_FORK_ENDPOINTS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "parse_fork_destination - more than %d endpoints in %s\n", 
+          MAX_FORK_ENDPOINTS, szUrl);
+        return 0;
+      }
+      if (!parse_ws_uri(channel, url.c_str(), alternative.host, alternative.path, &alternative.port, &alternative.sslFlags, 
+        &alternative.transport)) {
+        return 0;
+      }
+      if (FORK_TRANSPORT_SHM == alternative.transport) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "parse_fork_destination - %s: shared memory cannot be balanced\n", 
+          url.c_str());
+        return 0;
+      }
+      if (1 == count) {
+        strcpy(destination->host, alternative.host);
+        strcpy(destination->path, alternative.path);
+        destination->port = alternative.port;
+        destination->sslFlags = alternative.sslFlags;
+        destination->transport = alternative.transport;
+      }
+      if (!alternatives.empty()) alternatives += "|";
+      alternatives += url;
+    }
+    if (alternatives.length() >= MAX_ENDPOINTS_LEN) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "parse_fork_destination - endpoint list too long: %s\n", szUrl);
+      return 0;
+    }
+    if (count > 1) strcpy(destination->endpoints, alternatives.c_str());
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "parse_fork_destination - %d endpoints\n", count);
+    return count > 0;
+  }
+
   switch_status_t fork_init() {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: audio buffer (in secs):    %d secs\n", nAudioBufferSecs);
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: sub-protocol:              %s\n", mySubProtocolName);
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: lws service threads:       %d\n", nServiceThreads);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: lws service threads:       %d%s\n", nServiceThreads,
+      pinServiceThreads ? " (pinned)" : "");
+    if (nClipCacheMB > 0) {
+      std::string dir = clipCacheDir ? clipCacheDir : SWITCH_GLOBAL_dirs.temp_dir;
+      clipCache.configure(dir, nClipCacheMB * 1024 * 1024);
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: playAudio clip cache:      %u MB in %s\n",
+        (unsigned int) nClipCacheMB, dir.c_str());
+    }
  
     int logs = LLL_ERR | LLL_WARN | LLL_NOTICE ;
      //LLL_INFO | LLL_PARSER | LLL_HEADER | LLL_EXT | LLL_CLIENT  | LLL_LATENCY | LLL_DEBUG ;
-    AudioPipe::initialize(mySubProtocolName, nServiceThreads, logs, lws_logger);
+    AudioPipe::initialize(mySubProtocolName, nServiceThreads, pinServiceThreads, logs, lws_logger);
+    if (nLatencyEventSecs > 0) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: latency event every:      %d secs\n", nLatencyEventSecs);
+      switch_scheduler_add_task(switch_epoch_time_now(NULL) + nLatencyEventSecs, latencyEventTask, "audio_fork_latency", 
+        "mod_audio_fork", 0, NULL, SSHF_NONE);
+    }
    return SWITCH_STATUS_SUCCESS;
   }
 
   switch_status_t fork_cleanup() {
     bool cleanup = false;
+    if (nLatencyEventSecs > 0) switch_scheduler_del_task_group("mod_audio_fork");
     cleanup = AudioPipe::deinitialize();
     if (cleanup == true) {
         return SWITCH_STATUS_SUCCESS;
@@ -388,14 +1065,190 @@ extern "C" {
     return SWITCH_STATUS_FALSE;
   }
 
+  switch_status_t fork_service_load(switch_stream_handle_t *stream) {
+    std::vector<AudioPipe::ContextLoad> loads;
+    AudioPipe::getContextLoad(loads);
+
+    cJSON* json = cJSON_CreateArray();
+    for (auto it = loads.begin(); it != loads.end(); ++it) {
+      cJSON* ctx = cJSON_CreateObject();
+      cJSON_AddNumberToObject(ctx, "context", it->index);
+      cJSON_AddNumberToObject(ctx, "cpu", it->cpu);
+      cJSON_AddNumberToObject(ctx, "pipes", it->activePipes);
+      cJSON_AddNumberToObject(ctx, "bytesSent", it->bytesSent);
+      cJSON_AddNumberToObject(ctx, "bytesPerSec", it->bytesPerSec);
+      cJSON_AddItemToArray(json, ctx);
+    }
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t fork_stats(switch_stream_handle_t *stream) {
+    std::vector<AudioPipe::ContextLoad> loads;
+    AudioPipe::getContextLoad(loads);
+
+    AudioPipe::Stats total;
+    memset(&total, 0, sizeof(total));
+    unsigned int pipes = 0;
+    cJSON* json = cJSON_CreateObject();
+    cJSON* jsonContexts = cJSON_CreateArray();
+    for (auto it = loads.begin(); it != loads.end(); ++it) {
+      cJSON* ctx = cJSON_CreateObject();
+      cJSON_AddNumberToObject(ctx, "context", it->index);
+      cJSON_AddNumberToObject(ctx, "pipes", it->activePipes);
+      cJSON_AddNumberToObject(ctx, "bytesPerSec", it->bytesPerSec);
+      addStatsJson(ctx, it->stats);
+      cJSON_AddItemToArray(jsonContexts, ctx);
+
+      const AudioPipe::Stats& s = it->stats;
+      pipes += it->activePipes;
+      total.bytesSent += s.bytesSent;
+      total.framesSent += s.framesSent;
+      total.textFrames += s.textFrames;
+      total.partialWrites += s.partialWrites;
+      total.droppedBytes += s.droppedBytes;
+      total.queueHighWater = std::max(total.queueHighWater, s.queueHighWater);
+      total.connects += s.connects;
+      total.connectUs += s.connectUs;
+      total.tlsHandshakes += s.tlsHandshakes;
+      total.tlsHandshakeUs += s.tlsHandshakeUs;
+      total.reconnects += s.reconnects;
+      total.spooledBytes += s.spooledBytes;
+      total.spoolDrainedBytes += s.spoolDrainedBytes;
+      total.spoolDroppedBytes += s.spoolDroppedBytes;
+      total.pongs += s.pongs;
+      total.pingRttUs += s.pingRttUs;
+      total.pingTimeouts += s.pingTimeouts;
+    }
+    cJSON* jsonTotal = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jsonTotal, "pipes", pipes);
+    addStatsJson(jsonTotal, total);
+    cJSON_AddItemToObject(json, "total", jsonTotal);
+    cJSON_AddItemToObject(json, "contexts", jsonContexts);
+
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t fork_latency(switch_stream_handle_t *stream) {
+    std::vector<LatencyHistogram::Snapshot> snapshots;
+    AudioPipe::getLatency(snapshots);
+
+    cJSON* json = latencyJson(snapshots);
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t fork_tls_sessions(switch_stream_handle_t *stream, int flush) {
+    if (flush) AudioPipe::flushTlsSessions();
+
+    TlsSessionCache::Stats stats;
+    AudioPipe::getTlsSessionStats(stats);
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "entries", stats.entries);
+    cJSON_AddNumberToObject(json, "hits", stats.hits);
+    cJSON_AddNumberToObject(json, "misses", stats.misses);
+    cJSON_AddNumberToObject(json, "stores", stats.stores);
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t fork_endpoints(switch_stream_handle_t *stream) {
+    std::vector<EndpointBalancer::EndpointInfo> endpoints;
+    AudioPipe::getEndpoints(endpoints);
+
+    cJSON* json = cJSON_CreateArray();
+    for (auto it = endpoints.begin(); it != endpoints.end(); ++it) {
+      cJSON* jsonEndpoint = cJSON_CreateObject();
+      cJSON_AddStringToObject(jsonEndpoint, "endpoint", it->key.c_str());
+      cJSON_AddItemToObject(jsonEndpoint, "healthy", cJSON_CreateBool(it->healthy));
+      cJSON_AddNumberToObject(jsonEndpoint, "active", it->active);
+      cJSON_AddNumberToObject(jsonEndpoint, "failures", it->failures);
+      cJSON_AddNumberToObject(jsonEndpoint, "connects", it->connects);
+      cJSON_AddNumberToObject(jsonEndpoint, "connectFailures", it->connectFailures);
+      cJSON_AddNumberToObject(jsonEndpoint, "probes", it->probes);
+      cJSON_AddNumberToObject(jsonEndpoint, "probeFailures", it->probeFailures);
+      cJSON_AddItemToArray(json, jsonEndpoint);
+    }
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t fork_dns_cache(switch_stream_handle_t *stream, int flush) {
+    if (flush) AudioPipe::flushDnsCache();
+
+    std::vector<DnsCache::EntryInfo> entries;
+    DnsCache::Stats stats;
+    AudioPipe::getDnsCache(entries, stats);
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "hits", stats.hits);
+    cJSON_AddNumberToObject(json, "misses", stats.misses);
+    cJSON_AddNumberToObject(json, "negativeHits", stats.negativeHits);
+    cJSON* jsonEntries = cJSON_CreateArray();
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      cJSON* jsonEntry = cJSON_CreateObject();
+      cJSON_AddStringToObject(jsonEntry, "host", it->host.c_str());
+      cJSON* jsonAddresses = cJSON_CreateArray();
+      for (auto addr = it->addresses.begin(); addr != it->addresses.end(); ++addr) {
+        cJSON_AddItemToArray(jsonAddresses, cJSON_CreateString(addr->c_str()));
+      }
+      cJSON_AddItemToObject(jsonEntry, "addresses", jsonAddresses);
+      cJSON_AddNumberToObject(jsonEntry, "ttl", it->ttl);
+      cJSON_AddItemToObject(jsonEntry, "negative", cJSON_CreateBool(it->negative));
+      cJSON_AddItemToArray(jsonEntries, jsonEntry);
+    }
+    cJSON_AddItemToObject(json, "entries", jsonEntries);
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t fork_clip_cache(switch_stream_handle_t *stream, int flush) {
+    if (flush) clipCache.purge();
+
+    ClipCache::Stats stats;
+    clipCache.getStats(stats);
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "enabled", cJSON_CreateBool(clipCache.enabled()));
+    cJSON_AddNumberToObject(json, "entries", stats.entries);
+    cJSON_AddNumberToObject(json, "bytes", stats.bytes);
+    cJSON_AddNumberToObject(json, "inUse", stats.inUse);
+    cJSON_AddNumberToObject(json, "hits", stats.hits);
+    cJSON_AddNumberToObject(json, "misses", stats.misses);
+    cJSON_AddNumberToObject(json, "evictions", stats.evictions);
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
   switch_status_t fork_session_init(switch_core_session_t *session, 
               responseHandler_t responseHandler,
               uint32_t samples_per_second, 
-              char *host,
-              unsigned int port,
-              char *path,
+              fork_destination_t* destinations,
+              int nDestinations,
               int sampling,
-              int sslFlags,
               int channels,
               char *bugname,
               char* metadata, 
@@ -409,7 +1262,7 @@ extern "C" {
       switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "error allocating memory!\n");
       return SWITCH_STATUS_FALSE;
     }
-    if (SWITCH_STATUS_SUCCESS != fork_data_init(tech_pvt, session, host, port, path, sslFlags, samples_per_second, sampling, channels, 
+    if (SWITCH_STATUS_SUCCESS != fork_data_init(tech_pvt, session, destinations, nDestinations, samples_per_second, sampling, channels, 
       bugname, metadata, responseHandler)) {
       destroy_tech_pvt(tech_pvt);
       return SWITCH_STATUS_FALSE;
@@ -421,8 +1274,10 @@ extern "C" {
 
    switch_status_t fork_session_connect(void **ppUserData) {
     private_t *tech_pvt = static_cast<private_t *>(*ppUserData);
-    AudioPipe *pAudioPipe = static_cast<AudioPipe*>(tech_pvt->pAudioPipe);
-    pAudioPipe->connect();
+    for (int i = 0; i < tech_pvt->destinations; i++) {
+      AudioPipe *pAudioPipe = static_cast<AudioPipe*>(tech_pvt->pAudioPipe[i]);
+      pAudioPipe->connect();
+    }
     return SWITCH_STATUS_SUCCESS;
   }
 
@@ -439,7 +1294,6 @@ extern "C" {
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) fork_session_cleanup\n", id);
 
     if (!tech_pvt) return SWITCH_STATUS_FALSE;
-    AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe);
       
     switch_mutex_lock(tech_pvt->mutex);
 
@@ -454,18 +1308,21 @@ extern "C" {
       }
     }
 
-    // delete any temp files
+    // delete any temp files, and let go of any shared ones
     struct playout* playout = tech_pvt->playout;
     while (playout) {
-      std::remove(playout->file);
+      if (!clipCache.release(playout->file)) std::remove(playout->file);
       free(playout->file);
       struct playout *tmp = playout;
       playout = playout->next;
       free(tmp);
     }
 
-    if (pAudioPipe && text) pAudioPipe->bufferForSending(text);
-    if (pAudioPipe) pAudioPipe->close();
+    for (int i = 0; i < tech_pvt->destinations; i++) {
+      AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe[i]);
+      if (pAudioPipe && text) sendText(tech_pvt, pAudioPipe, text);
+      if (pAudioPipe) pAudioPipe->close();
+    }
 
     destroy_tech_pvt(tech_pvt);
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) fork_session_cleanup: connection closed\n", id);
@@ -482,9 +1339,58 @@ extern "C" {
     private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
   
     if (!tech_pvt) return SWITCH_STATUS_FALSE;
-    AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe);
-    if (pAudioPipe && text) pAudioPipe->bufferForSending(text);
+    for (int i = 0; i < tech_pvt->destinations; i++) {
+      AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe[i]);
+      if (pAudioPipe && text) sendText(tech_pvt, pAudioPipe, text);
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t fork_session_stats(switch_core_session_t *session, char *bugname, switch_stream_handle_t *stream) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, bugname);
+    if (!bug) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "fork_session_stats failed because no bug\n");
+      return SWITCH_STATUS_FALSE;
+    }
+    private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+    if (!tech_pvt) return SWITCH_STATUS_FALSE;
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "bugname", bugname);
+    cJSON* jsonDestinations = cJSON_CreateArray();
 
+    // a pipe is only deleted once the event that clears its pointer here has been handled, which takes the mutex
+    switch_mutex_lock(tech_pvt->mutex);
+    for (int i = 0; i < tech_pvt->destinations; i++) {
+      AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe[i]);
+      cJSON* jsonDestination = cJSON_CreateObject();
+      cJSON_AddNumberToObject(jsonDestination, "destination", i);
+      if (pAudioPipe) {
+        AudioPipe::Stats stats;
+        pAudioPipe->getStats(stats);
+        cJSON_AddStringToObject(jsonDestination, "host", pAudioPipe->getHost().c_str());
+        cJSON_AddNumberToObject(jsonDestination, "port", pAudioPipe->getPort());
+        cJSON_AddItemToObject(jsonDestination, "connected", cJSON_CreateBool(pAudioPipe->getLwsState() == AudioPipe::LWS_CLIENT_CONNECTED));
+        addStatsJson(jsonDestination, stats);
+        cJSON_AddNumberToObject(jsonDestination, "lastRttMs", pAudioPipe->getRttUs() / 1000.0);
+      }
+      else cJSON_AddItemToObject(jsonDestination, "connected", cJSON_CreateBool(0));
+      cJSON_AddItemToArray(jsonDestinations, jsonDestination);
+    }
+    if (tech_pvt->pGate) {
+      SpeechGate* gate = static_cast<SpeechGate *>(tech_pvt->pGate);
+      cJSON_AddNumberToObject(json, "silenceMs", gate->suppressedMs());
+      cJSON_AddNumberToObject(json, "silenceMarkers", gate->markers());
+    }
+    switch_mutex_unlock(tech_pvt->mutex);
+    cJSON_AddItemToObject(json, "destinations", jsonDestinations);
+
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
     return SWITCH_STATUS_SUCCESS;
   }
 
@@ -517,100 +1423,129 @@ extern "C" {
 
     tech_pvt->graceful_shutdown = 1;
 
-    AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe);
-    if (pAudioPipe) pAudioPipe->do_graceful_shutdown();
+    for (int i = 0; i < tech_pvt->destinations; i++) {
+      AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe[i]);
+      if (pAudioPipe) pAudioPipe->do_graceful_shutdown();
+    }
 
     return SWITCH_STATUS_SUCCESS;
   }
 
   switch_bool_t fork_frame(switch_core_session_t *session, switch_media_bug_t *bug) {
     private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
-    size_t inuse = 0;
-    bool dirty = false;
-    char *p = (char *) "{\"msg\": \"buffer overrun\"}";
+    AudioPipe* pipes[MAX_FORK_DESTINATIONS] = { nullptr };
+    size_t dropped[MAX_FORK_DESTINATIONS] = { 0 };
+    int accepting = 0;
 
     if (!tech_pvt || tech_pvt->audio_paused || tech_pvt->graceful_shutdown) return SWITCH_TRUE;
     
     if (switch_mutex_trylock(tech_pvt->mutex) == SWITCH_STATUS_SUCCESS) {
-      if (!tech_pvt->pAudioPipe) {
-        switch_mutex_unlock(tech_pvt->mutex);
-        return SWITCH_TRUE;
+      // the frames are read, resampled and encoded once, and then copied to each destination still taking audio
+      for (int i = 0; i < tech_pvt->destinations; i++) {
+        AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe[i]);
+        if (pAudioPipe && pAudioPipe->isAcceptingAudio()) {
+          pipes[i] = pAudioPipe;
+          accepting++;
+        }
       }
-      AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe);
-      if (pAudioPipe->getLwsState() != AudioPipe::LWS_CLIENT_CONNECTED) {
+      if (0 == accepting) {
         switch_mutex_unlock(tech_pvt->mutex);
         return SWITCH_TRUE;
       }
 
-      pAudioPipe->lockAudioBuffer();
-      size_t available = pAudioPipe->binarySpaceAvailable();
-      if (NULL == tech_pvt->resampler) {
-        switch_frame_t frame = { 0 };
-        frame.data = pAudioPipe->binaryWritePtr();
-        frame.buflen = available;
-        while (true) {
+      uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
+      switch_frame_t frame = { 0 };
+      frame.data = data;
+      frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
+      SpeechGate* gate = static_cast<SpeechGate *>(tech_pvt->pGate);
 
-          // check if buffer would be overwritten; dump packets if so
-          if (available < pAudioPipe->binaryMinSpace()) {
-            if (!tech_pvt->buffer_overrun_notified) {
-              tech_pvt->buffer_overrun_notified = 1;
-              tech_pvt->responseHandler(session, EVENT_BUFFER_OVERRUN, NULL);
-            }
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets!\n", 
-              tech_pvt->id);
-            pAudioPipe->binaryWritePtrResetToZero();
+      // a lone shared memory destination taking the audio as it comes has it read straight into its ring; once the
+      // ring is full the rest goes the usual way, which counts what has to be dropped
+      if (1 == tech_pvt->destinations && pipes[0]->isShm() && !tech_pvt->resampler && !tech_pvt->pEncoder && !gate) {
+        size_t room;
+        uint8_t* slot;
+        while ((slot = pipes[0]->audioSlot(room))) {
+          frame.data = slot;
+          frame.buflen = room;
+          if (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) != SWITCH_STATUS_SUCCESS) break;
+          if (frame.datalen) pipes[0]->commitAudio(frame.datalen, AudioPipe::wallClockUs());
+        }
+        frame.data = data;
+        frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
+      }
 
-            frame.data = pAudioPipe->binaryWritePtr();
-            frame.buflen = available = pAudioPipe->binarySpaceAvailable();
-          }
+      while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
+        if (!frame.datalen) continue;
+        uint64_t captureUs = AudioPipe::wallClockUs();
 
-          switch_status_t rv = switch_core_media_bug_read(bug, &frame, SWITCH_TRUE);
-          if (rv != SWITCH_STATUS_SUCCESS) break;
-          if (frame.datalen) {
-            pAudioPipe->binaryWritePtrAdd(frame.datalen);
-            frame.buflen = available = pAudioPipe->binarySpaceAvailable();
-            frame.data = pAudioPipe->binaryWritePtr();
-            dirty = true;
+        // with the speech gate on, the energy prefilter spares the detector the frames that are plainly silent
+        if (gate) {
+          bool speech = gate->loud((const int16_t *) data, frame.datalen / sizeof(int16_t));
+          if (speech) {
+            switch_vad_state_t state = switch_vad_process(tech_pvt->vad, (int16_t *) data, frame.samples);
+            speech = SWITCH_VAD_STATE_START_TALKING == state || SWITCH_VAD_STATE_TALKING == state;
+          }
+          SpeechGate::Verdict_t verdict = gate->update(speech, frame.datalen);
+          if (SpeechGate::HOLD == verdict) {
+            gate->hold(data, frame.datalen, captureUs);
+            sendSilence(tech_pvt, pipes, gate->takeSilence(false));
+            continue;
+          }
+          if (SpeechGate::RESUME == verdict) {
+            uint8_t preroll[SWITCH_RECOMMENDED_BUFFER_SIZE];
+            sendSilence(tech_pvt, pipes, gate->takeSilence(true));
+            gate->drainPreroll(preroll, sizeof(preroll), [&](const uint8_t* d, size_t len, uint64_t us) {
+              forwardFrame(tech_pvt, pipes, dropped, d, len, us);
+            });
           }
         }
+        forwardFrame(tech_pvt, pipes, dropped, data, frame.datalen, captureUs);
       }
-      else {
-        uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
-        switch_frame_t frame = { 0 };
-        frame.data = data;
-        frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
-        while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
-          if (frame.datalen) {
-            spx_uint32_t out_len = available >> 1;  // space for samples which are 2 bytes
-            spx_uint32_t in_len = frame.samples;
-
-            speex_resampler_process_interleaved_int(tech_pvt->resampler, 
-              (const spx_int16_t *) frame.data, 
-              (spx_uint32_t *) &in_len, 
-              (spx_int16_t *) ((char *) pAudioPipe->binaryWritePtr()),
-              &out_len);
-
-            if (out_len > 0) {
-              // bytes written = num samples * 2 * num channels
-              size_t bytes_written = out_len << tech_pvt->channels;
-              pAudioPipe->binaryWritePtrAdd(bytes_written);
-              available = pAudioPipe->binarySpaceAvailable();
-              dirty = true;
-            }
-            if (available < pAudioPipe->binaryMinSpace()) {
-              if (!tech_pvt->buffer_overrun_notified) {
-                tech_pvt->buffer_overrun_notified = 1;
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets!\n", 
-                  tech_pvt->id);
-                tech_pvt->responseHandler(session, EVENT_BUFFER_OVERRUN, NULL);
-              }
-              break;
+
+      for (int i = 0; i < tech_pvt->destinations; i++) {
+        if (!pipes[i]) continue;
+
+        // oldest audio was discarded to make room for the newest
+        if (dropped[i] > 0) {
+          if (!(tech_pvt->buffer_overrun_notified & (1U << i))) {
+            tech_pvt->buffer_overrun_notified |= (1U << i);
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets!\n", 
+              tech_pvt->id);
+            if (tech_pvt->destinations > 1) {
+              tech_pvt->responseHandler(session, EVENT_BUFFER_OVERRUN, (char *) destinationJson(tech_pvt, i, NULL).c_str());
             }
+            else tech_pvt->responseHandler(session, EVENT_BUFFER_OVERRUN, NULL);
+          }
+          else {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) dropped %lu bytes of oldest audio\n", 
+              tech_pvt->id, dropped[i]);
           }
         }
+
+        pipes[i]->binaryWriteDone();
       }
+      switch_mutex_unlock(tech_pvt->mutex);
+    }
+    return SWITCH_TRUE;
+  }
+
+  switch_bool_t fork_write_replace(switch_core_session_t *session, switch_media_bug_t *bug) {
+    private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+
+    if (!tech_pvt) return SWITCH_TRUE;
 
-      pAudioPipe->unlockAudioBuffer();
+    // replace what the channel is about to play with audio the server has streamed to us, if there is any
+    if (switch_mutex_trylock(tech_pvt->mutex) == SWITCH_STATUS_SUCCESS) {
+      AudioPipe *pAudioPipe = static_cast<AudioPipe *>(tech_pvt->pAudioPipe[0]);
+      PlaybackBuffer* playback = pAudioPipe ? pAudioPipe->getPlayback() : nullptr;
+      switch_frame_t* frame = playback ? switch_core_media_bug_get_write_replace_frame(bug) : nullptr;
+      if (frame && frame->samples > 0 && frame->samples * sizeof(int16_t) <= frame->buflen) {
+        unsigned int frameMs = frame->rate ? frame->samples * 1000 / frame->rate : RTP_PACKETIZATION_PERIOD;
+        if (playback->read((int16_t *) frame->data, frame->samples, frameMs)) {
+          frame->datalen = frame->samples * sizeof(int16_t);
+          switch_core_media_bug_set_write_replace_frame(bug, frame);
+        }
+      }
       switch_mutex_unlock(tech_pvt->mutex);
     }
     return SWITCH_TRUE;
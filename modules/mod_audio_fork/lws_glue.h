@@ -3,18 +3,28 @@
 
 #include "mod_audio_fork.h"
 
-int parse_ws_uri(switch_channel_t *channel, const char* szServerUri, char* host, char *path, unsigned int* pPort, int* pSslFlags);
+int parse_ws_uri(switch_channel_t *channel, const char* szServerUri, char* host, char *path, unsigned int* pPort, int* pSslFlags, int* pTransport);
+int parse_fork_destination(switch_channel_t *channel, const char* szUrl, fork_destination_t* destination);
 
 switch_status_t fork_init();
 switch_status_t fork_cleanup();
+switch_status_t fork_service_load(switch_stream_handle_t *stream);
+switch_status_t fork_stats(switch_stream_handle_t *stream);
+switch_status_t fork_latency(switch_stream_handle_t *stream);
+switch_status_t fork_tls_sessions(switch_stream_handle_t *stream, int flush);
+switch_status_t fork_dns_cache(switch_stream_handle_t *stream, int flush);
+switch_status_t fork_clip_cache(switch_stream_handle_t *stream, int flush);
+switch_status_t fork_endpoints(switch_stream_handle_t *stream);
 switch_status_t fork_session_init(switch_core_session_t *session, responseHandler_t responseHandler,
-		uint32_t samples_per_second, char *host, unsigned int port, char* path, int sampling, int sslFlags, int channels, 
+		uint32_t samples_per_second, fork_destination_t* destinations, int nDestinations, int sampling, int channels, 
     char *bugname, char* metadata, void **ppUserData);
 switch_status_t fork_session_cleanup(switch_core_session_t *session, char *bugname, char* text, int channelIsClosing);
 switch_status_t fork_session_pauseresume(switch_core_session_t *session, char *bugname, int pause);
 switch_status_t fork_session_graceful_shutdown(switch_core_session_t *session, char *bugname);
 switch_status_t fork_session_send_text(switch_core_session_t *session, char *bugname, char* text);
+switch_status_t fork_session_stats(switch_core_session_t *session, char *bugname, switch_stream_handle_t *stream);
 switch_bool_t fork_frame(switch_core_session_t *session, switch_media_bug_t *bug);
+switch_bool_t fork_write_replace(switch_core_session_t *session, switch_media_bug_t *bug);
 switch_status_t fork_service_threads();
 switch_status_t fork_session_connect(void **ppUserData);
 #endif
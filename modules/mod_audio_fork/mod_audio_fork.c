@@ -44,6 +44,10 @@ static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data,
 		return fork_frame(session, bug);
 		break;
 
+	case SWITCH_ABC_TYPE_WRITE_REPLACE:
+		return fork_write_replace(session, bug);
+		break;
+
 	case SWITCH_ABC_TYPE_WRITE:
 	default:
 		break;
@@ -54,11 +58,9 @@ static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data,
 
 static switch_status_t start_capture(switch_core_session_t *session, 
         switch_media_bug_flag_t flags, 
-        char* host,
-        unsigned int port, 
-        char* path,
+        fork_destination_t* destinations,
+        int nDestinations,
         int sampling,
-        int sslFlags,
 	      char* bugname, 
         char* metadata)
 {
@@ -69,10 +71,13 @@ static switch_status_t start_capture(switch_core_session_t *session,
 
 	void *pUserData = NULL;
   int channels = (flags & SMBF_STEREO) ? 2 : 1;
+  int i;
 
-	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, 
-    "mod_audio_fork (%s): streaming %d sampling to %s path %s port %d tls: %s.\n", 
-    bugname, sampling, host, path, port, sslFlags ? "yes" : "no");
+  for (i = 0; i < nDestinations; i++) {
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, 
+      "mod_audio_fork (%s): streaming %d sampling to %s path %s port %d tls: %s.\n", 
+      bugname, sampling, destinations[i].host, destinations[i].path, destinations[i].port, destinations[i].sslFlags ? "yes" : "no");
+  }
 
 	if (switch_channel_get_private(channel, bugname)) {
 		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "mod_audio_fork: bug %s already attached!\n", bugname);
@@ -81,6 +86,11 @@ static switch_status_t start_capture(switch_core_session_t *session,
 
 	read_codec = switch_core_session_get_read_codec(session);
 
+  // audio streamed back by the server replaces what the channel would otherwise play
+  if (switch_true(switch_channel_get_variable(channel, "MOD_AUDIO_FORK_BIDIRECTIONAL_AUDIO"))) {
+    flags |= SMBF_WRITE_REPLACE;
+  }
+
 	if (switch_channel_pre_answer(channel) != SWITCH_STATUS_SUCCESS) {
 		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "mod_audio_fork: channel must have reached pre-answer status before calling start!\n");
 		return SWITCH_STATUS_FALSE;
@@ -88,7 +98,7 @@ static switch_status_t start_capture(switch_core_session_t *session,
 
 	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "calling fork_session_init.\n");
 	if (SWITCH_STATUS_FALSE == fork_session_init(session, responseHandler, read_codec->implementation->actual_samples_per_second, 
-		host, port, path, sampling, sslFlags, channels, bugname, metadata, &pUserData)) {
+		destinations, nDestinations, sampling, channels, bugname, metadata, &pUserData)) {
 		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error initializing mod_audio_fork session.\n");
 		return SWITCH_STATUS_FALSE;
 	}
@@ -159,7 +169,7 @@ static switch_status_t send_text(switch_core_session_t *session, char* bugname,
   return status;
 }
 
-#define FORK_API_SYNTAX "<uuid> [start | stop | send_text | pause | resume | graceful-shutdown ] [wss-url | path] [mono | mixed | stereo] [8000 | 16000 | 24000 | 32000 | 64000] [bugname] [metadata]"
+#define FORK_API_SYNTAX "<uuid> [start | stop | send_text | pause | resume | graceful-shutdown | stats ] [wss-url[,wss-url...] | path] [mono | mixed | stereo] [8000 | 16000 | 24000 | 32000 | 64000] [bugname] [metadata]"
 SWITCH_STANDARD_API(fork_function)
 {
 	char *mycmd = NULL, *argv[7] = { 0 };
@@ -208,6 +218,14 @@ SWITCH_STANDARD_API(fork_function)
         if (argc > 2) bugname = argv[2];
 				status = do_graceful_shutdown(lsession, bugname);
       }
+      else if (!strcasecmp(argv[1], "stats")) {
+        if (argc > 2) bugname = argv[2];
+        // the stats are the whole response
+        if (SWITCH_STATUS_SUCCESS == fork_session_stats(lsession, bugname, stream)) {
+          switch_core_session_rwunlock(lsession);
+          goto done;
+        }
+      }
       else if (!strcasecmp(argv[1], "send_text")) {
         char * text = 0;
         if (argc < 3) {
@@ -227,9 +245,9 @@ SWITCH_STANDARD_API(fork_function)
       }
       else if (!strcasecmp(argv[1], "start")) {
 				switch_channel_t *channel = switch_core_session_get_channel(lsession);
-        char host[MAX_WS_URL_LEN], path[MAX_PATH_LEN];
-        unsigned int port;
-        int sslFlags;
+        fork_destination_t destinations[MAX_FORK_DESTINATIONS];
+        char *urls[MAX_FORK_DESTINATIONS + 1] = { 0 };
+        int nDestinations, i;
         int sampling = 8000;
       	switch_media_bug_flag_t flags = SMBF_READ_STREAM ;
         char *metadata = NULL;
@@ -262,13 +280,23 @@ SWITCH_STANDARD_API(fork_function)
 				else {
 					sampling = atoi(argv[4]);
 				}
-        if (!parse_ws_uri(channel, argv[2], &host[0], &path[0], &port, &sslFlags)) {
-          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "invalid websocket uri: %s\n", argv[2]);
+        // the same audio can be sent to several servers at once: a comma-separated list of urls
+        nDestinations = switch_separate_string(argv[2], ',', urls, (sizeof(urls) / sizeof(urls[0])));
+        if (nDestinations > MAX_FORK_DESTINATIONS) {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "too many websocket uris, the limit is %d\n", MAX_FORK_DESTINATIONS);
+          switch_core_session_rwunlock(lsession);
+          goto done;
         }
-				else if (sampling % 8000 != 0) {
+        for (i = 0; i < nDestinations; i++) {
+          memset(&destinations[i], 0, sizeof(fork_destination_t));
+          if (!parse_fork_destination(channel, urls[i], &destinations[i])) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "invalid websocket uri: %s\n", urls[i]);
+          }
+        }
+				if (sampling % 8000 != 0) {
           switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "invalid sample rate: %s\n", argv[4]);					
 				}
-        status = start_capture(lsession, flags, host, port, path, sampling, sslFlags, bugname, metadata);
+        status = start_capture(lsession, flags, destinations, nDestinations, sampling, bugname, metadata);
 			}
       else {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "unsupported mod_audio_fork cmd: %s\n", argv[1]);
@@ -292,6 +320,72 @@ SWITCH_STANDARD_API(fork_function)
 	return SWITCH_STATUS_SUCCESS;
 }
 
+#define FORK_LOAD_API_SYNTAX ""
+SWITCH_STANDARD_API(fork_load_function)
+{
+	fork_service_load(stream);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_STATS_API_SYNTAX ""
+SWITCH_STANDARD_API(fork_stats_function)
+{
+	fork_stats(stream);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_LATENCY_API_SYNTAX ""
+SWITCH_STANDARD_API(fork_latency_function)
+{
+	fork_latency(stream);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_TLS_API_SYNTAX "[flush]"
+SWITCH_STANDARD_API(fork_tls_function)
+{
+	int flush = !zstr(cmd) && 0 == strcasecmp(cmd, "flush");
+
+	if (!zstr(cmd) && !flush) {
+		stream->write_function(stream, "-USAGE: %s\n", FORK_TLS_API_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
+	}
+	fork_tls_sessions(stream, flush);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_DNS_API_SYNTAX "[flush]"
+SWITCH_STANDARD_API(fork_dns_function)
+{
+	int flush = !zstr(cmd) && 0 == strcasecmp(cmd, "flush");
+
+	if (!zstr(cmd) && !flush) {
+		stream->write_function(stream, "-USAGE: %s\n", FORK_DNS_API_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
+	}
+	fork_dns_cache(stream, flush);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_CLIP_API_SYNTAX "[flush]"
+SWITCH_STANDARD_API(fork_clip_function)
+{
+	int flush = !zstr(cmd) && 0 == strcasecmp(cmd, "flush");
+
+	if (!zstr(cmd) && !flush) {
+		stream->write_function(stream, "-USAGE: %s\n", FORK_CLIP_API_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
+	}
+	fork_clip_cache(stream, flush);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_ENDPOINTS_API_SYNTAX ""
+SWITCH_STANDARD_API(fork_endpoints_function)
+{
+	fork_endpoints(stream);
+	return SWITCH_STATUS_SUCCESS;
+}
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_audio_fork_load)
 {
@@ -308,13 +402,21 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_audio_fork_load)
     switch_event_reserve_subclass(EVENT_PLAY_AUDIO) != SWITCH_STATUS_SUCCESS ||
     switch_event_reserve_subclass(EVENT_KILL_AUDIO) != SWITCH_STATUS_SUCCESS ||
     switch_event_reserve_subclass(EVENT_ERROR) != SWITCH_STATUS_SUCCESS ||
-    switch_event_reserve_subclass(EVENT_DISCONNECT) != SWITCH_STATUS_SUCCESS) {
+    switch_event_reserve_subclass(EVENT_DISCONNECT) != SWITCH_STATUS_SUCCESS ||
+    switch_event_reserve_subclass(EVENT_LATENCY) != SWITCH_STATUS_SUCCESS) {
 
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't register an event subclass for mod_audio_fork API.\n");
 		return SWITCH_STATUS_TERM;
 	}
 
 	SWITCH_ADD_API(api_interface, "uuid_audio_fork", "audio_fork API", fork_function, FORK_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_load", "audio_fork service thread load", fork_load_function, FORK_LOAD_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_stats", "audio_fork transport statistics", fork_stats_function, FORK_STATS_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_latency", "audio_fork capture to send latency", fork_latency_function, FORK_LATENCY_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_tls_cache", "audio_fork TLS session cache", fork_tls_function, FORK_TLS_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_dns", "audio_fork resolver cache", fork_dns_function, FORK_DNS_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_clip_cache", "audio_fork playAudio clip cache", fork_clip_function, FORK_CLIP_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_endpoints", "audio_fork endpoint health", fork_endpoints_function, FORK_ENDPOINTS_API_SYNTAX);
 	switch_console_set_complete("add uuid_audio_fork start wss-url metadata");
 	switch_console_set_complete("add uuid_audio_fork start wss-url");
 	switch_console_set_complete("add uuid_audio_fork stop");
@@ -341,6 +443,7 @@ SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_audio_fork_shutdown)
 	switch_event_free_subclass(EVENT_KILL_AUDIO);
 	switch_event_free_subclass(EVENT_DISCONNECT);
 	switch_event_free_subclass(EVENT_ERROR);
+	switch_event_free_subclass(EVENT_LATENCY);
 
 	return SWITCH_STATUS_SUCCESS;
 }
@@ -12,6 +12,12 @@
 #define MAX_SESSION_ID (256)
 #define MAX_WS_URL_LEN (512)
 #define MAX_PATH_LEN (4096)
+#define MAX_FORK_DESTINATIONS (4)
+#define MAX_ENDPOINTS_LEN (2048)
+#define MAX_FORK_ENDPOINTS (8)
+
+#define FORK_TRANSPORT_WEBSOCKET (0)    /* ws, wss, ws+unix, http, https */
+#define FORK_TRANSPORT_SHM (1)          /* shm: shared memory with a consumer on this host; host is its socket */
 
 #define EVENT_TRANSCRIPTION   "mod_audio_fork::transcription"
 #define EVENT_TRANSFER        "mod_audio_fork::transfer"
@@ -23,6 +29,9 @@
 #define EVENT_CONNECT_FAIL    "mod_audio_fork::connect_failed"
 #define EVENT_BUFFER_OVERRUN  "mod_audio_fork::buffer_overrun"
 #define EVENT_JSON            "mod_audio_fork::json"
+#define EVENT_RECONNECTING    "mod_audio_fork::reconnecting"
+#define EVENT_RECONNECTED     "mod_audio_fork::reconnected"
+#define EVENT_LATENCY         "mod_audio_fork::latency"
 
 #define MAX_METADATA_LEN (8192)
 
@@ -31,6 +40,17 @@ struct playout {
   struct playout* next;
 };
 
+struct fork_destination {
+  char host[MAX_WS_URL_LEN];
+  unsigned int port;
+  char path[MAX_PATH_LEN];
+  int sslFlags;
+  int transport;
+  char endpoints[MAX_ENDPOINTS_LEN];    /* interchangeable urls separated by |, when there is more than one */
+};
+
+typedef struct fork_destination fork_destination_t;
+
 typedef void (*responseHandler_t)(switch_core_session_t* session, const char* eventName, char* json);
 
 struct private_data {
@@ -39,7 +59,11 @@ struct private_data {
   char bugname[MAX_BUG_LEN+1];
   SpeexResamplerState *resampler;
   responseHandler_t responseHandler;
-  void *pAudioPipe;
+  void *pAudioPipe[MAX_FORK_DESTINATIONS];
+  int destinations;
+  void *pEncoder;
+  void *pGate;
+  switch_vad_t *vad;
   int ws_state;
   char host[MAX_WS_URL_LEN];
   unsigned int port;
@@ -48,9 +72,10 @@ struct private_data {
   struct playout* playout;
   int  channels;
   unsigned int id;
-  int buffer_overrun_notified:1;
+  unsigned int buffer_overrun_notified;    /* one bit per destination */
   int audio_paused:1;
   int graceful_shutdown:1;
+  int multiplex:1;
   char initialMetadata[8192];
 };
 
@@ -1,12 +1,13 @@
 #include "parser.hpp"
 #include <switch.h>
 
-cJSON* parse_json(switch_core_session_t* session, const std::string& data, std::string& type) {
+// data must be NUL-terminated at data[len]; it is parsed where it lies
+cJSON* parse_json(switch_core_session_t* session, const char* data, size_t len, std::string& type) {
   cJSON* json = NULL;
   const char *szType = NULL;
-  json = cJSON_Parse(data.c_str());
+  json = cJSON_Parse(data);
   if (!json) {
-    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "parse - failed parsing incoming msg as JSON: %s\n", data.c_str());
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "parse - failed parsing incoming msg (%lu bytes) as JSON: %s\n", len, data);
     return NULL;
   }
 
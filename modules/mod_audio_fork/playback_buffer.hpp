@@ -0,0 +1,163 @@
+#ifndef __PLAYBACK_BUFFER_HPP__
+#define __PLAYBACK_BUFFER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <speex/speex_resampler.h>
+
+#include "audio_ring.hpp"
+
+/**
+ * audio streamed back by the server, on its way into the call.
+ *
+ * The lws service thread writes 16-bit linear mono audio as it arrives in binary frames, in pieces of any size,
+ * and it is resampled to the channel's rate on the way in.  The media thread reads a frame at a time to replace
+ * what the channel would otherwise have played.  A little audio is buffered before playback starts or resumes,
+ * to absorb jitter in its arrival; if no more arrives for as long, whatever is left is played out anyway.
+ */
+class PlaybackBuffer {
+public:
+  PlaybackBuffer(unsigned int inRate, unsigned int outRate, unsigned int prebufferMs, unsigned int maxMs, int quality) :
+    m_inRate(inRate), m_outRate(outRate), m_quality(quality), m_resampler(nullptr), m_oddByte(-1),
+    m_ring((size_t) outRate * 2 * std::max(maxMs, prebufferMs + FRAME_MS) / 1000, (size_t) outRate * 2 * FRAME_MS / 1000),
+    m_prebufferBytes((size_t) outRate * 2 * prebufferMs / 1000), m_prebufferMs(prebufferMs),
+    m_writes(0), m_flush(false), m_playing(false), m_lastWrites(0), m_idleMs(0), m_underruns(0) {}
+  ~PlaybackBuffer() {
+    if (m_resampler) speex_resampler_destroy(m_resampler);
+  }
+
+  bool init(std::string& err) {
+    if (m_inRate == m_outRate) return true;
+    int error = 0;
+    m_resampler = speex_resampler_init(1, m_inRate, m_outRate, m_quality, &error);
+    if (0 != error || !m_resampler) {
+      err = speex_resampler_strerror(error);
+      return false;
+    }
+    return true;
+  }
+
+  // service thread: append audio from the server; a sample may be split across two calls
+  void write(const uint8_t* data, size_t len) {
+    int16_t in[BLOCK_SAMPLES];
+    int16_t out[BLOCK_SAMPLES * 8];
+
+    while (len > 0) {
+      size_t n = 0;
+      if (m_oddByte >= 0) {
+        uint8_t pair[2] = { (uint8_t) m_oddByte, data[0] };
+        memcpy(&in[n++], pair, sizeof(pair));
+        m_oddByte = -1;
+        data++;
+        len--;
+      }
+      size_t whole = std::min(len / sizeof(int16_t), BLOCK_SAMPLES - n);
+      memcpy(&in[n], data, whole * sizeof(int16_t));
+      n += whole;
+      data += whole * sizeof(int16_t);
+      len -= whole * sizeof(int16_t);
+      if (1 == len) {
+        m_oddByte = data[0];
+        len = 0;
+      }
+      if (0 == n) break;
+
+      if (!m_resampler) {
+        m_ring.push((const uint8_t *) in, n * sizeof(int16_t));
+        continue;
+      }
+      const int16_t* p = in;
+      spx_uint32_t remaining = n;
+      while (remaining > 0) {
+        spx_uint32_t in_len = remaining;
+        spx_uint32_t out_len = sizeof(out) / sizeof(int16_t);
+        speex_resampler_process_int(m_resampler, 0, p, &in_len, out, &out_len);
+        if (out_len > 0) m_ring.push((const uint8_t *) out, out_len * sizeof(int16_t));
+        if (0 == in_len) break;
+        p += in_len;
+        remaining -= in_len;
+      }
+    }
+    m_writes.fetch_add(1, std::memory_order_release);
+  }
+
+  /**
+   * media thread: fill out with the next samples to play, padding with silence if the buffer runs dry;
+   * returns false, leaving out alone, if there is nothing to play.  Frames are expected every frameMs.
+   */
+  bool read(int16_t* out, size_t samples, unsigned int frameMs) {
+    if (m_flush.exchange(false, std::memory_order_acq_rel)) {
+      uint8_t discard[4096];
+      while (m_ring.pop(discard, sizeof(discard)) > 0);
+      m_playing = false;
+    }
+
+    uint64_t writes = m_writes.load(std::memory_order_acquire);
+    if (writes != m_lastWrites) {
+      m_lastWrites = writes;
+      m_idleMs = 0;
+    }
+    else m_idleMs += frameMs;
+
+    if (!m_playing) {
+      size_t buffered = m_ring.size();
+      if (0 == buffered) return false;
+      if (buffered < m_prebufferBytes && m_idleMs < m_prebufferMs) return false;
+      m_playing = true;
+    }
+
+    size_t bytes = samples * sizeof(int16_t);
+    size_t n = m_ring.pop((uint8_t *) out, bytes);
+    if (n < bytes) {
+      // ran dry: build the buffer up again before carrying on
+      memset((uint8_t *) out + n, 0, bytes - n);
+      m_playing = false;
+      if (m_idleMs < m_prebufferMs) m_underruns++;
+      if (0 == n) return false;
+    }
+    return true;
+  }
+
+  // any thread: throw away whatever is waiting to be played, e.g. when the server interrupts itself
+  void clear(void) {
+    m_flush.store(true, std::memory_order_release);
+  }
+
+  // media thread only
+  uint64_t underruns(void) const {
+    return m_underruns;
+  }
+  uint64_t droppedBytes(void) const {
+    return m_ring.droppedBytes();
+  }
+
+  // no default constructor or copying
+  PlaybackBuffer() = delete;
+  PlaybackBuffer(const PlaybackBuffer&) = delete;
+  void operator=(const PlaybackBuffer&) = delete;
+
+private:
+  static const size_t BLOCK_SAMPLES = 1024;
+  static const unsigned int FRAME_MS = 20;
+
+  unsigned int m_inRate;
+  unsigned int m_outRate;
+  int m_quality;
+  SpeexResamplerState* m_resampler;   // service thread only
+  int m_oddByte;                      // first half of a sample split across writes; service thread only
+  AudioRing m_ring;                   // at the channel's rate; drops the oldest audio if the server gets too far ahead
+  size_t m_prebufferBytes;
+  unsigned int m_prebufferMs;
+  std::atomic<uint64_t> m_writes;
+  std::atomic<bool> m_flush;
+  bool m_playing;                     // media thread only, as are the rest
+  uint64_t m_lastWrites;
+  unsigned int m_idleMs;
+  uint64_t m_underruns;
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef __SHM_CHANNEL_HPP__
+#define __SHM_CHANNEL_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the shared ring needs lock-free 64 bit atomics");
+
+/**
+ * a fork's audio handed to a consumer on the same host through shared memory, rather than over a websocket.
+ *
+ * We connect to the consumer's unix domain socket (SOCK_SEQPACKET), which is then the control channel: it carries
+ * the text messages a websocket would, one per packet, both ways.  The audio goes into a named POSIX shared memory
+ * object laid out as a ring of fixed size slots, one frame per slot, with an eventfd as the doorbell; the first
+ * packet we send (the hello) carries the descriptors of both as SCM_RIGHTS, so the consumer need not look the
+ * segment up by name.
+ *
+ * One thread writes the audio (the media thread) and the consumer, in its own process, reads it; neither waits on
+ * the other.  When the ring is full new audio is dropped, and counted, rather than overwriting what the consumer
+ * may be reading; the slot sequence numbers show where the gaps are.  The doorbell is rung once per batch of frames.
+ */
+class ShmChannel {
+public:
+  static const uint32_t VERSION = 1;
+
+  // at the start of the segment
+  struct Header {
+    char magic[8];                        // "AFORKSHM"
+    uint32_t version;
+    uint32_t headerLen;                   // offset of the first slot
+    uint32_t slotCount;
+    uint32_t slotLen;                     // distance between slots; the audio in a slot starts after its SlotHeader
+    uint32_t slotCapacity;                // most audio one slot holds
+    uint32_t reserved[9];
+    alignas(64) std::atomic<uint64_t> head;       // slots written, published after the slot is filled; producer
+    alignas(64) std::atomic<uint64_t> tail;       // slots read, advanced by the consumer once done with a slot
+    alignas(64) std::atomic<uint64_t> dropped;    // frames discarded because the ring was full
+    std::atomic<uint32_t> ended;          // set once the audio is complete (graceful shutdown)
+  };
+
+  // at the start of each slot
+  struct SlotHeader {
+    uint32_t len;                         // bytes of audio
+    uint32_t flags;
+    uint64_t seq;                         // frames offered so far, dropped ones included
+    uint64_t captureUs;                   // when the last of the audio was captured, in microseconds since the epoch
+  };
+
+  ShmChannel(const std::string& socketPath, const std::string& name, size_t slotCapacity, size_t slotCount) :
+    m_socketPath(socketPath), m_name(name), m_slotCapacity(std::max(slotCapacity, (size_t) 1)),
+    m_slotCount(std::max(slotCount, (size_t) 2)), m_sock(-1), m_shmFd(-1), m_doorbell(-1), m_base(nullptr),
+    m_hdr(nullptr), m_len(0), m_head(0), m_rung(0), m_seq(0), m_unlink(false) {
+    m_slotLen = (sizeof(SlotHeader) + m_slotCapacity + 63) / 64 * 64;
+  }
+  ~ShmChannel() {
+    if (m_sock >= 0) ::close(m_sock);
+    if (m_doorbell >= 0) ::close(m_doorbell);
+    if (m_shmFd >= 0) ::close(m_shmFd);
+    if (m_base) munmap(m_base, m_len);
+    if (m_unlink) shm_unlink(m_name.c_str());
+  }
+
+  /**
+   * connect to the consumer, create the segment and the doorbell, and send hello along with them; any thread, once.
+   * Returns false, with the reason in err, if any of it fails
+   */
+  bool open(const std::string& hello, std::string& err) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (m_socketPath.empty() || m_socketPath.length() >= sizeof(addr.sun_path)) return fail(err, "invalid socket path", 0);
+    memcpy(addr.sun_path, m_socketPath.c_str(), m_socketPath.length());
+
+    m_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (m_sock < 0) return fail(err, "socket", errno);
+    if (::connect(m_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) return fail(err, "connect", errno);
+
+    m_len = sizeof(Header) + m_slotCount * m_slotLen;
+    m_shmFd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (m_shmFd < 0) return fail(err, "shm_open", errno);
+    m_unlink = true;
+    if (ftruncate(m_shmFd, m_len) < 0) return fail(err, "ftruncate", errno);
+    void* base = mmap(nullptr, m_len, PROT_READ | PROT_WRITE, MAP_SHARED, m_shmFd, 0);
+    if (MAP_FAILED == base) return fail(err, "mmap", errno);
+    m_base = (uint8_t *) base;
+
+    m_doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_doorbell < 0) return fail(err, "eventfd", errno);
+
+    m_hdr = new (m_base) Header();
+    memcpy(m_hdr->magic, "AFORKSHM", sizeof(m_hdr->magic));
+    m_hdr->version = VERSION;
+    m_hdr->headerLen = sizeof(Header);
+    m_hdr->slotCount = m_slotCount;
+    m_hdr->slotLen = m_slotLen;
+    m_hdr->slotCapacity = m_slotCapacity;
+    m_hdr->head.store(0, std::memory_order_relaxed);
+    m_hdr->tail.store(0, std::memory_order_relaxed);
+    m_hdr->dropped.store(0, std::memory_order_relaxed);
+    m_hdr->ended.store(0, std::memory_order_release);
+
+    // hello goes out with the segment and the doorbell attached
+    int fds[2] = { m_shmFd, m_doorbell };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(hello.c_str());
+    iov.iov_len = hello.length();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(m_sock, &msg, MSG_NOSIGNAL) < 0) return fail(err, "sendmsg", errno);
+
+    int flags = fcntl(m_sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(m_sock, F_SETFL, flags | O_NONBLOCK) < 0) return fail(err, "fcntl", errno);
+    return true;
+  }
+
+  // producer: the slot the next frame can be read straight into, with its capacity in len; nullptr if the ring is full
+  uint8_t* reserve(size_t& len) {
+    if (m_head - m_hdr->tail.load(std::memory_order_acquire) >= m_slotCount) return nullptr;
+    len = m_slotCapacity;
+    return slot(m_head) + sizeof(SlotHeader);
+  }
+
+  // producer: the slot reserve returned now holds len bytes of audio
+  void commit(size_t len, uint64_t captureUs) {
+    SlotHeader* sh = (SlotHeader *) slot(m_head);
+    sh->len = len;
+    sh->flags = 0;
+    sh->seq = m_seq++;
+    sh->captureUs = captureUs;
+    m_hdr->head.store(++m_head, std::memory_order_release);
+  }
+
+  // producer: copy audio into the ring, a slot's worth at a time; returns the bytes dropped because it was full
+  size_t write(const uint8_t* data, size_t len, uint64_t captureUs) {
+    while (len > 0) {
+      size_t room;
+      uint8_t* p = reserve(room);
+      if (!p) {
+        m_seq++;
+        m_hdr->dropped.fetch_add(1, std::memory_order_relaxed);
+        return len;
+      }
+      size_t n = std::min(len, room);
+      memcpy(p, data, n);
+      commit(n, captureUs);
+      data += n;
+      len -= n;
+    }
+    return 0;
+  }
+
+  // producer: wake the consumer if anything was written since the last time
+  void ring(void) {
+    if (m_rung == m_head) return;
+    m_rung = m_head;
+    uint64_t one = 1;
+    ssize_t n = ::write(m_doorbell, &one, sizeof(one));
+    (void) n;
+  }
+
+  // any thread: no more audio is coming
+  void end(void) {
+    m_hdr->ended.store(1, std::memory_order_release);
+    uint64_t one = 1;
+    ssize_t n = ::write(m_doorbell, &one, sizeof(one));
+    (void) n;
+  }
+
+  // any thread: send a text message on the control channel; false if the consumer is not keeping up or has gone
+  bool sendText(const char* text, size_t len) {
+    return send(m_sock, text, len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) len;
+  }
+
+  /**
+   * read the next message from the control channel into buf; returns its length, which is more than len if it was
+   * truncated, 0 if there is none waiting, or -1 if the consumer has closed the channel or it has failed
+   */
+  ssize_t receive(uint8_t* buf, size_t len) {
+    ssize_t n = recv(m_sock, buf, len, MSG_DONTWAIT | MSG_TRUNC);
+    if (n > 0) return n;
+    if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) return 0;
+    return -1;
+  }
+
+  // any thread: closes the control channel, which the consumer sees as the end of the fork
+  void shutdown(void) {
+    if (m_sock >= 0) ::shutdown(m_sock, SHUT_RDWR);
+  }
+
+  int controlFd(void) const {
+    return m_sock;
+  }
+  const std::string& name(void) const {
+    return m_name;
+  }
+  size_t slotCount(void) const {
+    return m_slotCount;
+  }
+  size_t slotCapacity(void) const {
+    return m_slotCapacity;
+  }
+
+  // no default constructor or copying
+  ShmChannel() = delete;
+  ShmChannel(const ShmChannel&) = delete;
+  void operator=(const ShmChannel&) = delete;
+
+private:
+  uint8_t* slot(uint64_t n) const {
+    return m_base + sizeof(Header) + (n % m_slotCount) * m_slotLen;
+  }
+
+  static bool fail(std::string& err, const char* what, int e) {
+    err = what;
+    if (e) err += std::string(": ") + strerror(e);
+    return false;
+  }
+
+  std::string m_socketPath;
+  std::string m_name;
+  size_t m_slotCapacity;
+  size_t m_slotCount;
+  size_t m_slotLen;
+  int m_sock;
+  int m_shmFd;
+  int m_doorbell;
+  uint8_t* m_base;
+  Header* m_hdr;
+  size_t m_len;
+  uint64_t m_head;      // producer's copy of head
+  uint64_t m_rung;      // head when the doorbell was last rung; producer only
+  uint64_t m_seq;       // producer only
+  bool m_unlink;
+};
+
+#endif
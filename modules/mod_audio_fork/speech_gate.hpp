@@ -0,0 +1,119 @@
+#ifndef __SPEECH_GATE_HPP__
+#define __SPEECH_GATE_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "audio_ring.hpp"
+
+/**
+ * decides which frames of a fork's audio are worth sending, so long silences are not streamed.
+ *
+ * Frames are classified as they are read from the bug, at the channel's rate: anything quieter than the energy
+ * threshold is silence outright, and louder frames are left to the caller's voice activity detector.  Speech is
+ * sent, along with a hangover of whatever follows it so words are not clipped at the end.  Once the hangover runs
+ * out frames are held back in a short pre-roll, which goes out ahead of the next speech so its onset is not
+ * clipped either; audio that falls out of the pre-roll is counted as silence, for the caller to report in place
+ * of the audio itself.  Media thread only.
+ */
+class SpeechGate {
+public:
+  enum Verdict_t {
+    SEND,       // speech, or within the hangover after it
+    RESUME,     // speech after silence: report the silence, send the pre-roll, then this frame
+    HOLD        // silence: hand the frame to hold()
+  };
+
+  SpeechGate(unsigned int sampleRate, unsigned int channels, unsigned int energyThreshold, unsigned int hangoverMs,
+    unsigned int prerollMs, unsigned int markerMs, unsigned int frameMs) :
+    m_bytesPerMs(sampleRate * channels * sizeof(int16_t) / 1000), m_threshold(energyThreshold), m_hangoverMs(hangoverMs),
+    m_markerMs(std::max(markerMs, frameMs)), m_speaking(false), m_quietMs(0), m_silentBytes(0),
+    m_preroll(std::max((size_t) 1, (size_t) m_bytesPerMs * prerollMs), (size_t) m_bytesPerMs * frameMs),
+    m_suppressedMs(0), m_markers(0) {
+    m_preroll.enableTimestamps(frameMs * 1000);
+  }
+
+  // the energy prefilter: false if the mean square of the samples is under the threshold squared
+  bool loud(const int16_t* samples, size_t n) const {
+    if (0 == n) return false;
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum += (int32_t) samples[i] * samples[i];
+    return (uint64_t) sum > (uint64_t) m_threshold * m_threshold * n;
+  }
+
+  // classify the next frame, len bytes long, given whether it holds speech
+  Verdict_t update(bool speech, size_t len) {
+    if (speech) {
+      m_quietMs = 0;
+      if (m_speaking) return SEND;
+      m_speaking = true;
+      return RESUME;
+    }
+    if (m_speaking) {
+      m_quietMs += ms(len);
+      if (m_quietMs <= m_hangoverMs) return SEND;
+      m_speaking = false;
+    }
+    return HOLD;
+  }
+
+  // keep a silent frame for the pre-roll; captureUs is when it was read
+  void hold(const uint8_t* data, size_t len, uint64_t captureUs) {
+    m_silentBytes += m_preroll.push(data, len, captureUs);
+  }
+
+  /**
+   * the milliseconds of silence not yet reported, once there are at least markerMs of them or, with all, whatever
+   * there is (e.g. when speech resumes); 0 if there is nothing to report yet
+   */
+  unsigned int takeSilence(bool all) {
+    unsigned int silentMs = ms(m_silentBytes);
+    if (0 == silentMs || (!all && silentMs < m_markerMs)) return 0;
+    m_silentBytes -= (size_t) silentMs * m_bytesPerMs;
+    m_suppressedMs += silentMs;
+    m_markers++;
+    return silentMs;
+  }
+
+  // hand the pre-roll to fn(data, len, captureUs) a frame at a time, oldest first, captureUs being when each was read
+  template<typename F>
+  void drainPreroll(uint8_t* buf, size_t buflen, F fn) {
+    size_t frameLen = std::min(m_preroll.frameLen(), buflen);
+    uint64_t startUs = 0;
+    size_t n;
+    while ((n = m_preroll.pop(buf, frameLen, nullptr, &startUs)) > 0) {
+      fn(buf, n, startUs + (uint64_t) ms(n) * 1000);
+    }
+  }
+
+  uint64_t suppressedMs(void) const {
+    return m_suppressedMs;
+  }
+  uint64_t markers(void) const {
+    return m_markers;
+  }
+
+  // no default constructor or copying
+  SpeechGate() = delete;
+  SpeechGate(const SpeechGate&) = delete;
+  void operator=(const SpeechGate&) = delete;
+
+private:
+  unsigned int ms(size_t bytes) const {
+    return m_bytesPerMs ? bytes / m_bytesPerMs : 0;
+  }
+
+  size_t m_bytesPerMs;
+  unsigned int m_threshold;
+  unsigned int m_hangoverMs;
+  unsigned int m_markerMs;
+  bool m_speaking;
+  unsigned int m_quietMs;     // since the last speech
+  size_t m_silentBytes;       // dropped from the pre-roll and not yet reported
+  AudioRing m_preroll;
+  uint64_t m_suppressedMs;
+  uint64_t m_markers;
+};
+
+#endif
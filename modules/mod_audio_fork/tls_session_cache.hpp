@@ -0,0 +1,163 @@
+#ifndef __TLS_SESSION_CACHE_HPP__
+#define __TLS_SESSION_CACHE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <libwebsockets.h>
+
+/**
+ * process-wide store of TLS client sessions, keyed by host:port.
+ *
+ * lws keeps a session cache per vhost, which for us means per service thread, so a connect that lands
+ * on a different thread than the last one to reach the same host would otherwise do a full handshake.
+ * After a full handshake the session is serialized out of the vhost cache into here, and before every
+ * connect it is loaded back into the connecting vhost, so any thread can resume it.
+ *
+ * Needs lws built with LWS_WITH_TLS_SESSIONS (the default); without it every call is a no-op.
+ */
+class TlsSessionCache {
+public:
+  struct Stats {
+    size_t entries;
+    uint64_t hits;      // handshakes that resumed a session
+    uint64_t misses;    // full handshakes
+    uint64_t stores;    // sessions saved into the cache
+  };
+
+  TlsSessionCache(size_t maxEntries = 256, time_t ttlSecs = 3600) :
+    m_maxEntries(maxEntries), m_ttlSecs(ttlSecs), m_hits(0), m_misses(0), m_stores(0) {}
+
+  void setMaxEntries(size_t maxEntries) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_maxEntries = maxEntries;
+    if (0 == m_maxEntries) m_entries.clear();
+  }
+  bool enabled(void) const {
+    return m_maxEntries > 0;
+  }
+  time_t ttl(void) const {
+    return m_ttlSecs;
+  }
+
+  // service thread: make any session we hold for host:port available to the vhost about to connect there
+  void load(struct lws_vhost* vh, const char* host, uint16_t port) {
+#if defined(LWS_WITH_TLS) && defined(LWS_WITH_TLS_SESSIONS)
+    if (!enabled()) return;
+    Request req = { this, makeKey(host, port) };
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      if (m_entries.end() == m_entries.find(req.key)) return;
+    }
+    lws_tls_session_dump_load(vh, host, port, loadCb, &req);
+#endif
+  }
+
+  // service thread: called once a connection is up; counts the handshake and keeps the session if it was a new one
+  void established(struct lws* wsi, const char* host, uint16_t port) {
+#if defined(LWS_WITH_TLS) && defined(LWS_WITH_TLS_SESSIONS)
+    if (!enabled()) return;
+    if (lws_tls_session_is_reused(wsi)) {
+      m_hits++;
+      return;
+    }
+    m_misses++;
+    Request req = { this, makeKey(host, port) };
+    lws_tls_session_dump_save(lws_get_vhost(wsi), host, port, saveCb, &req);
+#endif
+  }
+
+  void flush(void) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_entries.clear();
+  }
+
+  void getStats(Stats& stats) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    stats.entries = m_entries.size();
+    stats.hits = m_hits.load();
+    stats.misses = m_misses.load();
+    stats.stores = m_stores.load();
+  }
+
+  // no copying
+  TlsSessionCache(const TlsSessionCache&) = delete;
+  void operator=(const TlsSessionCache&) = delete;
+
+private:
+  struct Entry {
+    std::vector<uint8_t> blob;    // DER encoded session, as produced by lws
+    time_t stored;
+  };
+  struct Request {
+    TlsSessionCache* cache;
+    std::string key;
+  };
+
+  static std::string makeKey(const char* host, uint16_t port) {
+    return std::string(host) + ":" + std::to_string(port);
+  }
+
+#if defined(LWS_WITH_TLS) && defined(LWS_WITH_TLS_SESSIONS)
+  static int saveCb(struct lws_context* cx, struct lws_tls_session_dump* info) {
+    Request* req = static_cast<Request*>(info->opaque);
+    TlsSessionCache* cache = req->cache;
+    time_t now = time(nullptr);
+    std::lock_guard<std::mutex> lk(cache->m_mutex);
+
+    if (cache->m_entries.end() == cache->m_entries.find(req->key)) {
+      if (0 == cache->m_maxEntries) return 1;
+      while (cache->m_entries.size() >= cache->m_maxEntries) {
+        // full: make room by dropping the oldest session
+        auto oldest = cache->m_entries.begin();
+        for (auto it = cache->m_entries.begin(); it != cache->m_entries.end(); ++it) {
+          if (it->second.stored < oldest->second.stored) oldest = it;
+        }
+        cache->m_entries.erase(oldest);
+      }
+    }
+    Entry& entry = cache->m_entries[req->key];
+    entry.blob.assign((const uint8_t*) info->blob, (const uint8_t*) info->blob + info->blob_len);
+    entry.stored = now;
+    cache->m_stores++;
+    return 0;
+  }
+
+  static int loadCb(struct lws_context* cx, struct lws_tls_session_dump* info) {
+    Request* req = static_cast<Request*>(info->opaque);
+    TlsSessionCache* cache = req->cache;
+    std::lock_guard<std::mutex> lk(cache->m_mutex);
+
+    auto it = cache->m_entries.find(req->key);
+    if (cache->m_entries.end() == it) return 1;
+    if (time(nullptr) - it->second.stored > cache->m_ttlSecs) {
+      cache->m_entries.erase(it);
+      return 1;
+    }
+
+    // lws frees the blob once it has deserialized it
+    info->blob = malloc(it->second.blob.size());
+    if (!info->blob) return 1;
+    memcpy(info->blob, it->second.blob.data(), it->second.blob.size());
+    info->blob_len = it->second.blob.size();
+    return 0;
+  }
+#endif
+
+  std::mutex m_mutex;
+  std::unordered_map<std::string, Entry> m_entries;
+  std::atomic<size_t> m_maxEntries;
+  time_t m_ttlSecs;
+  std::atomic<uint64_t> m_hits;
+  std::atomic<uint64_t> m_misses;
+  std::atomic<uint64_t> m_stores;
+};
+
+#endif
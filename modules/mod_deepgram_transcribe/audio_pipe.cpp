@@ -2,16 +2,22 @@
 
 #include <cassert>
 #include <iostream>
+#include <algorithm>
 
 /* discard incoming text messages over the socket that are longer than this */
 #define MAX_RECV_BUF_SIZE (65 * 1024 * 10)
-#define RECV_BUF_REALLOC_SIZE (8 * 1024)
 
 using namespace deepgram;
 
 namespace {
+  // each service thread runs exactly one lws context, so a per-thread pool is a per-context pool
+  static thread_local BufferPool recvPool;
+
   static const char *requestedTcpKeepaliveSecs = std::getenv("MOD_AUDIO_FORK_TCP_KEEPALIVE_SECS");
   static int nTcpKeepaliveSecs = requestedTcpKeepaliveSecs ? ::atoi(requestedTcpKeepaliveSecs) : 55;
+
+  static const char *requestedTlsSessionCacheSize = std::getenv("MOD_AUDIO_FORK_TLS_SESSION_CACHE_SIZE");
+  static int nTlsSessionCacheSize = std::max(0, requestedTlsSessionCacheSize ? ::atoi(requestedTlsSessionCacheSize) : 256);
 }
 
 static int dch_lws_http_basic_auth_gen(const char *apiKey, char *buf, size_t len) {
@@ -86,6 +92,7 @@ int AudioPipe::lws_callback(struct lws *wsi,
           *ppAp = ap;
           ap->m_vhd = vhd;
           ap->m_state = LWS_CLIENT_CONNECTED;
+          tlsSessions.established(wsi, ap->m_host.c_str(), ap->m_port);
           ap->m_callback(ap->m_uuid.c_str(), AudioPipe::CONNECT_SUCCESS, NULL,  ap->isFinished());
         }
         else {
@@ -135,49 +142,52 @@ int AudioPipe::lws_callback(struct lws *wsi,
           return 0;
         }
 
+        BufferPool& pool = recvPool;
         if (lws_is_first_fragment(wsi)) {
-          // allocate a buffer for the entire chunk of memory needed
+          // take a pooled buffer big enough for this frame plus a terminating NUL so it can be handed up in place
           assert(nullptr == ap->m_recv_buf);
-          ap->m_recv_buf_len = len + lws_remaining_packet_payload(wsi);
-          ap->m_recv_buf = (uint8_t*) malloc(ap->m_recv_buf_len);
+          size_t needed = len + lws_remaining_packet_payload(wsi) + 1;
+          ap->m_recv_buf = needed <= MAX_RECV_BUF_SIZE ? pool.acquire(needed, ap->m_recv_buf_len) : nullptr;
           ap->m_recv_buf_ptr = ap->m_recv_buf;
-        }
-
-        size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
-        size_t remaining_space = ap->m_recv_buf_len - write_offset;
-        if (remaining_space < len) {
-          lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE buffer realloc needed.\n");
-          size_t newlen = ap->m_recv_buf_len + RECV_BUF_REALLOC_SIZE;
-          if (newlen > MAX_RECV_BUF_SIZE) {
-            free(ap->m_recv_buf);
-            ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-            ap->m_recv_buf_len = 0;
+          if (nullptr == ap->m_recv_buf) {
             lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
           }
-          else {
-            ap->m_recv_buf = (uint8_t*) realloc(ap->m_recv_buf, newlen);
-            if (nullptr != ap->m_recv_buf) {
-              ap->m_recv_buf_len = newlen;
-              ap->m_recv_buf_ptr = ap->m_recv_buf + write_offset;
-            }
-          }
         }
 
         if (nullptr != ap->m_recv_buf) {
-          if (len > 0) {
-            memcpy(ap->m_recv_buf_ptr, in, len);
-            ap->m_recv_buf_ptr += len;
-          }
-          if (lws_is_final_fragment(wsi)) {
-            if (nullptr != ap->m_recv_buf) {
-              std::string msg((char *)ap->m_recv_buf, ap->m_recv_buf_ptr - ap->m_recv_buf);
-              ap->m_callback(ap->m_uuid.c_str(), AudioPipe::MESSAGE, msg.c_str(),  ap->isFinished());
-              if (nullptr != ap->m_recv_buf) free(ap->m_recv_buf);
+          size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
+          if (ap->m_recv_buf_len - write_offset < len + 1) {
+            // message continues in further fragments: move up to the next slab class that fits
+            size_t newlen = 0;
+            uint8_t* newbuf = nullptr;
+            size_t needed = write_offset + len + lws_remaining_packet_payload(wsi) + 1;
+            if (needed <= MAX_RECV_BUF_SIZE) newbuf = pool.acquire(needed, newlen);
+            if (nullptr == newbuf) {
+              lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
             }
-            ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-            ap->m_recv_buf_len = 0;
+            else {
+              memcpy(newbuf, ap->m_recv_buf, write_offset);
+            }
+            pool.release(ap->m_recv_buf, ap->m_recv_buf_len);
+            ap->m_recv_buf = newbuf;
+            ap->m_recv_buf_ptr = newbuf ? newbuf + write_offset : nullptr;
+            ap->m_recv_buf_len = newlen;
           }
         }
+
+        if (nullptr != ap->m_recv_buf && len > 0) {
+          memcpy(ap->m_recv_buf_ptr, in, len);
+          ap->m_recv_buf_ptr += len;
+        }
+        if (lws_is_final_fragment(wsi)) {
+          if (nullptr != ap->m_recv_buf) {
+            *ap->m_recv_buf_ptr = '\0';
+            ap->m_callback(ap->m_uuid.c_str(), AudioPipe::MESSAGE, (char *) ap->m_recv_buf,  ap->isFinished());
+            pool.release(ap->m_recv_buf, ap->m_recv_buf_len);
+          }
+          ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
+          ap->m_recv_buf_len = 0;
+        }
       }
       break;
 
@@ -264,6 +274,7 @@ std::list<AudioPipe*> AudioPipe::pendingConnects;
 std::list<AudioPipe*> AudioPipe::pendingDisconnects;
 std::list<AudioPipe*> AudioPipe::pendingWrites;
 AudioPipe::log_emit_function AudioPipe::logger;
+TlsSessionCache AudioPipe::tlsSessions(nTlsSessionCacheSize);
 std::mutex AudioPipe::mapMutex;
 std::unordered_map<std::thread::id, bool> AudioPipe::stopFlags;
 std::queue<std::thread::id> AudioPipe::threadIds;
@@ -405,6 +416,13 @@ bool AudioPipe::lws_service_thread(unsigned int nServiceThread) {
   info.keepalive_timeout = 5;           // seconds to allow remote client to hold on to an idle HTTP/1.1 connection 
   info.timeout_secs_ah_idle = 10;       // secs to allow a client to hold an ah without using it
   info.retry_and_idle_policy = &retry;
+#if defined(LWS_WITH_TLS) && defined(LWS_WITH_TLS_SESSIONS)
+  if (tlsSessions.enabled()) {
+    // this vhost's own cache; sessions are shared with the other service threads through tlsSessions
+    info.tls_session_timeout = tlsSessions.ttl();
+    info.tls_session_cache_max = 64;
+  }
+#endif
 
   lwsl_notice("AudioPipe::lws_service_thread creating context in service thread %d.\n", nServiceThread);
 
@@ -484,7 +502,7 @@ AudioPipe::AudioPipe(const char* uuid, const char* host, unsigned int port, cons
 }
 AudioPipe::~AudioPipe() {
   if (m_audio_buffer) delete [] m_audio_buffer;
-  if (m_recv_buf) delete [] m_recv_buf;
+  if (m_recv_buf) free(m_recv_buf);
 }
 
 void AudioPipe::connect(void) {
@@ -510,6 +528,9 @@ bool AudioPipe::connect_client(struct lws_per_vhost_data *vhd) {
   m_state = LWS_CLIENT_CONNECTING;
   m_vhd = vhd;
 
+  // offer a session from an earlier handshake with this host, possibly made on another service thread
+  tlsSessions.load(vhd->vhost, m_host.c_str(), m_port);
+
   m_wsi = lws_client_connect_via_info(&i);
   lwsl_debug("%s attempting connection, wsi is %p\n", m_uuid.c_str(), m_wsi);
 
@@ -11,6 +11,9 @@
 
 #include <libwebsockets.h>
 
+#include "buffer_pool.hpp"
+#include "tls_session_cache.hpp"
+
 namespace deepgram {
 
 class AudioPipe {
@@ -42,6 +45,12 @@ public:
   static void initialize(unsigned int nThreads, int loglevel, log_emit_function logger);
   static bool deinitialize();
   static bool lws_service_thread(unsigned int nServiceThread);
+  static void getTlsSessionStats(TlsSessionCache::Stats& stats) {
+    tlsSessions.getStats(stats);
+  }
+  static void flushTlsSessions(void) {
+    tlsSessions.flush();
+  }
 
   // constructor
   AudioPipe(const char* uuid, const char* host, unsigned int port, const char* path, 
@@ -99,6 +108,7 @@ private:
   static std::list<AudioPipe*> pendingDisconnects;
   static std::list<AudioPipe*> pendingWrites;
   static log_emit_function logger;
+  static TlsSessionCache tlsSessions;
 
   static std::mutex mapMutex;
   static std::unordered_map<std::thread::id, bool> stopFlags;
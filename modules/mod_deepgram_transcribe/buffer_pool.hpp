@@ -0,0 +1,73 @@
+#ifndef __BUFFER_POOL_HPP__
+#define __BUFFER_POOL_HPP__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * slab pool of heap buffers in power-of-two size classes.
+ *
+ * Not thread safe: each lws service context owns one and only touches it from its
+ * service thread.  Released buffers are kept for reuse until the pool is holding
+ * maxCachedBytes, after which they are returned to the heap.
+ */
+class BufferPool {
+public:
+  BufferPool(size_t minSize = 4 * 1024, size_t maxSize = 1024 * 1024, size_t maxCachedBytes = 2 * 1024 * 1024) :
+    m_minSize(minSize), m_maxSize(maxSize), m_maxCachedBytes(maxCachedBytes), m_cachedBytes(0) {
+    size_t classes = 1;
+    for (size_t sz = m_minSize; sz < m_maxSize; sz <<= 1) classes++;
+    m_free.resize(classes);
+  }
+  ~BufferPool() {
+    for (size_t i = 0; i < m_free.size(); i++) {
+      for (size_t j = 0; j < m_free[i].size(); j++) free(m_free[i][j]);
+    }
+  }
+
+  // returns a buffer of at least len bytes and its actual capacity, or nullptr if len is beyond the largest class
+  uint8_t* acquire(size_t len, size_t& capacity) {
+    size_t idx = 0;
+    size_t sz = m_minSize;
+    while (sz < len) {
+      sz <<= 1;
+      idx++;
+    }
+    if (idx >= m_free.size()) return nullptr;
+
+    capacity = sz;
+    if (!m_free[idx].empty()) {
+      uint8_t* buf = m_free[idx].back();
+      m_free[idx].pop_back();
+      m_cachedBytes -= sz;
+      return buf;
+    }
+    return (uint8_t*) malloc(sz);
+  }
+
+  void release(uint8_t* buf, size_t capacity) {
+    if (!buf) return;
+    size_t idx = 0;
+    for (size_t sz = m_minSize; sz < capacity; sz <<= 1) idx++;
+    if (idx >= m_free.size() || m_cachedBytes + capacity > m_maxCachedBytes) {
+      free(buf);
+      return;
+    }
+    m_free[idx].push_back(buf);
+    m_cachedBytes += capacity;
+  }
+
+  // no copying
+  BufferPool(const BufferPool&) = delete;
+  void operator=(const BufferPool&) = delete;
+
+private:
+  size_t m_minSize;
+  size_t m_maxSize;
+  size_t m_maxCachedBytes;
+  size_t m_cachedBytes;
+  std::vector<std::vector<uint8_t*> > m_free;
+};
+
+#endif
@@ -428,6 +428,24 @@ extern "C" {
     return SWITCH_STATUS_FALSE;
   }
 	
+  switch_status_t dg_tls_sessions(switch_stream_handle_t *stream, int flush) {
+    if (flush) deepgram::AudioPipe::flushTlsSessions();
+
+    TlsSessionCache::Stats stats;
+    deepgram::AudioPipe::getTlsSessionStats(stats);
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "entries", stats.entries);
+    cJSON_AddNumberToObject(json, "hits", stats.hits);
+    cJSON_AddNumberToObject(json, "misses", stats.misses);
+    cJSON_AddNumberToObject(json, "stores", stats.stores);
+    char* jsonString = cJSON_PrintUnformatted(json);
+    stream->write_function(stream, "%s\n", jsonString);
+    free(jsonString);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
   switch_status_t dg_transcribe_session_init(switch_core_session_t *session, 
     responseHandler_t responseHandler, uint32_t samples_per_second, uint32_t channels, 
     char* lang, int interim, char* bugname, void **ppUserData)
@@ -171,6 +171,19 @@ SWITCH_STANDARD_API(dg_transcribe_function)
 }
 
 
+#define TLS_API_SYNTAX "[flush]"
+SWITCH_STANDARD_API(dg_tls_function)
+{
+	int flush = !zstr(cmd) && 0 == strcasecmp(cmd, "flush");
+
+	if (!zstr(cmd) && !flush) {
+		stream->write_function(stream, "-USAGE: %s\n", TLS_API_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
+	}
+	dg_tls_sessions(stream, flush);
+	return SWITCH_STATUS_SUCCESS;
+}
+
 SWITCH_MODULE_LOAD_FUNCTION(mod_deepgram_transcribe_load)
 {
 	switch_api_interface_t *api_interface;
@@ -193,6 +206,7 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_deepgram_transcribe_load)
 	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "Deepgram Speech Transcription API successfully loaded\n");
 
 	SWITCH_ADD_API(api_interface, "uuid_deepgram_transcribe", "Deepgram Speech Transcription API", dg_transcribe_function, TRANSCRIBE_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "deepgram_tls_cache", "Deepgram TLS session cache", dg_tls_function, TLS_API_SYNTAX);
 	switch_console_set_complete("add uuid_deepgram_transcribe start lang-code [interim|final] [stereo|mono]");
 	switch_console_set_complete("add uuid_deepgram_transcribe stop ");
 